@@ -6,9 +6,12 @@
 #ifndef CIRCULAR_BUFFER_H_
 #define CIRCULAR_BUFFER_H_
 #include <array>
+#include <atomic>
+#include <algorithm>
 #include <mutex>
 #include <condition_variable>
 #include <chrono>
+#include <cstddef>
 
 namespace nul {
   template <typename T, std::size_t MAX_SIZE>
@@ -114,6 +117,394 @@ namespace nul {
 
       bool interrupted_{false};
   };
+
+  // CircularBuffer for exactly one producer thread and one consumer thread.
+  // put() and take() only touch the index of the other side when the ring
+  // looks full or empty to them, and only take the mutex when it really is,
+  // to park or to wake the other side up. the API is that of
+  // CircularBuffer, except that size() is a snapshot
+  template <typename T, std::size_t MAX_SIZE>
+  class SpscCircularBuffer final {
+    public:
+      static_assert(MAX_SIZE > 0, "MAX_SIZE must be positive");
+
+      // producer thread only
+      bool put(T data) {
+        if (interrupted_.load(std::memory_order_acquire)) {
+          return false;
+        }
+        auto head = head_.load(std::memory_order_relaxed);
+        if (head - cachedTail_ == MAX_SIZE) {
+          cachedTail_ = tail_.load(std::memory_order_acquire);
+          if (head - cachedTail_ == MAX_SIZE) {
+            auto lock = std::unique_lock<std::mutex>(mutex_);
+            park(lock, producerWaiting_, [&]{
+              cachedTail_ = tail_.load(std::memory_order_acquire);
+              return head - cachedTail_ < MAX_SIZE;
+            }, -1);
+            if (interrupted_.load(std::memory_order_acquire)) {
+              return false;
+            }
+          }
+        }
+        arr_[head % MAX_SIZE] = std::move(data);
+        head_.store(head + 1, std::memory_order_release);
+        wakeUp(consumerWaiting_);
+        return true;
+      }
+
+      // consumer thread only
+      T take(int waitTimeMillis = -1) {
+        auto tail = tail_.load(std::memory_order_relaxed);
+        if (tail == cachedHead_) {
+          cachedHead_ = head_.load(std::memory_order_acquire);
+          if (tail == cachedHead_) {
+            if (interrupted_.load(std::memory_order_acquire) ||
+                waitTimeMillis == 0) {
+              return T{};
+            }
+            auto lock = std::unique_lock<std::mutex>(mutex_);
+            park(lock, consumerWaiting_, [&]{
+              cachedHead_ = head_.load(std::memory_order_acquire);
+              return tail != cachedHead_;
+            }, waitTimeMillis);
+            if (interrupted_.load(std::memory_order_acquire)) {
+              return T{};
+            }
+          }
+        }
+        return takeOrDefault();
+      }
+
+      // consumer thread only
+      T takeOrDefault() {
+        auto tail = tail_.load(std::memory_order_relaxed);
+        if (tail == cachedHead_) {
+          cachedHead_ = head_.load(std::memory_order_acquire);
+          if (tail == cachedHead_) {
+            return T{};
+          }
+        }
+        T data = std::move(arr_[tail % MAX_SIZE]);
+        tail_.store(tail + 1, std::memory_order_release);
+        wakeUp(producerWaiting_);
+        return data;
+      }
+
+      std::size_t size() const {
+        auto tail = tail_.load(std::memory_order_acquire);
+        return head_.load(std::memory_order_acquire) - tail;
+      }
+
+      bool empty() const {
+        return size() == 0;
+      }
+
+      constexpr std::size_t capacity() const {
+        return MAX_SIZE;
+      }
+
+      bool interrupted() const {
+        return interrupted_.load(std::memory_order_acquire);
+      }
+
+      bool interruptedAndEmpty() const {
+        return interrupted() && empty();
+      }
+
+      // once interrupted, the queue will no longer accept put
+      void interrupt() {
+        auto lock = std::unique_lock<std::mutex>(mutex_);
+        interrupted_.store(true, std::memory_order_release);
+        cond_.notify_all();
+      }
+
+    private:
+      // the flag is raised before each check of ready, and the other side
+      // looks at the flag after it moves its index, with a full fence on
+      // both sides, so one of them sees the other. the waker lowers the
+      // flag, so that a parked side is woken up once, not on every move
+      template <typename Ready>
+      void park(
+        std::unique_lock<std::mutex> &lock, std::atomic<bool> &waiting,
+        Ready &&ready, int waitTimeMillis) {
+        auto deadline = std::chrono::steady_clock::now() +
+          std::chrono::milliseconds(std::max(waitTimeMillis, 0));
+        while (true) {
+          waiting.store(true, std::memory_order_relaxed);
+          std::atomic_thread_fence(std::memory_order_seq_cst);
+          if (interrupted_.load(std::memory_order_acquire) || ready()) {
+            break;
+          }
+          if (waitTimeMillis < 0) {
+            cond_.wait(lock);
+          } else if (cond_.wait_until(lock, deadline) ==
+                     std::cv_status::timeout) {
+            break;
+          }
+        }
+        waiting.store(false, std::memory_order_relaxed);
+      }
+
+      void wakeUp(std::atomic<bool> &waiting) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load(std::memory_order_relaxed)) {
+          // the waiter checks ready under the lock, so this cannot slip in
+          // between its check and its wait
+          std::lock_guard<std::mutex> lock(mutex_);
+          waiting.store(false, std::memory_order_relaxed);
+          cond_.notify_all();
+        }
+      }
+
+    private:
+      static constexpr std::size_t CACHE_LINE_SIZE = 64;
+
+      // keep the producer, the consumer and the waiters on separate cache
+      // lines, padded by hand like MpscQueue, alignas would over-align the
+      // buffer. the indices only grow, the slot is the index modulo
+      // MAX_SIZE
+      char headPadding_[CACHE_LINE_SIZE];
+      std::atomic<std::size_t> head_{0};  // written by put()
+      std::size_t cachedTail_{0};         // put() only
+      char tailPadding_[
+        CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>) -
+        sizeof(std::size_t)];
+      std::atomic<std::size_t> tail_{0};  // written by take()
+      std::size_t cachedHead_{0};         // take() only
+      char waitingPadding_[
+        CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>) -
+        sizeof(std::size_t)];
+      std::atomic<bool> producerWaiting_{false};
+      std::atomic<bool> consumerWaiting_{false};
+      std::atomic<bool> interrupted_{false};
+      std::condition_variable cond_;
+      std::mutex mutex_;
+      std::array<T, MAX_SIZE> arr_;
+  };
+
+  // bounded CircularBuffer for any number of producers and consumers, the
+  // queue of Dmitry Vyukov: every slot carries a sequence number that says
+  // whose turn it is, so a put or take claims a position with one CAS and
+  // never waits for another thread while the ring is neither full nor
+  // empty. tryPut()/tryTake() never block, put()/take() park on a full or
+  // empty ring like CircularBuffer, which only costs the other side a
+  // mutex while somebody is parked. size() is a snapshot
+  template <typename T, std::size_t MAX_SIZE>
+  class MpmcCircularBuffer final {
+    public:
+      // with a single slot, a full slot and an empty one look the same
+      static_assert(MAX_SIZE >= 2, "MAX_SIZE must be at least 2");
+
+      MpmcCircularBuffer() {
+        for (std::size_t i = 0; i < MAX_SIZE; ++i) {
+          slots_[i].seq.store(i, std::memory_order_relaxed);
+        }
+      }
+
+      MpmcCircularBuffer(const MpmcCircularBuffer &) = delete;
+      MpmcCircularBuffer &operator=(const MpmcCircularBuffer &) = delete;
+
+      // fails if the ring is full or interrupted, data is only moved from
+      // if it is put
+      bool tryPut(T &&data) {
+        if (interrupted_.load(std::memory_order_acquire)) {
+          return false;
+        }
+        auto pos = putPos_.load(std::memory_order_relaxed);
+        while (true) {
+          auto &slot = slots_[pos % MAX_SIZE];
+          auto seq = slot.seq.load(std::memory_order_acquire);
+          auto diff = static_cast<std::ptrdiff_t>(seq - pos);
+          if (diff == 0) {
+            if (putPos_.compare_exchange_weak(
+                  pos, pos + 1, std::memory_order_relaxed)) {
+              slot.data = std::move(data);
+              slot.seq.store(pos + 1, std::memory_order_release);
+              wakeUp(consumers_);
+              return true;
+            }
+          } else if (diff < 0) {
+            return false;  // the slot still holds the data of a lap ago
+          } else {
+            pos = putPos_.load(std::memory_order_relaxed);
+          }
+        }
+      }
+
+      bool tryPut(const T &data) {
+        auto copy = data;
+        return tryPut(std::move(copy));
+      }
+
+      // fails if the ring is empty
+      bool tryTake(T &data) {
+        auto pos = takePos_.load(std::memory_order_relaxed);
+        while (true) {
+          auto &slot = slots_[pos % MAX_SIZE];
+          auto seq = slot.seq.load(std::memory_order_acquire);
+          auto diff = static_cast<std::ptrdiff_t>(seq - (pos + 1));
+          if (diff == 0) {
+            if (takePos_.compare_exchange_weak(
+                  pos, pos + 1, std::memory_order_relaxed)) {
+              data = std::move(slot.data);
+              slot.seq.store(pos + MAX_SIZE, std::memory_order_release);
+              wakeUp(producers_);
+              return true;
+            }
+          } else if (diff < 0) {
+            return false;  // the slot is yet to be put
+          } else {
+            pos = takePos_.load(std::memory_order_relaxed);
+          }
+        }
+      }
+
+      // waits for room, returns false once interrupted
+      bool put(T data) {
+        while (!tryPut(std::move(data))) {
+          if (interrupted_.load(std::memory_order_acquire)) {
+            return false;
+          }
+          park(producers_, [this]{
+            return size() < MAX_SIZE;
+          }, -1);
+        }
+        return true;
+      }
+
+      T take(int waitTimeMillis = -1) {
+        T data{};
+        if (tryTake(data) || waitTimeMillis == 0) {
+          return data;
+        }
+        auto deadline = std::chrono::steady_clock::now() +
+          std::chrono::milliseconds(std::max(waitTimeMillis, 0));
+        while (!interrupted_.load(std::memory_order_acquire)) {
+          auto ready = park(consumers_, [this]{
+            return size() > 0;
+          }, waitTimeMillis, deadline);
+          if (interrupted_.load(std::memory_order_acquire)) {
+            break;
+          }
+          // another consumer may have been quicker
+          if (tryTake(data) || !ready) {
+            break;
+          }
+        }
+        return data;
+      }
+
+      T takeOrDefault() {
+        T data{};
+        tryTake(data);
+        return data;
+      }
+
+      std::size_t size() const {
+        auto takePos = takePos_.load(std::memory_order_acquire);
+        auto putPos = putPos_.load(std::memory_order_acquire);
+        // the positions are read one after the other
+        return putPos > takePos ? std::min(putPos - takePos, MAX_SIZE) : 0;
+      }
+
+      bool empty() const {
+        return size() == 0;
+      }
+
+      constexpr std::size_t capacity() const {
+        return MAX_SIZE;
+      }
+
+      bool interrupted() const {
+        return interrupted_.load(std::memory_order_acquire);
+      }
+
+      bool interruptedAndEmpty() const {
+        return interrupted() && empty();
+      }
+
+      // once interrupted, the queue will no longer accept put, what is in
+      // it can still be taken
+      void interrupt() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        interrupted_.store(true, std::memory_order_release);
+        producers_.cond.notify_all();
+        consumers_.cond.notify_all();
+      }
+
+    private:
+      struct Waiters {
+        std::atomic<int> waiting{0};
+        // notifications sent since a waiter last woke up, while every
+        // waiter has one coming the others need not send any
+        std::atomic<int> notified{0};
+        std::condition_variable cond;
+      };
+
+      // the waiter is counted before it checks ready, and the other side
+      // looks at the count after it moves a slot, with a full fence on both
+      // sides, so one of them sees the other. returns false on timeout
+      template <typename Ready>
+      bool park(
+        Waiters &waiters, Ready &&ready, int waitTimeMillis,
+        std::chrono::steady_clock::time_point deadline = {}) {
+        auto lock = std::unique_lock<std::mutex>(mutex_);
+        waiters.waiting.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto result = true;
+        while (!interrupted_.load(std::memory_order_acquire) && !ready()) {
+          if (waitTimeMillis < 0) {
+            waiters.cond.wait(lock);
+          } else if (waiters.cond.wait_until(lock, deadline) ==
+                     std::cv_status::timeout) {
+            result = interrupted_.load(std::memory_order_acquire) || ready();
+            waiters.notified.store(0, std::memory_order_relaxed);
+            break;
+          }
+          waiters.notified.store(0, std::memory_order_relaxed);
+        }
+        waiters.waiting.fetch_sub(1, std::memory_order_relaxed);
+        return result;
+      }
+
+      void wakeUp(Waiters &waiters) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.waiting.load(std::memory_order_relaxed) >
+            waiters.notified.load(std::memory_order_relaxed)) {
+          // the waiter checks ready under the lock, so this cannot slip in
+          // between its check and its wait
+          std::lock_guard<std::mutex> lock(mutex_);
+          if (waiters.waiting.load(std::memory_order_relaxed) >
+              waiters.notified.load(std::memory_order_relaxed)) {
+            waiters.notified.fetch_add(1, std::memory_order_relaxed);
+            waiters.cond.notify_one();
+          }
+        }
+      }
+
+    private:
+      struct Slot {
+        std::atomic<std::size_t> seq;
+        T data;
+      };
+
+      static constexpr std::size_t CACHE_LINE_SIZE = 64;
+
+      // the positions, the waiters and the slots on separate cache lines,
+      // padded by hand like MpscQueue rather than over-aligning the buffer
+      char putPadding_[CACHE_LINE_SIZE];
+      std::atomic<std::size_t> putPos_{0};
+      char takePadding_[CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>)];
+      std::atomic<std::size_t> takePos_{0};
+      char waitersPadding_[CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>)];
+      Waiters producers_;  // parked on a full ring
+      Waiters consumers_;  // parked on an empty ring
+      std::atomic<bool> interrupted_{false};
+      std::mutex mutex_;
+      char slotsPadding_[CACHE_LINE_SIZE];
+      std::array<Slot, MAX_SIZE> slots_;
+  };
 } /* end of namespace: nul */
 
 #endif /* end of include guard: CIRCULAR_BUFFER_H_ */
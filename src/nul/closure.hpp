@@ -0,0 +1,148 @@
+/*******************************************************************************
+**          File: closure.hpp
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-16 Fri 04:05 PM
+**   Description: move-only void() callable with inline storage, callables
+**                that fit in INLINE_SIZE bytes are stored without allocating
+*******************************************************************************/
+#ifndef CLOSURE_H_
+#define CLOSURE_H_
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+namespace nul {
+
+  class Closure final {
+    public:
+      static constexpr std::size_t INLINE_SIZE = 48;
+
+      Closure() = default;
+      Closure(std::nullptr_t) {}
+
+      template <typename F, typename Fn = typename std::decay<F>::type,
+               typename = typename std::enable_if<
+                 !std::is_same<Fn, Closure>::value>::type>
+      Closure(F &&f) {
+        init<Fn>(std::forward<F>(f), IsInline<Fn>{});
+      }
+
+      Closure(Closure &&other) noexcept {
+        moveFrom(other);
+      }
+
+      Closure &operator=(Closure &&other) noexcept {
+        if (this != &other) {
+          reset();
+          moveFrom(other);
+        }
+        return *this;
+      }
+
+      Closure(const Closure &) = delete;
+      Closure &operator=(const Closure &) = delete;
+
+      ~Closure() {
+        reset();
+      }
+
+      void operator()() {
+        ops_->invoke(&storage_);
+      }
+
+      explicit operator bool() const {
+        return ops_ != nullptr;
+      }
+
+      void reset() {
+        if (ops_) {
+          ops_->destroy(&storage_);
+          ops_ = nullptr;
+        }
+      }
+
+    private:
+      using Storage = typename std::aligned_storage<
+        INLINE_SIZE, alignof(std::max_align_t)>::type;
+
+      struct Ops {
+        void (*invoke)(void *storage);
+        void (*move)(void *dst, void *src);  // move src to dst, destroy src
+        void (*destroy)(void *storage);
+      };
+
+      template <typename Fn>
+      using IsInline = std::integral_constant<bool,
+        sizeof(Fn) <= INLINE_SIZE &&
+        alignof(std::max_align_t) % alignof(Fn) == 0 &&
+        std::is_nothrow_move_constructible<Fn>::value>;
+
+      template <typename Fn>
+      struct InlineOps {
+        static void invoke(void *storage) {
+          (*static_cast<Fn *>(storage))();
+        }
+        static void move(void *dst, void *src) {
+          new (dst) Fn(std::move(*static_cast<Fn *>(src)));
+          static_cast<Fn *>(src)->~Fn();
+        }
+        static void destroy(void *storage) {
+          static_cast<Fn *>(storage)->~Fn();
+        }
+        static constexpr Ops ops{invoke, move, destroy};
+      };
+
+      // callables that are too large live on the heap, storage_ keeps the
+      // pointer to it
+      template <typename Fn>
+      struct HeapOps {
+        static Fn *&get(void *storage) {
+          return *static_cast<Fn **>(storage);
+        }
+        static void invoke(void *storage) {
+          (*get(storage))();
+        }
+        static void move(void *dst, void *src) {
+          new (dst) Fn *(get(src));
+        }
+        static void destroy(void *storage) {
+          delete get(storage);
+        }
+        static constexpr Ops ops{invoke, move, destroy};
+      };
+
+      template <typename Fn, typename F>
+      void init(F &&f, std::true_type) {
+        new (&storage_) Fn(std::forward<F>(f));
+        ops_ = &InlineOps<Fn>::ops;
+      }
+
+      template <typename Fn, typename F>
+      void init(F &&f, std::false_type) {
+        new (&storage_) Fn *(new Fn(std::forward<F>(f)));
+        ops_ = &HeapOps<Fn>::ops;
+      }
+
+      void moveFrom(Closure &other) {
+        if (other.ops_) {
+          other.ops_->move(&storage_, &other.storage_);
+          ops_ = other.ops_;
+          other.ops_ = nullptr;
+        }
+      }
+
+    private:
+      Storage storage_;
+      const Ops *ops_{nullptr};
+  };
+
+  template <typename Fn>
+  constexpr Closure::Ops Closure::InlineOps<Fn>::ops;
+
+  template <typename Fn>
+  constexpr Closure::Ops Closure::HeapOps<Fn>::ops;
+
+} /* end of namespace: nul */
+
+#endif /* end of include guard: CLOSURE_H_ */
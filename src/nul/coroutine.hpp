@@ -0,0 +1,177 @@
+/*******************************************************************************
+**          File: coroutine.hpp
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-16 Fri 09:30 PM
+**   Description: C++20 coroutines that run on a Looper, awaiting a TaskQueue
+**                posts one recycled task that resumes the coroutine
+*******************************************************************************/
+#ifndef COROUTINE_H_
+#define COROUTINE_H_
+#include "looper.hpp"
+
+#ifdef NUL_HAS_COROUTINES
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <utility>
+
+namespace nul {
+
+  // a coroutine that starts right away and destroys itself when it
+  // finishes, nobody waits for it.
+  //
+  //   nul::Coroutine serve(nul::TaskQueue &tq, int fd) {
+  //     co_await tq.schedule();        // now on the looper thread
+  //     while (co_await tq.waitFd(fd, Looper::FD_EVENT_READ) != 0) {
+  //       ...
+  //       co_await tq.sleepFor(1000);
+  //     }
+  //   }
+  //
+  // when the task that would resume the coroutine is dropped (removed,
+  // detached, looper stopped), the coroutine is destroyed instead, so the
+  // destructors of its locals run. frames of coroutines started on a
+  // looper thread come from the looper's arena, see
+  // Looper::enableFrameArena()
+  class Coroutine final {
+    public:
+      struct promise_type {
+        Coroutine get_return_object() noexcept { return Coroutine(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() { std::terminate(); }
+
+        static void *operator new(std::size_t size) {
+          return FrameArena::allocateFrame(Looper::getCurrentFrameArena(), size);
+        }
+
+        static void operator delete(void *frame, std::size_t size) {
+          FrameArena::freeFrame(frame, size);
+        }
+      };
+
+      // the task that resumes a suspended coroutine, 8 bytes, it fits in
+      // the inline storage of a task
+      class Resumer final {
+        public:
+          explicit Resumer(std::coroutine_handle<> handle) : handle_(handle) {}
+          Resumer(Resumer &&other) noexcept :
+            handle_(std::exchange(other.handle_, nullptr)) {}
+          Resumer &operator=(Resumer &&) = delete;
+
+          ~Resumer() {
+            if (handle_) {
+              handle_.destroy();
+            }
+          }
+
+          void operator()() {
+            std::exchange(handle_, nullptr).resume();
+          }
+
+          // let go of the coroutine without destroying it
+          void release() noexcept {
+            handle_ = nullptr;
+          }
+
+        private:
+          std::coroutine_handle<> handle_;
+      };
+  };
+
+  class TaskQueue::ScheduleAwaiter final {
+    public:
+      explicit ScheduleAwaiter(TaskQueue &tq) : tq_(tq) {}
+
+      bool await_ready() const noexcept {
+        return false;
+      }
+
+      void await_suspend(std::coroutine_handle<> handle) {
+        tq_.post(Coroutine::Resumer(handle), PostSite());
+      }
+
+      void await_resume() const noexcept {}
+
+    private:
+      TaskQueue &tq_;
+  };
+
+  class TaskQueue::SleepAwaiter final {
+    public:
+      SleepAwaiter(TaskQueue &tq, int64_t delayUs) :
+        tq_(tq), delayUs_(delayUs) {}
+
+      bool await_ready() const noexcept {
+        return false;
+      }
+
+      void await_suspend(std::coroutine_handle<> handle) {
+        tq_.postDelayed(delayUs_, Coroutine::Resumer(handle), PostSite());
+      }
+
+      void await_resume() const noexcept {}
+
+    private:
+      TaskQueue &tq_;
+      int64_t delayUs_;
+  };
+
+  // resumes with the ready FdEvent bits, or 0 right away if the fd cannot
+  // be watched. the fd is unwatched before the coroutine resumes. the watch
+  // owns the coroutine, which is destroyed with it if the fd is unwatched
+  // first (the queue is detached, the looper stops)
+  class TaskQueue::FdAwaiter final {
+    public:
+      FdAwaiter(TaskQueue &tq, int fd, int events) :
+        tq_(tq), fd_(fd), events_(events) {}
+
+      bool await_ready() const noexcept {
+        return false;
+      }
+
+      bool await_suspend(std::coroutine_handle<> handle) {
+        // the callback may resume the coroutine on the looper thread before
+        // watchFd() returns, the frame must not be touched afterwards
+        auto resumer = std::make_shared<Coroutine::Resumer>(handle);
+        if (tq_.watchFd(fd_, events_, [this, resumer](int fd, int events){
+              tq_.unwatchFd(fd);
+              readyEvents_ = events;
+              (*resumer)();
+            })) {
+          return true;
+        }
+        // not watched, the coroutine goes on right away
+        resumer->release();
+        return false;
+      }
+
+      int await_resume() const noexcept {
+        return readyEvents_;
+      }
+
+    private:
+      TaskQueue &tq_;
+      int fd_;
+      int events_;
+      int readyEvents_{0};
+  };
+
+  inline TaskQueue::ScheduleAwaiter TaskQueue::schedule() {
+    return ScheduleAwaiter(*this);
+  }
+
+  inline TaskQueue::SleepAwaiter TaskQueue::sleepFor(int64_t delayUs) {
+    return SleepAwaiter(*this, delayUs);
+  }
+
+  inline TaskQueue::FdAwaiter TaskQueue::waitFd(int fd, int events) {
+    return FdAwaiter(*this, fd, events);
+  }
+
+} /* end of namespace: nul */
+
+#endif /* NUL_HAS_COROUTINES */
+
+#endif /* end of include guard: COROUTINE_H_ */
@@ -0,0 +1,114 @@
+/*******************************************************************************
+**          File: frame_arena.hpp
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-16 Fri 09:30 PM
+**   Description: pools of recycled blocks for coroutine frames, a few size
+**                classes backed by NodePools, larger frames use the heap
+*******************************************************************************/
+#ifndef FRAME_ARENA_H_
+#define FRAME_ARENA_H_
+#include <atomic>
+#include <cstddef>
+#include <new>
+
+#include "node_pool.hpp"
+
+namespace nul {
+
+  // a frame is preceded by a header that records the arena it came from, so
+  // it can be freed on any thread. every frame holds a reference to its
+  // arena, which is destroyed with the last frame or owner reference
+  class FrameArena final {
+    public:
+      static constexpr std::size_t HEADER_SIZE = alignof(std::max_align_t);
+      static constexpr std::size_t MIN_BLOCK_SIZE = 128;
+      static constexpr int SIZE_CLASS_COUNT = 5;  // 128 to 2048 bytes
+
+      FrameArena() = default;
+      FrameArena(const FrameArena &) = delete;
+      FrameArena &operator=(const FrameArena &) = delete;
+
+      void retain() {
+        refs_.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      void release() {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          delete this;
+        }
+      }
+
+      // arena may be null, the frame then comes from the heap
+      static void *allocateFrame(FrameArena *arena, std::size_t size) {
+        auto total = size + HEADER_SIZE;
+        auto sizeClass = sizeClassOf(total);
+        void *block;
+        if (arena && sizeClass < SIZE_CLASS_COUNT) {
+          block = arena->allocate(sizeClass);
+          arena->retain();
+        } else {
+          block = ::operator new(total);
+          arena = nullptr;
+        }
+        *static_cast<FrameArena **>(block) = arena;
+        return static_cast<char *>(block) + HEADER_SIZE;
+      }
+
+      // size must be the one the frame was allocated with
+      static void freeFrame(void *frame, std::size_t size) {
+        auto block = static_cast<char *>(frame) - HEADER_SIZE;
+        auto arena = *reinterpret_cast<FrameArena **>(block);
+        if (!arena) {
+          ::operator delete(block);
+          return;
+        }
+        arena->deallocate(sizeClassOf(size + HEADER_SIZE), block);
+        arena->release();
+      }
+
+    private:
+      template <std::size_t N>
+      struct Block {
+        alignas(std::max_align_t) unsigned char bytes[N];
+      };
+
+      static int sizeClassOf(std::size_t size) {
+        if (size <= MIN_BLOCK_SIZE) {
+          return 0;
+        }
+        // the index of the smallest power of two >= size, minus that of 128
+        return 64 - __builtin_clzll(size - 1) - 7;
+      }
+
+      void *allocate(int sizeClass) {
+        switch (sizeClass) {
+          case 0: return pool128_.acquire();
+          case 1: return pool256_.acquire();
+          case 2: return pool512_.acquire();
+          case 3: return pool1024_.acquire();
+          default: return pool2048_.acquire();
+        }
+      }
+
+      void deallocate(int sizeClass, void *block) {
+        switch (sizeClass) {
+          case 0: pool128_.release(static_cast<Block<128> *>(block)); break;
+          case 1: pool256_.release(static_cast<Block<256> *>(block)); break;
+          case 2: pool512_.release(static_cast<Block<512> *>(block)); break;
+          case 3: pool1024_.release(static_cast<Block<1024> *>(block)); break;
+          default: pool2048_.release(static_cast<Block<2048> *>(block)); break;
+        }
+      }
+
+    private:
+      std::atomic<int> refs_{1};  // the owner and the live frames
+      NodePool<Block<128>> pool128_;
+      NodePool<Block<256>> pool256_;
+      NodePool<Block<512>> pool512_;
+      NodePool<Block<1024>> pool1024_;
+      NodePool<Block<2048>> pool2048_;
+  };
+
+} /* end of namespace: nul */
+
+#endif /* end of include guard: FRAME_ARENA_H_ */
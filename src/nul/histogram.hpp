@@ -0,0 +1,88 @@
+/*******************************************************************************
+**          File: histogram.hpp
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-16 Fri 07:20 PM
+**   Description: fixed-size histogram with power-of-two buckets, recording
+**                a value costs a few instructions and never allocates
+*******************************************************************************/
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+#include <cstdint>
+#include <algorithm>
+
+namespace nul {
+
+  // bucket 0 holds the values <= 0, bucket i holds [2^(i-1), 2^i), the
+  // last bucket also holds everything above. not thread-safe
+  class Histogram final {
+    public:
+      static constexpr int BUCKET_COUNT = 40;
+
+      void record(int64_t value) {
+        ++buckets_[bucketOf(value)];
+        ++count_;
+        sum_ += value;
+        max_ = std::max(max_, value);
+      }
+
+      void reset() {
+        *this = Histogram();
+      }
+
+      uint64_t count() const {
+        return count_;
+      }
+
+      uint64_t bucketCount(int bucket) const {
+        return buckets_[bucket];
+      }
+
+      int64_t max() const {
+        return max_;
+      }
+
+      double mean() const {
+        return count_ == 0 ? 0 : static_cast<double>(sum_) / count_;
+      }
+
+      // an upper bound of the value below which the given percent (0 to
+      // 100) of the recorded values fall, accurate to a factor of 2
+      int64_t percentile(double percent) const {
+        if (count_ == 0) {
+          return 0;
+        }
+        auto rank = static_cast<uint64_t>(percent / 100 * count_);
+        rank = std::min(std::max<uint64_t>(rank, 1), count_);
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKET_COUNT - 1; ++i) {
+          seen += buckets_[i];
+          if (seen >= rank) {
+            return std::min(upperBound(i), max_);
+          }
+        }
+        return max_;
+      }
+
+    private:
+      static int bucketOf(int64_t value) {
+        if (value <= 0) {
+          return 0;
+        }
+        auto bucket = 64 - __builtin_clzll(static_cast<uint64_t>(value));
+        return std::min(bucket, BUCKET_COUNT - 1);
+      }
+
+      static int64_t upperBound(int bucket) {
+        return bucket == 0 ? 0 : (int64_t{1} << bucket) - 1;
+      }
+
+    private:
+      uint64_t buckets_[BUCKET_COUNT]{};
+      uint64_t count_{0};
+      int64_t sum_{0};
+      int64_t max_{0};
+  };
+
+} /* end of namespace: nul */
+
+#endif /* end of include guard: HISTOGRAM_H_ */
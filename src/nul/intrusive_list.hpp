@@ -0,0 +1,148 @@
+/*******************************************************************************
+**          File: intrusive_list.hpp
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-16 Fri 03:40 PM
+**   Description: intrusive doubly linked list, an object can be linked into
+**                several lists at the same time through differently tagged
+**                hooks, linking and unlinking never allocate
+*******************************************************************************/
+#ifndef INTRUSIVE_LIST_H_
+#define INTRUSIVE_LIST_H_
+#include <cstddef>
+#include <cassert>
+
+namespace nul {
+
+  template <typename T, typename Tag> class IntrusiveList;
+
+  // Tag only distinguishes the hooks of an object that lives in more than
+  // one list, any (incomplete) type will do
+  template <typename Tag>
+  class ListHook {
+    public:
+      bool isLinked() const {
+        return linked_;
+      }
+
+    private:
+      template <typename T, typename U> friend class IntrusiveList;
+
+      ListHook *prev_{nullptr};
+      ListHook *next_{nullptr};
+      bool linked_{false};
+  };
+
+  template <typename T, typename Tag>
+  class IntrusiveList final {
+    using Hook = ListHook<Tag>;
+
+    public:
+      IntrusiveList() = default;
+      IntrusiveList(const IntrusiveList &) = delete;
+      IntrusiveList &operator=(const IntrusiveList &) = delete;
+
+      bool empty() const {
+        return head_ == nullptr;
+      }
+
+      std::size_t size() const {
+        return size_;
+      }
+
+      T *front() const {
+        return head_ ? toObject(head_) : nullptr;
+      }
+
+      T *back() const {
+        return tail_ ? toObject(tail_) : nullptr;
+      }
+
+      static T *next(T *obj) {
+        auto hook = static_cast<Hook *>(obj)->next_;
+        return hook ? toObject(hook) : nullptr;
+      }
+
+      void pushBack(T *obj) {
+        auto hook = static_cast<Hook *>(obj);
+        assert(!hook->linked_);
+        hook->linked_ = true;
+        hook->prev_ = tail_;
+        hook->next_ = nullptr;
+        if (tail_) {
+          tail_->next_ = hook;
+        } else {
+          head_ = hook;
+        }
+        tail_ = hook;
+        ++size_;
+      }
+
+      T *popFront() {
+        auto obj = front();
+        if (obj) {
+          remove(obj);
+        }
+        return obj;
+      }
+
+      void remove(T *obj) {
+        auto hook = static_cast<Hook *>(obj);
+        assert(hook->linked_);
+        if (hook->prev_) {
+          hook->prev_->next_ = hook->next_;
+        } else {
+          head_ = hook->next_;
+        }
+        if (hook->next_) {
+          hook->next_->prev_ = hook->prev_;
+        } else {
+          tail_ = hook->prev_;
+        }
+        hook->prev_ = hook->next_ = nullptr;
+        hook->linked_ = false;
+        --size_;
+      }
+
+      // move all objects of other to the end of this list
+      void splice(IntrusiveList &other) {
+        if (other.empty()) {
+          return;
+        }
+        if (tail_) {
+          tail_->next_ = other.head_;
+          other.head_->prev_ = tail_;
+        } else {
+          head_ = other.head_;
+        }
+        tail_ = other.tail_;
+        size_ += other.size_;
+        other.head_ = other.tail_ = nullptr;
+        other.size_ = 0;
+      }
+
+      // visit every object, visitor is allowed to unlink the object that is
+      // being visited
+      template <typename Visitor>
+      void forEach(Visitor &&visitor) {
+        auto hook = head_;
+        while (hook) {
+          auto next = hook->next_;
+          visitor(toObject(hook));
+          hook = next;
+        }
+      }
+
+    private:
+      static T *toObject(Hook *hook) {
+        return static_cast<T *>(hook);
+      }
+
+    private:
+      Hook *head_{nullptr};
+      Hook *tail_{nullptr};
+      std::size_t size_{0};
+  };
+
+} /* end of namespace: nul */
+
+#endif /* end of include guard: INTRUSIVE_LIST_H_ */
@@ -11,62 +11,342 @@
 #include <mutex>
 #include <condition_variable>
 #include <functional>
-#include <queue>
-#include <deque>
 #include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
 #include <pthread.h>
+#include <sched.h>
+#include <limits.h>
 
 #include "spin_lock.hpp"
+#include "closure.hpp"
+#include "node_pool.hpp"
+#include "mpsc_queue.hpp"
+#include "timer_wheel.hpp"
+#include "intrusive_list.hpp"
+#include "histogram.hpp"
+#include "task_future.hpp"
+#include "frame_arena.hpp"
+#include "task_bound.hpp"
+#include "trace.hpp"
 #include "cpp11_compat.hpp"
 
 #ifdef __ANDROID__
 #include <sys/prctl.h>
 #endif
 
-namespace {
-  class Task {
-    public:
-      Task(void *marker, int identity, std::function<void()> &&call) :
-        marker(marker), identity(identity), call(std::move(call)) {}
+// C++20 coroutines, see coroutine.hpp
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define NUL_HAS_COROUTINES 1
+#endif
+#endif
 
-      void *marker;
-      int identity; // a number to name this task, zero if unamed
-      std::function<void()> call;
-  };
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
-  class TimedTask : public Task {
+namespace {
+  struct ReadyQueueTag;
+  struct MarkerTag;
+  struct IdentityTag;
+  struct MarkerIndex;
+
+  // the same node type serves immediate and delayed tasks, so that all of
+  // them can be recycled through one pool
+  class Task :
+    public nul::MpscNode,
+    public nul::TimerNode,
+    public nul::ListHook<ReadyQueueTag>,
+    public nul::ListHook<MarkerTag>,
+    public nul::ListHook<IdentityTag> {
     public:
-      TimedTask(
+      Task(
         void *marker,
         int identity,
-        int64_t triggerTimeUs,
+        int64_t dueTimeUs,
         int64_t intervalUs,
-        std::function<void()> &&call) :
-        Task(marker, identity, std::move(call)),
-        triggerTimeUs(triggerTimeUs),
-        intervalUs(intervalUs) {}
+        nul::Closure &&call) :
+        marker(marker),
+        identity(identity),
+        dueTimeUs(dueTimeUs),
+        intervalUs(intervalUs),
+        call(std::move(call)) {
+      }
 
-      int64_t triggerTimeUs;
+      void *marker;
+      int identity; // a number to name this task, zero if unamed
+      // a timed task may run anywhere in [dueTimeUs, dueTimeUs + slackUs],
+      // the timer wheel is keyed by the end of that range (triggerTimeUs)
+      int64_t dueTimeUs;
+      int64_t slackUs{0}; // or Looper::TIMER_SLACK_PRECISE
       int64_t intervalUs; // zero if no repeat
-      bool isRemoved{false};
+      int repeatPolicy{0}; // Looper::RepeatPolicy bits of repeated tasks
+      uint32_t maxCatchUp{0}; // see TaskQueue::setRepeatPolicy()
+      int64_t enqueueTimeUs{0}; // set for immediate tasks if metrics are on
+      int priority{1}; // Looper::TaskPriority of immediate tasks, NORMAL
+      int64_t expireTimeUs{0}; // discarded if still queued by then, 0 never
+      // the bounds an immediate task holds a slot in while it is queued
+      nul::TaskBound *queueBound{nullptr};
+      bool inLooperBound{false};
+      // posted with a delay, whatever time the clock gives dueTimeUs
+      bool isTimed{false};
+      // the removal epoch seen by a post on the looper's own thread, see
+      // Looper::pushLocalTask()
+      uint64_t removalEpoch{0};
+      // where the task was posted, if known, see nul::PostSite
+      const char *postFile{nullptr};
+      int postLine{0};
+      uint64_t flowId{0}; // links the post to the run in a trace
+      // set when the task is removed while sitting in a batch that the
+      // looper is running without the lock
+      std::atomic<bool> isRemoved{false};
+      nul::Closure call;
+
+      // where the task is indexed while it is pending, see Looper::index_
+      MarkerIndex *markerIndex{nullptr};
+      nul::IntrusiveList<Task, IdentityTag> *identityList{nullptr};
   };
+
+  using ReadyQueue = nul::IntrusiveList<Task, ReadyQueueTag>;
+  using MarkerList = nul::IntrusiveList<Task, MarkerTag>;
+  using IdentityList = nul::IntrusiveList<Task, IdentityTag>;
+
+  // pending tasks of one marker, split the ways they can be removed
+  struct MarkerIndex {
+    MarkerList nonRepeated;
+    MarkerList repeated;
+    IdentityList unnamed;
+    std::unordered_map<int, IdentityList> named;
+    std::size_t namedSweepSize{16};
+
+    bool empty() const {
+      return nonRepeated.empty() && repeated.empty();
+    }
+  };
+
+  // emptied entries are kept so that a key that comes back does not cost an
+  // allocation, they are swept once the map doubles, which keeps the map
+  // within twice the number of keys that have pending tasks
+  template <typename Map, typename IsEmpty>
+  void sweepEmptyEntries(Map &map, std::size_t &sweepSize, IsEmpty &&isEmpty) {
+    if (map.size() < sweepSize) {
+      return;
+    }
+    for (auto it = map.begin(); it != map.end(); ) {
+      if (isEmpty(it->second)) {
+        it = map.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    sweepSize = std::max(sweepSize, map.size() * 2);
+  }
 }
 
 namespace nul {
 
   class TaskQueue;
+  class LooperGroup;
+  class LooperWatchdog;
+  class ManualLooper;
+  class Coroutine;
+
+  // how Looper::start() creates the looper thread
+  struct LooperOptions {
+    // the CPUs the thread may run on, empty for all of them. Linux only,
+    // ignored on Android and elsewhere
+    std::vector<int> cpuAffinity;
+    // 1 to 99 runs the thread with SCHED_FIFO at that priority, which
+    // usually requires CAP_SYS_NICE, 0 keeps the default policy
+    int fifoPriority{0};
+    // the nice value of the thread under the default policy, Linux only.
+    // best effort, a negative value is silently dropped without permission
+    int niceValue{0};
+    // 0 for the default stack size
+    std::size_t stackSize{0};
+  };
   class Looper final : public std::enable_shared_from_this<Looper> {
     friend class TaskQueue;
+    friend class LooperGroup;
+    friend class LooperWatchdog;
+    friend class ManualLooper;
+    friend class Coroutine;
+    public:
+      // runs strands, loopers that have no thread of their own, see
+      // LooperGroup. it is only called when a strand turns from parked to
+      // runnable, so a strand is never scheduled twice at the same time
+      class Scheduler {
+        public:
+          virtual ~Scheduler() = default;
+          // the strand has work to do, call runSlice() on it soon
+          virtual void schedule(const std::shared_ptr<Looper> &strand) = 0;
+          // call onWakeUpDue() on the strand after delayUs
+          virtual void scheduleAfter(
+            const std::shared_ptr<Looper> &strand, int64_t delayUs) = 0;
+      };
+
+      // the time of timers, task expiry and the latencies in Metrics, in
+      // microseconds, it must never go backwards, see setClock()
+      class Clock {
+        public:
+          virtual ~Clock() = default;
+          virtual int64_t nowUs() = 0;
+      };
+
     private:
-      Looper(const std::string &name = "") : name_(name) { }
+#ifdef __linux__
+      struct FdWatcher;
+      using FdWatchers = std::vector<std::shared_ptr<FdWatcher>>;
+#endif
+
+      Looper(const std::string &name = "") : name_(name) {
+        registerLooper(this);
+#ifdef __linux__
+        epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+        wakeupFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        auto event = epoll_event{};
+        event.events = EPOLLIN;
+        event.data.u64 = WAKEUP_EVENT_DATA;
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, wakeupFd_, &event);
+
+        timerFd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        event.data.u64 = TIMER_EVENT_DATA;
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, timerFd_, &event);
+#endif
+      }
+
+      // a strand starts parked, it is woken up through the scheduler, and
+      // cannot watch fds
+      Looper(const std::string &name, const std::weak_ptr<Scheduler> &scheduler) :
+        name_(name), scheduler_(scheduler), isStrand_(true) {
+        parked_ = true;
+        registerLooper(this);
+      }
 
     public:
+      enum FdEvent {
+        FD_EVENT_READ = 1 << 0,
+        FD_EVENT_WRITE = 1 << 1,
+        FD_EVENT_ERROR = 1 << 2,  // reported only, error or hang-up
+      };
+
+      // called on the looper thread with the FdEvent bits that are ready
+      using FdCallback = std::function<void(int fd, int events)>;
+
+      // lanes of immediate tasks, a lane is served only when the ones above
+      // it are empty, except that a lane that has been passed over
+      // MAX_PASSED_OVER times in a row gets one task in. idle tasks are not
+      // protected, they run once per idle period, when no other task is
+      // ready, see TaskQueue::postIdle()
+      enum TaskPriority {
+        PRIORITY_URGENT = 0,
+        PRIORITY_NORMAL,
+        PRIORITY_BACKGROUND,
+        PRIORITY_IDLE,
+      };
+
+      static constexpr int PRIORITY_COUNT = PRIORITY_IDLE + 1;
+      static constexpr int MAX_PASSED_OVER = 8;
+
+      // what a post does when it finds the looper or its TaskQueue full,
+      // see setCapacity()
+      enum OverflowPolicy {
+        OVERFLOW_REJECT,       // the post fails
+        OVERFLOW_BLOCK,        // the producer waits for room
+        OVERFLOW_DROP_OLDEST,  // the oldest queued task is discarded
+      };
+
+      // how a coalesced post merges with a pending task of the same queue
+      // and identity, one COALESCE_KEEP_* bit or'ed with one
+      // COALESCE_*_DEADLINE bit, see TaskQueue::postCoalesced()
+      enum CoalescePolicy {
+        COALESCE_KEEP_FIRST = 0,           // the pending callable runs
+        COALESCE_KEEP_LAST = 1 << 0,       // the new callable replaces it
+        COALESCE_EARLIEST_DEADLINE = 0,    // timed tasks, the sooner wins
+        COALESCE_LATEST_DEADLINE = 1 << 1, // timed tasks, the later wins
+      };
+
+      // how a repeated task is scheduled again after a run, one REPEAT_FIXED_*
+      // mode or'ed with one policy for the runs that a fixed rate task
+      // missed because the looper was busy or stalled, see
+      // TaskQueue::setRepeatPolicy()
+      enum RepeatPolicy {
+        REPEAT_FIXED_RATE = 0,            // runs at delay + n * interval
+        REPEAT_FIXED_DELAY = 1 << 0,      // runs interval after a run ends
+        REPEAT_CATCH_UP = 0,              // missed runs go back to back
+        REPEAT_SKIP_MISSED = 1 << 1,      // the next run is the next tick
+        REPEAT_COALESCE_MISSED = 1 << 2,  // one run for all of them, now
+      };
+
+      // slack of timed tasks that must not fire late, on Linux the looper
+      // then waits with a timerfd instead of the millisecond timeout of
+      // epoll_wait() while such tasks are pending
+      static constexpr int64_t TIMER_SLACK_PRECISE = -1;
+
+      // all durations are in microseconds
+      struct TaskMetrics {
+        uint64_t executedTasks{0};
+        nul::Histogram queueLatency;   // post to start, immediate tasks
+        nul::Histogram timerLateness;  // trigger time to start, timed tasks
+        nul::Histogram runTime;
+      };
+
+      struct QueueMetrics : TaskMetrics {
+        const void *marker{nullptr};   // the TaskQueue
+        std::size_t pendingTasks{0};   // immediate and timed
+      };
+
+      struct Metrics : TaskMetrics {
+        int64_t timeUs{0};             // when the snapshot was taken
+        std::size_t pendingTasks{0};   // immediate tasks
+        std::size_t pendingTimers{0};  // timed tasks, including repeated ones
+        double tasksPerSecond{0};      // since the previous snapshot
+        uint64_t stalledTasks{0};      // reported by a LooperWatchdog
+        std::vector<QueueMetrics> queues;
+      };
+
       ~Looper() {
+        unregisterLooper(this);
         std::unique_lock<std::mutex> lock(mutex_);
-        if (t_) {
+        if (hasThread_) {
           lock.unlock();
           stop();
-          t_->join();
+          pthread_join(thread_, nullptr);
+        }
+
+#ifdef __linux__
+        if (epollFd_ >= 0) {
+          close(timerFd_);
+          close(wakeupFd_);
+          close(epollFd_);
+        }
+#endif
+
+        drainSubmissionsLocked();
+        while (auto node = localSubmissions_.popFront()) {
+          recycleTask(static_cast<Task *>(node));
+        }
+        for (auto &lane : q_) {
+          while (auto task = lane.popFront()) {
+            recycleTask(task);
+          }
+        }
+        timers_.forEach([this](nul::TimerNode *node){
+          timers_.remove(node);
+          recycleTask(static_cast<Task *>(node));
+        });
+
+        // frames that are still alive keep the arena
+        if (auto arena = frameArena_.load(std::memory_order_acquire)) {
+          arena->release();
         }
       }
 
@@ -83,230 +363,1706 @@ namespace nul {
         return std::shared_ptr<Looper>(new Looper(name));
       }
 
-      static std::shared_ptr<Looper> getCurrent() {
-        auto looper = pthread_getspecific(getThreadLocalLooperKey());
-        if (looper) {
-          return reinterpret_cast<Looper *>(looper)->shared_from_this();
+      static std::shared_ptr<Looper> getCurrent() {
+        auto looper = currentLooper();
+        return looper ? looper->shared_from_this() : nullptr;
+      }
+
+      // whether the calling thread is running this looper (or strand), a
+      // thread_local read, cheaper than comparing getCurrent()
+      bool isCurrentThread() const {
+        return currentLooper() == this;
+      }
+
+      // returns false if the thread cannot be created with the options,
+      // the looper is then left stopped. options do not apply to strands
+      bool start(const LooperOptions &options = LooperOptions()) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (isStrand_) {
+          running_ = true;
+        } else if (!hasThread_) {
+          options_ = options;
+          running_ = true;
+          hasThread_ = createThread();
+          running_ = hasThread_;
+        }
+        return running_;
+      }
+
+      void stop() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (running_) {
+          running_ = false;
+        }
+        // producers blocked on a full looper give up
+        bound_.wakeWaiters();
+        // a parked strand runs once more to drop its pending tasks
+        if (!isStrand_ || parked_.exchange(false, std::memory_order_seq_cst)) {
+          wakeUp();
+        }
+      }
+
+      std::string getName() const {
+        return name_;
+      }
+
+      bool isRunning() const {
+        return running_;
+      }
+
+      // watch fd for readiness (level-triggered), callback runs on the looper
+      // thread, so socket I/O, tasks and timers share one thread. an fd can
+      // only be watched once, it must be unwatched before it is closed.
+      // after unwatchFd() returns on the looper thread the callback is not
+      // called again, when called from another thread, a callback that is
+      // already being dispatched may still run once. marker is the
+      // TaskQueue that watches fd, if any, see unwatchFds(). the watches
+      // are dropped when the looper stops. Linux only (epoll), returns
+      // false elsewhere
+      bool watchFd(
+        int fd, int events, FdCallback callback, void *marker = nullptr) {
+#ifdef __linux__
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (fdWatchers_.find(fd) != fdWatchers_.end()) {
+          return false;
+        }
+
+        auto watcher = std::make_shared<FdWatcher>();
+        watcher->seq = ++fdWatcherSeq_;
+        watcher->marker = marker;
+        watcher->callback = std::move(callback);
+        if (!epollCtl(EPOLL_CTL_ADD, fd, events, watcher->seq)) {
+          return false;
+        }
+        fdWatchers_.emplace(fd, std::move(watcher));
+        return true;
+#else
+        return false;
+#endif
+      }
+
+      bool updateFd(int fd, int events) {
+#ifdef __linux__
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = fdWatchers_.find(fd);
+        return it != fdWatchers_.end() &&
+          epollCtl(EPOLL_CTL_MOD, fd, events, it->second->seq);
+#else
+        return false;
+#endif
+      }
+
+      // the callback is destroyed without the lock, it may own a suspended
+      // coroutine, see TaskQueue::waitFd()
+      bool unwatchFd(int fd) {
+#ifdef __linux__
+        std::shared_ptr<FdWatcher> watcher;
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = fdWatchers_.find(fd);
+        if (it == fdWatchers_.end()) {
+          return false;
+        }
+        watcher = std::move(it->second);
+        fdWatchers_.erase(it);
+        epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+        hasFdWatchers_ = !fdWatchers_.empty();
+        return true;
+#else
+        return false;
+#endif
+      }
+
+      // unwatch the fds that marker watches, a detached TaskQueue has no
+      // callback of its own called any more
+      void unwatchFds(void *marker) {
+#ifdef __linux__
+        FdWatchers unwatched;
+        std::lock_guard<std::mutex> lock(mutex_);
+        takeFdWatchersLocked(marker, unwatched);
+#endif
+      }
+
+      // the maximum number of ready tasks the loop takes under one lock
+      // acquisition, 1 (the default) takes one task at a time and runs
+      // timers only when no ready task is pending. with a larger size, every
+      // batch also takes up to batchSize expired timers, so that a burst of
+      // ready tasks cannot starve them
+      void setBatchSize(std::size_t batchSize) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        batchSize_ = batchSize > 0 ? batchSize : 1;
+      }
+
+      // bound the number of queued immediate tasks (timed tasks count once
+      // they fire), 0 (the default) for no bound. a post that finds the
+      // looper full is handled by the policy, OVERFLOW_DROP_OLDEST discards
+      // the oldest task of the lowest non-empty lane. OVERFLOW_BLOCK never
+      // blocks the looper's own thread, which would wait for itself, such
+      // posts get in beyond the bound. only the tasks posted after the bound
+      // is set count against it. see also TaskQueue::setCapacity()
+      void setCapacity(
+        std::size_t capacity, OverflowPolicy policy = OVERFLOW_REJECT) {
+        bound_.setCapacity(capacity, policy);
+      }
+
+      // poll for new work for up to maxSpinUs before parking, so that a post
+      // to an idle looper does not pay for the wakeup (a futex wake and a
+      // scheduler hop). producers never wake up a spinning looper. the
+      // window adapts to how soon work arrives after the looper goes idle,
+      // and shrinks to nothing while it arrives later than maxSpinUs. 0 (the
+      // default) parks right away, which suits loopers that run batch work.
+      // strands do not spin, and neither do loopers on a single CPU, where
+      // spinning only delays the producer
+      void setMaxIdleSpin(int64_t maxSpinUs) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        maxSpinUs_ = std::thread::hardware_concurrency() > 1 && !clock_ ?
+          std::max<int64_t>(maxSpinUs, 0) : 0;
+        spinUs_ = maxSpinUs_;
+      }
+
+      // replace the monotonic clock, before anything is posted. the looper
+      // still sleeps in real time, for the span its clock says, so a clock
+      // that is moved by hand only suits a looper that is run by hand, see
+      // ManualLooper. a looper with a clock does not spin
+      void setClock(const std::shared_ptr<Clock> &clock) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        clock_ = clock;
+        if (clock_) {
+          maxSpinUs_ = spinUs_ = 0;
+        }
+      }
+
+      // metrics are off by default, when on, every task costs three clock
+      // reads and an uncontended lock on the looper thread, while snapshots
+      // are only paid for by the reader
+      void setMetricsEnabled(bool enabled) {
+        std::lock_guard<std::mutex> lock(metricsMutex_);
+        if (enabled && !metricsEnabled_) {
+          lastSnapshotUs_ = nowUs();
+          lastExecutedTasks_ = metrics_.executedTasks;
+        }
+        metricsEnabled_ = enabled;
+      }
+
+      Metrics getMetrics() {
+        auto result = Metrics{};
+        result.timeUs = nowUs();
+        auto pendingByMarker = std::unordered_map<void *, std::size_t>{};
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          drainSubmissionsLocked();
+          for (auto &lane : q_) {
+            result.pendingTasks += lane.size();
+          }
+          result.pendingTimers = timers_.size();
+          for (auto &entry : index_) {
+            if (!entry.second.empty()) {
+              pendingByMarker[entry.first] = entry.second.nonRepeated.size() +
+                entry.second.repeated.size();
+            }
+          }
+        }
+
+        std::lock_guard<std::mutex> lock(metricsMutex_);
+        static_cast<TaskMetrics &>(result) = metrics_;
+        auto elapsedUs = result.timeUs - lastSnapshotUs_;
+        if (metricsEnabled_ && elapsedUs > 0) {
+          result.tasksPerSecond =
+            (metrics_.executedTasks - lastExecutedTasks_) * 1e6 / elapsedUs;
+        }
+        lastSnapshotUs_ = result.timeUs;
+        lastExecutedTasks_ = metrics_.executedTasks;
+        result.stalledTasks = stalledTasks_.load(std::memory_order_relaxed);
+
+        for (auto &entry : queueMetrics_) {
+          auto queue = QueueMetrics{};
+          static_cast<TaskMetrics &>(queue) = entry.second;
+          queue.marker = entry.first;
+          auto it = pendingByMarker.find(entry.first);
+          if (it != pendingByMarker.end()) {
+            queue.pendingTasks = it->second;
+            pendingByMarker.erase(it);
+          }
+          result.queues.push_back(std::move(queue));
+        }
+        // queues that have pending tasks but nothing executed yet
+        for (auto &entry : pendingByMarker) {
+          auto queue = QueueMetrics{};
+          queue.marker = entry.first;
+          queue.pendingTasks = entry.second;
+          result.queues.push_back(std::move(queue));
+        }
+        return result;
+      }
+
+      // allocate the frames of coroutines that are started on this looper
+      // from recycled blocks instead of the heap, see coroutine.hpp. the
+      // arena cannot be disabled, it never shrinks
+      void enableFrameArena() {
+        if (frameArena_.load(std::memory_order_acquire)) {
+          return;
+        }
+        auto arena = new nul::FrameArena();
+        nul::FrameArena *expected = nullptr;
+        if (!frameArena_.compare_exchange_strong(
+              expected, arena, std::memory_order_acq_rel)) {
+          arena->release();
+        }
+      }
+
+    private:
+      // tasks are recycled, so steady-state posting does not allocate
+      template <typename ...Args>
+      Task *obtainTask(Args &&...args) {
+        return taskPool_.acquire(std::forward<Args>(args)...);
+      }
+
+      void recycleTask(Task *task) {
+        releaseBounds(task);
+        taskPool_.release(task);
+      }
+
+      // lock-free, producers only touch mutex_ when the looper is parked or
+      // full. queueBound and detached are those of the posting TaskQueue,
+      // if any
+      bool postTask(
+        Task *task, nul::TaskBound *queueBound = nullptr,
+        const std::atomic<bool> *detached = nullptr) {
+        if (!running_ || !admitTask(task, queueBound, detached)) {
+          recycleTask(task);
+          return false;
+        }
+        if (metricsEnabled_.load(std::memory_order_relaxed)) {
+          task->enqueueTimeUs = clockNowUs();
+        }
+        if (isCurrentThread()) {
+          postLocalTask(task);
+          return true;
+        }
+        submissions_.push(task);
+        wakeUpIfParked();
+        dropPendingTasksIfStopped();
+        return true;
+      }
+
+      // the local list is drained ahead of the shared submissions, so the
+      // shared ones that can be seen now, which were posted before task,
+      // are moved to the lanes first. otherwise a task posted in reaction
+      // to a post from another thread (it saw a flag that was set after
+      // that post) would run ahead of it. only the lock holder may call
+      // empty(), removals drain the submissions from other threads
+      void postLocalTask(Task *task) {
+        if (!submissions_.drained()) {
+          std::lock_guard<std::mutex> lock(mutex_);
+          drainSubmissionsLocked();
+        }
+        pushLocalTask(task);
+      }
+
+      // a post from a task (or fd callback) of this looper neither touches
+      // the shared submissions nor wakes anybody up, the looper drains its
+      // local list before it parks. removals from other threads cannot look
+      // into the list, they leave a record that the looper applies to the
+      // tasks whose post did not see the record's epoch
+      void pushLocalTask(Task *task) {
+        if (localSubmissions_.empty()) {
+          // pairs with recordRemovalLocked(), a removal that does not see
+          // the flag is seen by the epoch below
+          hasLocalSubmissions_.store(true, std::memory_order_seq_cst);
+        }
+        task->removalEpoch = removalEpoch_.load(std::memory_order_seq_cst);
+        localSubmissions_.pushBack(task);
+      }
+
+      // the timed tasks are added under one lock acquisition, the immediate
+      // ones are pushed at once, and the looper is woken up at most once.
+      // returns the number of tasks that are posted, the others are
+      // recycled
+      std::size_t postBatch(
+        nul::MpscChain &immediate, nul::MpscChain &timed,
+        nul::TaskBound *queueBound, const std::atomic<bool> *detached) {
+        auto posted = std::size_t{0};
+        if (!timed.empty()) {
+          std::lock_guard<std::mutex> lock(mutex_);
+          while (auto node = timed.popFront()) {
+            posted += postTimedTaskLocked(static_cast<Task *>(node));
+          }
+        }
+
+        // admission may block or drop tasks, so it goes task by task
+        nul::MpscChain admitted;
+        auto enqueueTimeUs =
+          metricsEnabled_.load(std::memory_order_relaxed) ? clockNowUs() : 0;
+        auto isLocal = isCurrentThread();
+        while (auto node = immediate.popFront()) {
+          auto task = static_cast<Task *>(node);
+          if (!running_ || !admitTask(task, queueBound, detached)) {
+            recycleTask(task);
+            continue;
+          }
+          task->enqueueTimeUs = enqueueTimeUs;
+          if (isLocal) {
+            postLocalTask(task);
+          } else {
+            admitted.pushBack(task);
+          }
+          ++posted;
+        }
+        if (!admitted.empty()) {
+          submissions_.push(admitted);
+          wakeUpIfParked();
+          dropPendingTasksIfStopped();
+        }
+        return posted;
+      }
+
+      // only the producer that clears the flag pays for the wakeup
+      void wakeUpIfParked() {
+        if (parked_.load(std::memory_order_seq_cst) &&
+            parked_.exchange(false, std::memory_order_seq_cst)) {
+#ifdef __linux__
+          wakeUp();
+#else
+          std::lock_guard<std::mutex> lock(mutex_);
+          wakeUp();
+#endif
+        }
+      }
+
+      bool postTimedTask(Task *timedTask) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return postTimedTaskLocked(timedTask);
+      }
+
+      // post task unless a pending task of the same kind (immediate or
+      // timed, not repeated) has its marker and identity, which then absorbs
+      // it following policy, see CoalescePolicy. the index is looked up
+      // before the task takes its slots in the bounds, which may block, and
+      // once more afterwards, when another post may have got in first
+      bool postCoalescedTask(
+        Task *task, nul::TaskBound *queueBound,
+        const std::atomic<bool> *detached, int policy) {
+        auto isTimed = task->isTimed;
+        auto merged = false;
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          merged = coalesceTaskLocked(task, policy);
+          if (!merged && isTimed) {
+            return postTimedTaskLocked(task);
+          }
+        }
+        if (!merged && running_ && admitTask(task, queueBound, detached)) {
+          {
+            std::lock_guard<std::mutex> lock(mutex_);
+            merged = coalesceTaskLocked(task, policy);
+            if (!merged) {
+              // pushed under the lock, so that the next coalesced post
+              // finds it in the index
+              if (metricsEnabled_.load(std::memory_order_relaxed)) {
+                task->enqueueTimeUs = clockNowUs();
+              }
+              // coalesceTaskLocked() drained the submissions that were
+              // posted before, see postLocalTask()
+              if (isCurrentThread()) {
+                pushLocalTask(task);
+                return true;
+              }
+              submissions_.push(task);
+            }
+          }
+          if (!merged) {
+            wakeUpIfParked();
+            dropPendingTasksIfStopped();
+            return true;
+          }
+        }
+        // the callable that lost is destroyed without the lock, it may be
+        // a coroutine whose locals post tasks
+        recycleTask(task);
+        return merged;
+      }
+
+      // take a slot in each bound that is set, following its policy. the
+      // slots taken are recorded in the task, so recycling it gives them
+      // back even if it is rejected halfway
+      bool admitTask(
+        Task *task, nul::TaskBound *queueBound,
+        const std::atomic<bool> *detached) {
+        if (queueBound && queueBound->capacity() > 0) {
+          if (!acquireSlot(*queueBound, task->marker)) {
+            return false;
+          }
+          queueBound->retain();
+          task->queueBound = queueBound;
+        }
+        if (bound_.capacity() > 0) {
+          if (!acquireSlot(bound_, nullptr, detached)) {
+            return false;
+          }
+          task->inLooperBound = true;
+        }
+        return true;
+      }
+
+      // marker is the TaskQueue that owns bound, or null for the looper's.
+      // a post that waits for room gives up once its queue is detached,
+      // detachFromLooper() waits for it, maybe on the looper's thread
+      bool acquireSlot(
+        nul::TaskBound &bound, void *marker,
+        const std::atomic<bool> *detached = nullptr) {
+        uint32_t seen;
+        while (!bound.tryAcquire(seen)) {
+          if (bound.isClosed() || !running_ ||
+              (detached && detached->load(std::memory_order_seq_cst))) {
+            return false;
+          }
+          switch (bound.policy()) {
+            case OVERFLOW_BLOCK:
+              if (isCurrentThread()) {
+                bound.acquire();
+                return true;
+              }
+              // a TaskQueue bound is not woken up when the looper stops,
+              // so look at running_ (and detached) every now and then
+              bound.waitForRoom(seen, 10000);
+              break;
+
+            case OVERFLOW_DROP_OLDEST: {
+              std::lock_guard<std::mutex> lock(mutex_);
+              drainSubmissionsLocked();
+              if (!dropOldestLocked(marker)) {
+                // the tasks that fill the bound are still being posted
+                bound.acquire();
+                return true;
+              }
+              break;
+            }
+
+            default:
+              return false;
+          }
+        }
+        return true;
+      }
+
+      // discard the oldest queued immediate task of marker, or that of the
+      // lowest non-empty lane if marker is null
+      bool dropOldestLocked(void *marker) {
+        if (!marker) {
+          for (int lane = PRIORITY_IDLE; lane >= 0; --lane) {
+            if (!q_[lane].empty()) {
+              removeTaskLocked(q_[lane].front());
+              return true;
+            }
+          }
+          return false;
+        }
+
+        auto it = index_.find(marker);
+        if (it == index_.end()) {
+          return false;
+        }
+        // posting order, timed tasks are skipped
+        for (auto task = it->second.nonRepeated.front(); task;
+             task = MarkerList::next(task)) {
+          if (static_cast<nul::ListHook<ReadyQueueTag> *>(task)->isLinked()) {
+            removeTaskLocked(task);
+            return true;
+          }
+        }
+        return false;
+      }
+
+      void releaseBounds(Task *task) {
+        if (task->queueBound) {
+          task->queueBound->release();
+          task->queueBound->unref();
+          task->queueBound = nullptr;
+        }
+        if (task->inLooperBound) {
+          bound_.release();
+          task->inLooperBound = false;
+        }
+      }
+
+      // the main lock must be held when calling this function
+      bool postTimedTaskLocked(Task *timedTask) {
+        if (!running_) {
+          recycleTask(timedTask);
+          return false;
+        }
+
+        // an empty wheel may lag far behind, catch it up so the new timer
+        // is put in a slot that matches its real distance
+        if (timers_.empty()) {
+          timers_.advance(clockNowUs());
+          maxSlackUs_ = 0;
+        }
+
+        if (timedTask->slackUs == TIMER_SLACK_PRECISE) {
+          ++preciseTimerCount_;
+        } else {
+          maxSlackUs_ = std::max(maxSlackUs_, timedTask->slackUs);
+        }
+        timedTask->triggerTimeUs =
+          timedTask->dueTimeUs + std::max<int64_t>(timedTask->slackUs, 0);
+
+        // wake up the looper only when the new task expires before all the
+        // others
+        auto nextTimeUs = timers_.nextTimeUs();
+        auto triggerTimeUs = timedTask->triggerTimeUs;
+        timers_.add(timedTask);
+        indexTaskLocked(timedTask);
+        if (isStrand_) {
+          // a strand that is not parked arms its wakeup when it parks
+          if (parked_.load(std::memory_order_seq_cst)) {
+            if (triggerTimeUs > clockNowUs()) {
+              armWakeUpLocked(triggerTimeUs);
+            } else if (parked_.exchange(false, std::memory_order_seq_cst)) {
+              wakeUp();
+            }
+          }
+        } else if (nextTimeUs < 0 || triggerTimeUs < nextTimeUs) {
+          if (parked_.exchange(false, std::memory_order_relaxed)) {
+            wakeUp();
+          } else {
+            // a spinning looper picks the new deadline up without a wakeup
+            timerAdded_.store(true, std::memory_order_relaxed);
+          }
+        }
+        return true;
+      }
+
+      // the cost of removal is proportional to the number of removed tasks,
+      // pending tasks are indexed by marker and identity, only the current
+      // batch (bounded by the batch size) has to be scanned
+      void removePendingTasks(void *marker, int identity) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        drainSubmissionsLocked();
+
+        auto it = index_.find(marker);
+        if (it != index_.end()) {
+          auto &markerIndex = it->second;
+          auto list = &markerIndex.unnamed;
+          if (identity != 0) {
+            auto namedIt = markerIndex.named.find(identity);
+            list = namedIt != markerIndex.named.end() ? &namedIt->second : nullptr;
+          }
+          while (list && !list->empty()) {
+            removeTaskLocked(list->front());
+          }
+        }
+
+        recordRemovalLocked(marker, identity, false);
+        markRemovedInBatch([marker, identity](const Task &task){
+          return marker == task.marker && identity == task.identity;
+        });
+      }
+
+      void removeAllPendingTasks(void *marker) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        drainSubmissionsLocked();
+
+        auto it = index_.find(marker);
+        if (it != index_.end()) {
+          auto &markerIndex = it->second;
+          while (auto task = markerIndex.nonRepeated.front()) {
+            removeTaskLocked(task);
+          }
+          while (auto task = markerIndex.repeated.front()) {
+            removeTaskLocked(task);
+          }
+        }
+
+        recordRemovalLocked(marker, 0, true);
+        markRemovedInBatch([marker](const Task &task){
+          return marker == task.marker;
+        });
+      }
+
+      // remove all tasks that do not have identities
+      void removeAllUnamedPendingTasks(void *marker) {
+        removePendingTasks(marker, 0);
+      }
+
+      void removeAllNonRepeatedTasks(void *marker) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        drainSubmissionsLocked();
+
+        auto it = index_.find(marker);
+        if (it != index_.end()) {
+          while (auto task = it->second.nonRepeated.front()) {
+            removeTaskLocked(task);
+          }
+        }
+
+        // the local submissions are immediate tasks, none is repeated
+        recordRemovalLocked(marker, 0, true);
+        markRemovedInBatch([marker](const Task &task){
+          return marker == task.marker && task.intervalUs == 0;
+        });
+      }
+
+    private:
+      void run() {
+        currentLooper() = this;
+        setThreadName(name_);
+#ifdef __linux__
+        // nice values are per thread on Linux
+        if (options_.niceValue != 0 && options_.fifoPriority == 0) {
+          setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)),
+                      options_.niceValue);
+        }
+#endif
+
+        auto lock = std::unique_lock<std::mutex>(mutex_);
+        auto spun = false;  // the current idle period has spun in vain
+        auto idleSinceUs = int64_t{0};
+        while (running_) {
+          finishBatchLocked();
+          drainSubmissionsLocked();
+
+          auto now = collectBatchLocked();
+          if (!batch_.empty()) {
+            spun = false;
+            lock.unlock();
+            runBatch();
+            // do not let a busy loop starve the watched fds
+            if (hasFdWatchers_) {
+              pollFds(0);
+            }
+            lock.lock();
+            continue;
+          }
+
+          // an expired task that was discarded may have posted one
+          if (!localSubmissions_.empty()) {
+            continue;
+          }
+
+          // other threads may have moved submissions to the lanes while we
+          // spun without the lock (removals drain them), so collect again
+          // before parking
+          if (spinUs_ > 0 && !spun) {
+            spun = true;
+            idleSinceUs = now;
+            if (spinLocked(lock, now, timers_.nextTimeUs())) {
+              adaptSpinLocked(clockNowUs() - now);
+              idleRan_ = false;
+              spun = false;
+            }
+            continue;
+          }
+
+          // producers only wake up a parked looper, so raise the flag
+          // before the final emptiness check
+          parked_.store(true, std::memory_order_seq_cst);
+          if (submissions_.empty() && localSubmissions_.empty()) {
+            auto waitStartUs = nul::Tracer::isEnabled() ? nowUs() : 0;
+            waitLocked(lock, now, timers_.nextTimeUs());
+            if (waitStartUs > 0) {
+              traceWait(waitStartUs, nowUs() - waitStartUs);
+            }
+          }
+          parked_.store(false, std::memory_order_relaxed);
+          if (maxSpinUs_ > 0) {
+            adaptSpinLocked(clockNowUs() - (spun ? idleSinceUs : now));
+          }
+          spun = false;
+          // whatever woke us up starts a new idle period
+          idleRan_ = false;
+        }
+        finishBatchLocked();
+        dropPendingTasks(lock);
+      }
+
+      // run one batch of a strand on the calling thread, returns true if the
+      // strand still has work and must be scheduled again, otherwise the
+      // strand parks and arms a wakeup for its earliest timer. the scheduler
+      // guarantees that slices of the same strand never overlap
+      bool runSlice() {
+        auto previous = currentLooper();
+        currentLooper() = this;
+
+        auto lock = std::unique_lock<std::mutex>(mutex_);
+        drainSubmissionsLocked();
+        collectBatchLocked();
+        if (!batch_.empty()) {
+          lock.unlock();
+          runBatch();
+          lock.lock();
+          finishBatchLocked();
+          drainSubmissionsLocked();
+        }
+
+        // a stopped strand runs once more to drop its tasks
+        if (!running_) {
+          dropPendingTasks(lock);
+        }
+        auto nextTimeUs = timers_.nextTimeUs();
+        auto hasWork = hasReadyTasksLocked() ||
+          (nextTimeUs >= 0 && nextTimeUs <= clockNowUs());
+        if (!hasWork) {
+          // same protocol as run(), producers that came in before the flag
+          // was raised did not schedule the strand
+          parked_.store(true, std::memory_order_seq_cst);
+          idleRan_ = false;
+          if (!submissions_.empty() &&
+              parked_.exchange(false, std::memory_order_seq_cst)) {
+            hasWork = true;
+          } else if (nextTimeUs >= 0) {
+            armWakeUpLocked(nextTimeUs);
+          }
+        }
+        lock.unlock();
+
+        currentLooper() = previous;
+        return hasWork;
+      }
+
+      // called by the scheduler when a wakeup armed by a strand is due
+      void onWakeUpDue() {
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          armedTimeUs_ = -1;
+        }
+        if (parked_.exchange(false, std::memory_order_seq_cst)) {
+          wakeUp();
+        }
+      }
+
+      // ask the scheduler to wake the strand up at timeUs, unless an earlier
+      // wakeup is already armed, the main lock must be held
+      void armWakeUpLocked(int64_t timeUs) {
+        if (armedTimeUs_ >= 0 && armedTimeUs_ <= timeUs) {
+          return;
+        }
+        if (auto scheduler = scheduler_.lock()) {
+          armedTimeUs_ = timeUs;
+          scheduler->scheduleAfter(
+            shared_from_this(), std::max<int64_t>(timeUs - clockNowUs(), 0));
+        }
+      }
+
+      // move up to batchSize_ ready tasks to batch_, in batch mode expired
+      // timers are taken as well (up to batchSize_ of them), so that a burst
+      // of ready tasks cannot starve the timers, otherwise timers are only
+      // taken when no ready task is pending. returns the time used to check
+      // the timers. the main lock must be held
+      int64_t collectBatchLocked() {
+        auto expiryNow = int64_t{0};
+        while (batch_.size() < batchSize_) {
+          auto task = popReadyTaskLocked();
+          if (!task) {
+            break;
+          }
+          takeReadyTaskLocked(task, expiryNow);
+        }
+
+        auto now = int64_t{0};
+        if (batchSize_ > 1 || batch_.empty()) {
+          now = clockNowUs();
+          auto limit = batch_.size() + batchSize_;
+          while (batch_.size() < limit) {
+            auto task = popDueTimerLocked(now);
+            if (!task) {
+              break;
+            }
+            unindexTaskLocked(task);
+            if (nul::Tracer::isEnabled()) {
+              traceEvent(nul::Tracer::EVENT_TIMER, *task, now,
+                         now - task->dueTimeUs);
+            }
+            batch_.pushBack(task);
+          }
+        }
+
+        // an idle period runs all the idle tasks that are pending when it
+        // begins, those posted by idle tasks wait for the next period,
+        // otherwise an idle task that posts itself again keeps us spinning
+        auto &idleLane = q_[PRIORITY_IDLE];
+        if (!batch_.empty()) {
+          idleRan_ = false;
+        } else if (!idleRan_ && !idleLane.empty()) {
+          idleRan_ = true;
+          while (!idleLane.empty()) {
+            takeReadyTaskLocked(idleLane.popFront(), expiryNow);
+          }
+        }
+        return now;
+      }
+
+      // move a task that has left its lane to the batch, unless it has
+      // expired, expiryNow is read from the clock once per batch
+      void takeReadyTaskLocked(Task *task, int64_t &expiryNow) {
+        unindexTaskLocked(task);
+        releaseBounds(task);
+        if (task->expireTimeUs > 0) {
+          if (expiryNow == 0) {
+            expiryNow = clockNowUs();
+          }
+          if (expiryNow >= task->expireTimeUs) {
+            recycleTask(task);
+            return;
+          }
+        }
+        batch_.pushBack(task);
+      }
+
+      // the first task of the highest non-empty lane, unless a lower lane
+      // has waited too long. the main lock must be held
+      Task *popReadyTaskLocked() {
+        for (int lane = PRIORITY_IDLE - 1; lane > 0; --lane) {
+          if (passedOver_[lane] >= MAX_PASSED_OVER && !q_[lane].empty()) {
+            passedOver_[lane] = 0;
+            return q_[lane].popFront();
+          }
+        }
+        for (int lane = 0; lane < PRIORITY_IDLE; ++lane) {
+          if (q_[lane].empty()) {
+            passedOver_[lane] = 0;
+            continue;
+          }
+          for (int lower = lane + 1; lower < PRIORITY_IDLE; ++lower) {
+            if (!q_[lower].empty()) {
+              ++passedOver_[lower];
+            }
+          }
+          return q_[lane].popFront();
+        }
+        return nullptr;
+      }
+
+      // whether the next collectBatchLocked() has an immediate task to take,
+      // the main lock must be held
+      bool hasReadyTasksLocked() const {
+        for (int lane = 0; lane < PRIORITY_IDLE; ++lane) {
+          if (!q_[lane].empty()) {
+            return true;
+          }
+        }
+        return !idleRan_ && !q_[PRIORITY_IDLE].empty();
+      }
+
+      // pop the earliest timer if it has to fire now, timers with slack are
+      // taken once they are due, ahead of their deadline, so that the timers
+      // whose ranges overlap share one wakeup, which is scheduled for the
+      // earliest deadline. like the kernel does with hrtimer slack, only the
+      // front of the wheel is checked. the main lock must be held
+      Task *popDueTimerLocked(int64_t now) {
+        auto task = static_cast<Task *>(timers_.popExpired(now));
+        if (!task && maxSlackUs_ > 0) {
+          // no deadline lies further ahead than maxSlackUs_ for a timer
+          // that is due, so this only moves a bounded range to the due list
+          timers_.advance(now + maxSlackUs_);
+          task = static_cast<Task *>(timers_.front());
+          if (task && task->dueTimeUs <= now) {
+            timers_.remove(task);
+          } else {
+            task = nullptr;
+          }
+        }
+        if (task && task->slackUs == TIMER_SLACK_PRECISE) {
+          --preciseTimerCount_;
+        }
+        return task;
+      }
+
+      // batch_ is not modified while it runs, removals that happen in the
+      // meantime flag the tasks through isRemoved instead
+      void runBatch() {
+        auto measure = metricsEnabled_.load(std::memory_order_relaxed);
+        auto tracing = nul::Tracer::isEnabled();
+        auto watched = getWatchdogCount().load(std::memory_order_relaxed) > 0;
+        for (auto task = batch_.front(); task; task = ReadyQueue::next(task)) {
+          if (!running_) {
+            break;
+          }
+          if (task->isRemoved.load(std::memory_order_acquire)) {
+            continue;
+          }
+          auto startUs = tracing || watched ? nowUs() : 0;
+          if (watched) {
+            beginProbe(*task, startUs);
+          }
+          if (measure) {
+            runTaskWithMetrics(task);
+          } else {
+            task->call();
+          }
+          if (watched) {
+            endProbe();
+          }
+          if (tracing) {
+            traceEvent(nul::Tracer::EVENT_TASK, *task, startUs,
+                       nowUs() - startUs);
+            task->flowId = 0;  // the later runs of a repeated task
+          }
+          if (task->intervalUs == 0) {
+            // release whatever the task holds as soon as it is done
+            task->call.reset();
+          }
+        }
+      }
+
+      // the task that runs is published for LooperWatchdog, which reads it
+      // from its own thread, seq is odd while the fields are written
+      void beginProbe(const Task &task, int64_t startUs) {
+        beginProbe(startUs, task.marker, task.identity, task.postFile,
+                   task.postLine, -1);
+      }
+
+      // fd is that of the callback that runs, -1 for a task
+      void beginProbe(
+        int64_t startUs, const void *marker, int identity, const char *file,
+        int line, int fd) {
+        auto seq = probe_.seq.load(std::memory_order_relaxed);
+        probe_.seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        probe_.startUs.store(startUs, std::memory_order_relaxed);
+        probe_.marker.store(marker, std::memory_order_relaxed);
+        probe_.identity.store(identity, std::memory_order_relaxed);
+        probe_.file.store(file, std::memory_order_relaxed);
+        probe_.line.store(line, std::memory_order_relaxed);
+        probe_.fd.store(fd, std::memory_order_relaxed);
+        probe_.thread.store(pthread_self(), std::memory_order_relaxed);
+        probe_.seq.store(seq + 2, std::memory_order_release);
+      }
+
+      void endProbe() {
+        auto seq = probe_.seq.load(std::memory_order_relaxed);
+        probe_.seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        probe_.startUs.store(0, std::memory_order_relaxed);
+        probe_.seq.store(seq + 2, std::memory_order_release);
+      }
+
+      // loopers and strands are registered while they exist, so that a
+      // LooperWatchdog can find them
+      struct Registry {
+        std::mutex mutex;
+        std::vector<Looper *> loopers;
+      };
+
+      static Registry &getRegistry() {
+        static auto registry = new Registry();  // threads may outlive statics
+        return *registry;
+      }
+
+      static void registerLooper(Looper *looper) {
+        auto &registry = getRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.loopers.push_back(looper);
+      }
+
+      static void unregisterLooper(Looper *looper) {
+        auto &registry = getRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        auto &loopers = registry.loopers;
+        loopers.erase(std::remove(loopers.begin(), loopers.end(), looper),
+                      loopers.end());
+      }
+
+      // the number of running LooperWatchdogs, tasks are probed only while
+      // it is not 0
+      static std::atomic<int> &getWatchdogCount() {
+        static std::atomic<int> count{0};
+        return count;
+      }
+
+      // called by TaskQueue when the task is created, which is when it is
+      // posted
+      void setPostSite(Task *task, const nul::PostSite &site) {
+        task->postFile = site.file;
+        task->postLine = site.line;
+        if (nul::Tracer::isEnabled()) {
+          task->flowId = nul::Tracer::nextFlowId();
+          traceEvent(nul::Tracer::EVENT_POST, *task, nowUs(), 0);
+        }
+      }
+
+      void traceEvent(
+        nul::Tracer::EventType type, const Task &task,
+        int64_t timeUs, int64_t durationUs) {
+        nul::Tracer::record(nul::Tracer::Event{
+          timeUs, durationUs, this, task.marker, task.postFile, task.postLine,
+          task.identity, task.flowId, type
+        });
+      }
+
+      void traceWait(int64_t timeUs, int64_t durationUs) {
+        nul::Tracer::record(nul::Tracer::Event{
+          timeUs, durationUs, this, nullptr, nullptr, 0, 0, 0,
+          nul::Tracer::EVENT_WAIT
+        });
+      }
+
+      void runTaskWithMetrics(Task *task) {
+        auto startUs = clockNowUs();
+        task->call();
+        auto endUs = clockNowUs();
+
+        std::lock_guard<std::mutex> lock(metricsMutex_);
+        recordTask(metrics_, *task, startUs, endUs);
+        recordTask(queueMetrics_[task->marker], *task, startUs, endUs);
+      }
+
+      // immediate tasks posted before metrics were turned on have neither
+      // an enqueue time nor a trigger time, only their run time is recorded
+      static void recordTask(
+        TaskMetrics &metrics, const Task &task, int64_t startUs, int64_t endUs) {
+        ++metrics.executedTasks;
+        if (task.enqueueTimeUs > 0) {
+          metrics.queueLatency.record(startUs - task.enqueueTimeUs);
+        } else if (task.isTimed) {
+          metrics.timerLateness.record(startUs - task.dueTimeUs);
+        }
+        metrics.runTime.record(endUs - startUs);
+      }
+
+      QueueMetrics getQueueMetrics(void *marker) {
+        auto result = QueueMetrics{};
+        result.marker = marker;
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          drainSubmissionsLocked();
+          auto it = index_.find(marker);
+          if (it != index_.end()) {
+            result.pendingTasks =
+              it->second.nonRepeated.size() + it->second.repeated.size();
+          }
+        }
+
+        std::lock_guard<std::mutex> lock(metricsMutex_);
+        auto it = queueMetrics_.find(marker);
+        if (it != queueMetrics_.end()) {
+          static_cast<TaskMetrics &>(result) = it->second;
+        }
+        return result;
+      }
+
+      // drop the metrics of a queue that is detached
+      void removeQueueMetrics(void *marker) {
+        std::lock_guard<std::mutex> lock(metricsMutex_);
+        queueMetrics_.erase(marker);
+      }
+
+      // re-arm the repeated tasks of the last batch and recycle the rest,
+      // the main lock must be held
+      void finishBatchLocked() {
+        while (auto task = batch_.popFront()) {
+          if (task->intervalUs > 0 &&
+              !task->isRemoved.load(std::memory_order_relaxed)) {
+            scheduleNextRun(task);
+            postTimedTaskLocked(task);
+          } else {
+            recycleTask(task);
+          }
+        }
+      }
+
+      // the tasks that a stopped looper still has are dropped, which breaks
+      // the futures of those posted with postWithResult(), and so are its fd
+      // watches. the callables are destroyed without the lock, they may
+      // post or remove tasks
+      void dropPendingTasks(std::unique_lock<std::mutex> &lock) {
+        drainSubmissionsLocked();
+        timers_.forEach([this](nul::TimerNode *node){
+          auto task = static_cast<Task *>(node);
+          removeTimerLocked(task);
+          q_[task->priority].pushBack(task);  // dropped with the lanes
+        });
+        ReadyQueue dropped;
+        for (auto &lane : q_) {
+          while (auto task = lane.popFront()) {
+            unindexTaskLocked(task);
+            dropped.pushBack(task);
+          }
+        }
+#ifdef __linux__
+        FdWatchers unwatched;
+        takeFdWatchersLocked(nullptr, unwatched);
+#endif
+        lock.unlock();
+        while (auto task = dropped.popFront()) {
+          recycleTask(task);
+        }
+#ifdef __linux__
+        unwatched.clear();
+#endif
+        lock.lock();
+      }
+
+      // a post that raced with stop() may have been submitted after the
+      // looper dropped its tasks
+      void dropPendingTasksIfStopped() {
+        if (!running_) {
+          auto lock = std::unique_lock<std::mutex>(mutex_);
+          dropPendingTasks(lock);
+        }
+      }
+
+      // move the due time of a repeated task that has run to its next run.
+      // the runs of a fixed rate task that are due already have been
+      // missed, those that are kept run back to back, the others are
+      // dropped, so the task stays on its grid of ticks
+      void scheduleNextRun(Task *task) {
+        auto now = clockNowUs();
+        if (task->repeatPolicy & REPEAT_FIXED_DELAY) {
+          task->dueTimeUs = now + task->intervalUs;
+          return;
+        }
+
+        task->dueTimeUs += task->intervalUs;
+        if (task->dueTimeUs > now) {
+          return;
+        }
+        auto missed = (now - task->dueTimeUs) / task->intervalUs + 1;
+        auto kept = missed;
+        if (task->repeatPolicy & REPEAT_SKIP_MISSED) {
+          kept = 0;
+        } else if (task->repeatPolicy & REPEAT_COALESCE_MISSED) {
+          kept = 1;
+        } else if (task->maxCatchUp > 0) {
+          kept = std::min<int64_t>(missed, task->maxCatchUp);
+        }
+        task->dueTimeUs += (missed - kept) * task->intervalUs;
+      }
+
+      // poll without the lock until a task is submitted, a timer is added,
+      // a watched fd is ready or the spin window (cut short by the next
+      // timer) has passed, returns true unless the window passed
+      bool spinLocked(
+        std::unique_lock<std::mutex> &lock, int64_t now, int64_t nextTimeUs) {
+        auto deadlineUs = now + spinUs_;
+        if (nextTimeUs >= 0) {
+          deadlineUs = std::min(deadlineUs, nextTimeUs);
+        }
+        timerAdded_.store(false, std::memory_order_relaxed);
+        // only the lock holder may look into the submissions
+        auto lastPushed = submissions_.lastPushed();
+        lock.unlock();
+
+        auto found = false;
+        for (uint32_t i = 1; running_; ++i) {
+          if (submissions_.lastPushed() != lastPushed ||
+              timerAdded_.load(std::memory_order_relaxed)) {
+            found = true;
+            break;
+          }
+#ifdef __linux__
+          if (hasFdWatchers_ && pollFds(0) > 0) {
+            found = true;
+            break;
+          }
+#endif
+          if (i % 16 == 0 && clockNowUs() >= deadlineUs) {
+            break;
+          }
+          cpuRelax();
+        }
+
+        lock.lock();
+        return found || !running_;
+      }
+
+      // steer the spin window towards twice the time it takes for work to
+      // arrive after the looper goes idle, halve it when work comes later
+      // than the maximum
+      void adaptSpinLocked(int64_t idleUs) {
+        if (idleUs <= maxSpinUs_) {
+          spinUs_ = std::min(maxSpinUs_, (spinUs_ + idleUs * 2) / 2 + 1);
+        } else {
+          spinUs_ /= 2;
+        }
+      }
+
+      static void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        asm volatile("yield");
+#endif
+      }
+
+      // block until woken up, a watched fd is ready or wakeTimeUs (-1 for
+      // never) comes, the main lock must be held
+      void waitLocked(
+        std::unique_lock<std::mutex> &lock, int64_t now, int64_t wakeTimeUs) {
+        auto timeoutUs = wakeTimeUs < 0 ? -1 : wakeTimeUs - now;
+#ifdef __linux__
+        // epoll_wait() rounds up to milliseconds, precise timers arm the
+        // timerfd instead. a stale expiration only causes a spurious wakeup.
+        // the timerfd runs on CLOCK_MONOTONIC, the time of an injected clock
+        // only makes sense as a timeout
+        if (wakeTimeUs >= 0 && preciseTimerCount_ > 0 && !clock_) {
+          auto spec = itimerspec{};
+          spec.it_value.tv_sec = wakeTimeUs / 1000000;
+          spec.it_value.tv_nsec = (wakeTimeUs % 1000000) * 1000;
+          if (timerfd_settime(timerFd_, TFD_TIMER_ABSTIME, &spec, nullptr) == 0) {
+            timeoutUs = -1;
+          }
+        }
+        lock.unlock();
+        pollFds(timeoutUs);
+        lock.lock();
+#else
+        if (timeoutUs < 0) {
+          cond_.wait(lock);
+        } else {
+          cond_.wait_for(lock, std::chrono::microseconds(timeoutUs));
+        }
+#endif
+      }
+
+      // the main lock must be held, except on Linux and for strands, a
+      // strand must only be woken up by whoever cleared parked_
+      void wakeUp() {
+        if (isStrand_) {
+          if (auto scheduler = scheduler_.lock()) {
+            scheduler->schedule(shared_from_this());
+          }
+          return;
+        }
+#ifdef __linux__
+        uint64_t one = 1;
+        auto n = write(wakeupFd_, &one, sizeof(one));
+        static_cast<void>(n);
+#else
+        cond_.notify_one();
+#endif
+      }
+
+#ifdef __linux__
+      bool epollCtl(int op, int fd, int events, uint32_t seq) {
+        auto event = epoll_event{};
+        event.events =
+          ((events & FD_EVENT_READ) ? uint32_t{EPOLLIN} : uint32_t{0}) |
+          ((events & FD_EVENT_WRITE) ? uint32_t{EPOLLOUT} : uint32_t{0});
+        event.data.u64 = (static_cast<uint64_t>(seq) << 32) |
+          static_cast<uint32_t>(fd);
+        if (epoll_ctl(epollFd_, op, fd, &event) != 0) {
+          return false;
+        }
+        hasFdWatchers_ = true;
+        return true;
+      }
+
+      // move the watchers of marker, or all of them if marker is null, to
+      // taken, whose callbacks the caller destroys without the lock
+      void takeFdWatchersLocked(void *marker, FdWatchers &taken) {
+        for (auto it = fdWatchers_.begin(); it != fdWatchers_.end();) {
+          if (marker && it->second->marker != marker) {
+            ++it;
+            continue;
+          }
+          epoll_ctl(epollFd_, EPOLL_CTL_DEL, it->first, nullptr);
+          taken.push_back(std::move(it->second));
+          it = fdWatchers_.erase(it);
+        }
+        hasFdWatchers_ = !fdWatchers_.empty();
+      }
+
+      // wait for fd events for up to timeoutUs (rounded up to milliseconds)
+      // and dispatch them, runs on the looper thread without the main lock.
+      // returns the number of dispatched events
+      int pollFds(int64_t timeoutUs) {
+        constexpr int MAX_EVENTS = 64;
+        epoll_event events[MAX_EVENTS];
+        auto timeoutMs = timeoutUs < 0 ? -1 :
+          static_cast<int>(std::min<int64_t>((timeoutUs + 999) / 1000, INT32_MAX));
+        auto n = epoll_wait(epollFd_, events, MAX_EVENTS, timeoutMs);
+        if (n <= 0) {
+          return 0;
+        }
+
+        // look the watchers up under the lock, and keep them alive while
+        // their callbacks run, since they may be unwatched concurrently
+        std::shared_ptr<FdWatcher> watchers[MAX_EVENTS];
+        int readyFds[MAX_EVENTS];
+        int readyEvents[MAX_EVENTS];
+        int readyCount = 0;
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          for (int i = 0; i < n; ++i) {
+            auto data = events[i].data.u64;
+            if (data == WAKEUP_EVENT_DATA || data == TIMER_EVENT_DATA) {
+              uint64_t count;
+              auto r = read(data == WAKEUP_EVENT_DATA ? wakeupFd_ : timerFd_,
+                            &count, sizeof(count));
+              static_cast<void>(r);
+              continue;
+            }
+
+            // the seq tells a stale event from one of a re-watched fd
+            auto fd = static_cast<int>(static_cast<uint32_t>(data));
+            auto it = fdWatchers_.find(fd);
+            if (it == fdWatchers_.end() ||
+                it->second->seq != static_cast<uint32_t>(data >> 32)) {
+              continue;
+            }
+            auto flags = events[i].events;
+            readyFds[readyCount] = fd;
+            readyEvents[readyCount] =
+              ((flags & EPOLLIN) ? FD_EVENT_READ : 0) |
+              ((flags & EPOLLOUT) ? FD_EVENT_WRITE : 0) |
+              ((flags & (EPOLLERR | EPOLLHUP)) ? FD_EVENT_ERROR : 0);
+            watchers[readyCount++] = it->second;
+          }
+        }
+
+        // a callback that hangs stalls the looper like a task does, it is
+        // reported as one of the queue that watches the fd
+        auto watched = getWatchdogCount().load(std::memory_order_relaxed) > 0;
+        for (int i = 0; i < readyCount; ++i) {
+          if (watched) {
+            beginProbe(nowUs(), watchers[i]->marker, 0, nullptr, 0,
+                       readyFds[i]);
+          }
+          watchers[i]->callback(readyFds[i], readyEvents[i]);
+          if (watched) {
+            endProbe();
+          }
+        }
+        return readyCount;
+      }
+#endif
+
+      // move tasks submitted by producers to their lanes, the main lock must
+      // be held, which makes the holder the only consumer of submissions_.
+      // the local submissions are drained first, by the looper thread only,
+      // the shared ones left were not seen by the local posts, see
+      // postLocalTask()
+      void drainSubmissionsLocked() {
+        if (isCurrentThread() &&
+            hasLocalSubmissions_.load(std::memory_order_relaxed)) {
+          drainLocalSubmissionsLocked();
+        }
+        while (auto node = submissions_.pop()) {
+          auto task = static_cast<Task *>(node);
+          q_[task->priority].pushBack(task);
+          indexTaskLocked(task);
         }
-        return nullptr;
       }
 
-      void start() {
-        std::lock_guard<std::mutex> lock(mutex_);
-        if (!t_) {
-          running_ = true;
-          t_ = std::make_unique<std::thread>(&Looper::run, this);
+      void drainLocalSubmissionsLocked() {
+        while (auto node = localSubmissions_.popFront()) {
+          auto task = static_cast<Task *>(node);
+          if (isRemovedLocally(*task)) {
+            recycleTask(task);
+            continue;
+          }
+          q_[task->priority].pushBack(task);
+          indexTaskLocked(task);
         }
+        removals_.clear();
+        hasLocalSubmissions_.store(false, std::memory_order_relaxed);
       }
 
-      void stop() {
-        std::lock_guard<std::mutex> lock(mutex_);
-        if (running_) {
-          running_ = false;
+      bool isRemovedLocally(const Task &task) const {
+        for (auto &removal : removals_) {
+          if (removal.epoch > task.removalEpoch &&
+              removal.marker == task.marker &&
+              (removal.anyIdentity || removal.identity == task.identity)) {
+            return true;
+          }
         }
-        cond_.notify_one();
+        return false;
       }
 
-      std::string getName() const {
-        return name_;
+      // a removal on another thread while the looper thread has local
+      // submissions, see pushLocalTask()
+      void recordRemovalLocked(void *marker, int identity, bool anyIdentity) {
+        if (isCurrentThread()) {
+          return;  // the local submissions were drained
+        }
+        auto epoch = removalEpoch_.load(std::memory_order_relaxed) + 1;
+        removalEpoch_.store(epoch, std::memory_order_seq_cst);
+        if (hasLocalSubmissions_.load(std::memory_order_seq_cst)) {
+          removals_.push_back(Removal{marker, identity, anyIdentity, epoch});
+        }
       }
 
-      bool isRunning() const {
-        std::lock_guard<std::mutex> lock(mutex_);
-        return running_;
+      template <typename Predicate>
+      void markRemovedInBatch(Predicate &&pred) {
+        batch_.forEach([&pred](Task *task){
+          if (pred(*task)) {
+            task->isRemoved.store(true, std::memory_order_release);
+          }
+        });
       }
 
-    private:
-      bool postTask(std::unique_ptr<Task> task) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        if (!running_) {
-          return false;
+      // unlink a pending task from its queue and the index, then recycle it
+      void removeTaskLocked(Task *task) {
+        unindexTaskLocked(task);
+        if (isReadyTask(task)) {
+          q_[task->priority].remove(task);
+        } else {
+          removeTimerLocked(task);
         }
-        q_.push_back(std::move(task));
+        recycleTask(task);
+      }
 
-        cond_.notify_one();
-        return true;
+      static bool isReadyTask(Task *task) {
+        return static_cast<nul::ListHook<ReadyQueueTag> *>(task)->isLinked();
       }
 
-      bool postTimedTask(std::unique_ptr<TimedTask> timedTask) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        return postTimedTaskLocked(std::move(timedTask));
+      void removeTimerLocked(Task *task) {
+        timers_.remove(task);
+        if (task->slackUs == TIMER_SLACK_PRECISE) {
+          --preciseTimerCount_;
+        }
       }
 
-      // the main lock must be held when calling this function
-      bool postTimedTaskLocked(std::unique_ptr<TimedTask> timedTask) {
-        if (!running_) {
+      // merge task into a pending one that it coalesces with, if any. the
+      // callable that is not kept is left in task, which the caller
+      // recycles. tasks that are running are not pending, a post while
+      // one runs queues a new task. neither are the posts that the looper
+      // thread made since it last drained them, as seen from other threads
+      bool coalesceTaskLocked(Task *task, int policy) {
+        if (task->identity == 0 || task->intervalUs > 0) {
+          return false;
+        }
+        drainSubmissionsLocked();
+        auto it = index_.find(task->marker);
+        if (it == index_.end()) {
+          return false;
+        }
+        auto namedIt = it->second.named.find(task->identity);
+        if (namedIt == it->second.named.end()) {
           return false;
         }
 
-        auto inserted = false;
-        auto it = delayedQ_.begin();
-        while (it != delayedQ_.end()) {
-          if (timedTask->triggerTimeUs < (*it)->triggerTimeUs) {
-            delayedQ_.insert(it, std::move(timedTask));
-            inserted = true;
-            break;
-          }
-          ++it;
+        auto isTimed = task->isTimed;
+        auto pending = namedIt->second.front();
+        while (pending &&
+               (pending->intervalUs > 0 || isReadyTask(pending) == isTimed)) {
+          pending = IdentityList::next(pending);
         }
-        if (!inserted) {
-          delayedQ_.push_back(std::move(timedTask));
+        if (!pending) {
+          return false;
         }
 
-        // call notify_one only when task is inserted at the head of the queue
-        if (delayedQ_.size() == 1 || it == (delayedQ_.begin() + 1)) {
-          cond_.notify_one();
+        if (policy & COALESCE_KEEP_LAST) {
+          std::swap(pending->call, task->call);
+        }
+        if (isTimed) {
+          auto latest = (policy & COALESCE_LATEST_DEADLINE) != 0;
+          if (latest ? task->dueTimeUs > pending->dueTimeUs :
+              task->dueTimeUs < pending->dueTimeUs) {
+            unindexTaskLocked(pending);
+            removeTimerLocked(pending);
+            pending->dueTimeUs = task->dueTimeUs;
+            pending->slackUs = task->slackUs;
+            postTimedTaskLocked(pending);
+          }
         }
         return true;
       }
 
-      using RemoveTaskComparator = std::function<bool(const Task &task)>;
-
-      void removePendingTasks(void *marker, int identity) {
-        std::lock_guard<std::mutex> lock(mutex_);
-
-        auto comp = [marker, identity](const Task &task){
-          return marker == task.marker && identity == task.identity;
-        };
-        doRemoveTasks(q_, comp);
-        doRemoveTasks(delayedQ_, comp);
-
-        if (activeRepeatedTimedTask_ &&
-            activeRepeatedTimedTask_->marker == marker &&
-            activeRepeatedTimedTask_->identity == identity) {
-          activeRepeatedTimedTask_->isRemoved = true;
+      void indexTaskLocked(Task *task) {
+        sweepEmptyEntries(index_, indexSweepSize_, [](const MarkerIndex &mi){
+          return mi.empty();
+        });
+        auto &markerIndex = index_[task->marker];
+        (task->intervalUs > 0 ?
+         markerIndex.repeated : markerIndex.nonRepeated).pushBack(task);
+
+        auto list = &markerIndex.unnamed;
+        if (task->identity != 0) {
+          sweepEmptyEntries(
+            markerIndex.named, markerIndex.namedSweepSize,
+            [](const IdentityList &list){ return list.empty(); });
+          list = &markerIndex.named[task->identity];
         }
-      }
+        list->pushBack(task);
 
-      void removeAllPendingTasks(void *marker) {
-        std::lock_guard<std::mutex> lock(mutex_);
+        task->markerIndex = &markerIndex;
+        task->identityList = list;
+      }
 
-        auto comp = [marker](const Task &task){
-          return marker == task.marker;
-        };
-        doRemoveTasks(q_, comp);
-        doRemoveTasks(delayedQ_, comp);
+      void unindexTaskLocked(Task *task) {
+        auto markerIndex = task->markerIndex;
+        (task->intervalUs > 0 ?
+         markerIndex->repeated : markerIndex->nonRepeated).remove(task);
+        task->identityList->remove(task);
+        task->markerIndex = nullptr;
+        task->identityList = nullptr;
+      }
 
-        if (activeRepeatedTimedTask_ &&
-            activeRepeatedTimedTask_->marker == marker) {
-          activeRepeatedTimedTask_->isRemoved = true;
-        }
+      // monotonic, so that adjusting the wall clock does not move timers,
+      // on Linux it is CLOCK_MONOTONIC, which the timerfd is armed with
+      static int64_t nowUs() {
+        using namespace std::chrono;
+        return duration_cast<microseconds>(
+          steady_clock::now().time_since_epoch()).count();
       }
 
-      // remove all tasks that do not have identities
-      void removeAllUnamedPendingTasks(void *marker) {
-        removePendingTasks(marker, 0);
+      // the time of the looper's own clock, see setClock()
+      int64_t clockNowUs() const {
+        return clock_ ? clock_->nowUs() : nowUs();
       }
 
-      void removeAllNonRepeatedTasks(void *marker) {
+      // the earliest time a timer may be due, -1 if there is none, see
+      // TimerWheel::nextTimeUs()
+      int64_t nextTimerTimeUs() {
         std::lock_guard<std::mutex> lock(mutex_);
-
-        doRemoveTasks(q_, [marker](const Task &task){
-          return marker == task.marker;
-        });
-        doRemoveTasks(delayedQ_, [marker](const Task &task){
-          return marker == task.marker &&
-            static_cast<const TimedTask &>(task).intervalUs == 0;
-        });
-
-        if (activeRepeatedTimedTask_ &&
-            activeRepeatedTimedTask_->marker == marker &&
-            activeRepeatedTimedTask_->intervalUs == 0) {
-          activeRepeatedTimedTask_->isRemoved = true;
-        }
+        return timers_.nextTimeUs();
       }
 
-    private:
-      void run() {
-        pthread_setspecific(getThreadLocalLooperKey(), this);
-
-        if (!name_.empty()) {
+      static void setThreadName(const std::string &name) {
+        nul::Tracer::setThreadName(name);
+        if (!name.empty()) {
 #ifdef __ANDROID__
-          prctl(PR_SET_NAME, (unsigned long)name_.c_str(), 0, 0, 0);
+          prctl(PR_SET_NAME, (unsigned long)name.c_str(), 0, 0, 0);
 #elif __APPLE__
-          pthread_setname_np(name_.c_str());
+          pthread_setname_np(name.c_str());
+#elif __linux__
+          // longer names are rejected, 15 characters and the terminator
+          pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
 #endif
         }
+      }
 
-        using namespace std::chrono;
-
-        while (running_) {
-          auto lock = std::unique_lock<std::mutex>(mutex_);
-          if (!q_.empty()) {
-            auto task = std::move(q_.front());
-            q_.pop_front();
-
-            lock.unlock();
-            task->call();
-            continue;
-          }
-
-          if (delayedQ_.empty()) {
-            cond_.wait(lock);
-            continue;
-          }
-
-          auto now = duration_cast<microseconds>(
-            high_resolution_clock::now().time_since_epoch()).count();
-          auto delay = delayedQ_.front()->triggerTimeUs - now;
-
-          if (delay > 0) {
-            cond_.wait_for(lock, microseconds(delay));
-            continue;
-          }
-
-          auto timedTask = std::move(delayedQ_.front());
-          delayedQ_.pop_front();
-          if (timedTask->intervalUs > 0) {
-            activeRepeatedTimedTask_ = timedTask.get();
-          }
-          lock.unlock();
-
-          timedTask->call();
-
-          if (timedTask->intervalUs > 0) {
-            lock = std::unique_lock<std::mutex>(mutex_);
-            activeRepeatedTimedTask_ = nullptr;
-            if (!timedTask->isRemoved) {
-              timedTask->triggerTimeUs += timedTask->intervalUs;
-              postTimedTaskLocked(std::move(timedTask));
+      // the attributes that can only be set when the thread is created,
+      // the nice value is applied by the thread itself, see run()
+      bool createThread() {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        auto ok = true;
+        if (options_.stackSize > 0) {
+          ok = pthread_attr_setstacksize(&attr, std::max<std::size_t>(
+                options_.stackSize, PTHREAD_STACK_MIN)) == 0;
+        }
+#if defined(__linux__) && !defined(__ANDROID__)
+        if (ok && !options_.cpuAffinity.empty()) {
+          cpu_set_t cpus;
+          CPU_ZERO(&cpus);
+          for (auto cpu : options_.cpuAffinity) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE) {
+              CPU_SET(cpu, &cpus);
             }
           }
+          ok = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus) == 0;
+        }
+#endif
+        if (ok && options_.fifoPriority > 0) {
+          auto param = sched_param{};
+          param.sched_priority = options_.fifoPriority;
+          ok = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED) == 0 &&
+            pthread_attr_setschedpolicy(&attr, SCHED_FIFO) == 0 &&
+            pthread_attr_setschedparam(&attr, &param) == 0;
         }
+        ok = ok && pthread_create(&thread_, &attr, [](void *looper) -> void * {
+          static_cast<Looper *>(looper)->run();
+          return nullptr;
+        }, this) == 0;
+        pthread_attr_destroy(&attr);
+        return ok;
       }
 
-      template <typename Q>
-      void doRemoveTasks(Q &&q, const RemoveTaskComparator &comp) {
-        auto it = q.begin();
-        while (it != q.end()) {
-          if (comp(**it)) {
-            it = q.erase(it);
-          } else {
-            ++it;
-          }
-        }
+      // the arena of the looper that runs on the calling thread, if enabled
+      static nul::FrameArena *getCurrentFrameArena() {
+        auto looper = currentLooper();
+        return looper ?
+          looper->frameArena_.load(std::memory_order_acquire) : nullptr;
       }
 
-      static pthread_key_t getThreadLocalLooperKey() {
-        static pthread_key_t looperKey;
-        static std::once_flag flag;
-        std::call_once(flag, [] {
-          pthread_key_create(&looperKey, nullptr);
-        });
-        return looperKey;
+      // the looper (or strand) that runs on the calling thread
+      static Looper *&currentLooper() {
+        static thread_local Looper *looper = nullptr;
+        return looper;
       }
 
     private:
-      std::deque<std::unique_ptr<Task>> q_;             // guarded by mutex_
-      std::deque<std::unique_ptr<TimedTask>> delayedQ_; // guarded by mutex_
-      std::unique_ptr<std::thread> t_{nullptr};
+      // see recordRemovalLocked()
+      struct Removal {
+        void *marker;
+        int identity;
+        bool anyIdentity;
+        uint64_t epoch;
+      };
+
+    private:
+      nul::NodePool<Task> taskPool_;  // must outlive all the tasks below
+      nul::MpscQueue submissions_;                      // consumed under mutex_
+      nul::MpscChain localSubmissions_;  // the looper thread only, see pushLocalTask()
+      std::atomic<bool> hasLocalSubmissions_{false};
+      std::atomic<uint64_t> removalEpoch_{0};           // written under mutex_
+      std::vector<Removal> removals_;                   // guarded by mutex_
+      ReadyQueue q_[PRIORITY_COUNT];                    // guarded by mutex_
+      int passedOver_[PRIORITY_COUNT]{};                // guarded by mutex_
+      bool idleRan_{false};   // in the current idle period, guarded by mutex_
+      ReadyQueue batch_;        // written under mutex_, read by run() only
+      std::unordered_map<void *, MarkerIndex> index_;   // guarded by mutex_
+      std::size_t indexSweepSize_{16};                  // guarded by mutex_
+      nul::TimerWheel timers_;                          // guarded by mutex_
+      int64_t maxSlackUs_{0};   // bound of the pending slacks, guarded by mutex_
+      std::size_t preciseTimerCount_{0};                // guarded by mutex_
+      pthread_t thread_;
+      bool hasThread_{false};                           // guarded by mutex_
+      LooperOptions options_;   // set before the thread is created
       std::condition_variable cond_;
       mutable std::mutex mutex_;
 
       std::string name_;
-      bool running_{false};           // guarded by mutex_
+      std::atomic<bool> running_{false};
+      std::atomic<bool> parked_{false};
+
+#ifdef __linux__
+      struct FdWatcher {
+        uint32_t seq;
+        void *marker;
+        FdCallback callback;
+      };
+
+      static constexpr uint64_t WAKEUP_EVENT_DATA = UINT64_MAX;
+      static constexpr uint64_t TIMER_EVENT_DATA = UINT64_MAX - 1;
+
+      int epollFd_{-1};
+      int wakeupFd_{-1};
+      int timerFd_{-1};
+      std::unordered_map<int, std::shared_ptr<FdWatcher>> fdWatchers_; // guarded by mutex_
+      uint32_t fdWatcherSeq_{0};                        // guarded by mutex_
+      std::atomic<bool> hasFdWatchers_{false};
+#endif
 
-      TimedTask *activeRepeatedTimedTask_{nullptr}; // guarded by mutex_
+      std::size_t batchSize_{1};                        // guarded by mutex_
+      nul::TaskBound bound_;    // the capacity of the looper, see setCapacity()
+
+      int64_t maxSpinUs_{0};                            // guarded by mutex_
+      int64_t spinUs_{0};       // the adaptive spin window, guarded by mutex_
+      std::atomic<bool> timerAdded_{false};  // an earlier timer, while spinning
+
+      std::atomic<bool> metricsEnabled_{false};
+      std::mutex metricsMutex_;
+      TaskMetrics metrics_;                             // guarded by metricsMutex_
+      std::unordered_map<void *, TaskMetrics> queueMetrics_;  // guarded by metricsMutex_
+      int64_t lastSnapshotUs_{0};                       // guarded by metricsMutex_
+      uint64_t lastExecutedTasks_{0};                   // guarded by metricsMutex_
+
+      // set for strands only
+      std::weak_ptr<Scheduler> scheduler_;
+      const bool isStrand_{false};
+      int64_t armedTimeUs_{-1};   // the armed wakeup, guarded by mutex_
+
+      // set before the looper is used, see setClock()
+      std::shared_ptr<Clock> clock_;
+
+      std::atomic<nul::FrameArena *> frameArena_{nullptr};
+
+      // see beginProbe()
+      struct TaskProbe {
+        std::atomic<uint32_t> seq{0};
+        std::atomic<int64_t> startUs{0};  // 0 while no task runs
+        std::atomic<const void *> marker{nullptr};
+        std::atomic<int> identity{0};
+        std::atomic<const char *> file{nullptr};
+        std::atomic<int> line{0};
+        std::atomic<int> fd{-1};
+        std::atomic<pthread_t> thread{};
+      };
+      TaskProbe probe_;
+      std::atomic<uint64_t> stalledTasks_{0};
   };
 
   class TaskQueue final {
@@ -315,25 +2071,220 @@ namespace nul {
         assert(!!looper);
       }
 
+      ~TaskQueue() {
+        // tasks that are still queued keep the bound
+        if (auto bound = bound_.load(std::memory_order_acquire)) {
+          bound->unref();
+        }
+      }
+
+      // the overloads that take no arguments for call record the file and
+      // line they are called from, which shows up in traces (see
+      // nul::Tracer) and stall reports
       template <typename Callable, typename ...Args>
       bool post(Callable &&call, Args &&...args) {
         return post(0, std::forward<Callable>(call), std::forward<Args>(args)...);
       }
 
+      template <typename Callable>
+      bool post(
+        Callable &&call,
+        PostSite site = PostSite(NUL_CALLER_FILE, NUL_CALLER_LINE)) {
+        return postImmediateInternal(
+          site, currentPriority(), 0, 0, std::forward<Callable>(call));
+      }
+
       // identity=0 means no name for this task, which will be deleted once
       // removeAllUnamedPendingTasks() is called
       template <typename Callable, typename ...Args>
       bool post(int identity, Callable &&call, Args &&...args) {
-        auto lock = SpinLock(busyFlag_);
-        return !detached_ && looper_->postTask(std::make_unique<Task>(
-            this, identity, std::bind(
-              std::forward<Callable>(call), std::forward<Args>(args)...)));
+        return postWithPriority(
+          currentPriority(), identity,
+          std::forward<Callable>(call), std::forward<Args>(args)...);
+      }
+
+      template <typename Callable>
+      bool post(
+        int identity, Callable &&call,
+        PostSite site = PostSite(NUL_CALLER_FILE, NUL_CALLER_LINE)) {
+        return postImmediateInternal(
+          site, currentPriority(), identity, 0, std::forward<Callable>(call));
+      }
+
+      // identity=0 means no name for this task, see Looper::TaskPriority
+      template <typename Callable, typename ...Args>
+      bool postWithPriority(
+        Looper::TaskPriority priority, int identity,
+        Callable &&call, Args &&...args) {
+        return postImmediateInternal(
+          PostSite(), priority, identity, 0,
+          std::forward<Callable>(call), std::forward<Args>(args)...);
+      }
+
+      template <typename Callable>
+      bool postWithPriority(
+        Looper::TaskPriority priority, int identity, Callable &&call,
+        PostSite site = PostSite(NUL_CALLER_FILE, NUL_CALLER_LINE)) {
+        return postImmediateInternal(
+          site, priority, identity, 0, std::forward<Callable>(call));
+      }
+
+      // like post(), but the task is discarded without running if it is
+      // still queued expiryUs from now, a stale response is not worth
+      // sending
+      template <typename Callable, typename ...Args>
+      bool postWithExpiry(int64_t expiryUs, Callable &&call, Args &&...args) {
+        return postImmediateInternal(
+          PostSite(), currentPriority(), 0,
+          looper_->clockNowUs() + std::max<int64_t>(expiryUs, 1),
+          std::forward<Callable>(call), std::forward<Args>(args)...);
+      }
+
+      // post call unless a task with the same identity is already queued
+      // and has not started, for work that only needs to happen once
+      // however many times it is asked for ("flush", "recompute"). policy
+      // is one of Looper::COALESCE_KEEP_FIRST (the default, the queued
+      // callable runs and call is dropped) or Looper::COALESCE_KEEP_LAST
+      // (call replaces it, at its place in the queue). identity must not
+      // be 0. returns true if call is queued or merged
+      template <typename Callable, typename ...Args>
+      bool postCoalesced(
+        int identity, int policy, Callable &&call, Args &&...args) {
+        assert(identity != 0);
+        PostScope scope(*this);
+        if (!scope) {
+          return false;
+        }
+        return looper_->postCoalescedTask(
+          obtainImmediateTask(
+            PostSite(), currentPriority(), identity,
+            std::forward<Callable>(call), std::forward<Args>(args)...),
+          bound_.load(std::memory_order_acquire), &detached_, policy);
+      }
+
+      // the timed counterpart of postCoalesced(), a queued timed task with
+      // the same identity absorbs this one. policy may also pick which
+      // deadline is kept, Looper::COALESCE_EARLIEST_DEADLINE (the default)
+      // or Looper::COALESCE_LATEST_DEADLINE (a debounce), e.g.
+      // Looper::COALESCE_KEEP_LAST | Looper::COALESCE_LATEST_DEADLINE.
+      // repeated tasks do not coalesce
+      template <typename Callable, typename ...Args>
+      bool postDelayedCoalesced(
+        int identity, int64_t delayUs, int policy,
+        Callable &&call, Args &&...args) {
+        assert(identity != 0);
+        PostScope scope(*this);
+        if (!scope) {
+          return false;
+        }
+        return looper_->postCoalescedTask(
+          obtainTimedTask(
+            PostSite(), identity, delayUs, 0,
+            timerSlackUs_.load(std::memory_order_relaxed),
+            std::forward<Callable>(call), std::forward<Args>(args)...),
+          nullptr, nullptr, policy);
+      }
+
+      // bound the number of queued immediate tasks of this queue, on top of
+      // the bound of the looper, 0 for no bound. OVERFLOW_DROP_OLDEST
+      // discards the oldest task of this queue, see Looper::setCapacity()
+      void setCapacity(
+        std::size_t capacity,
+        Looper::OverflowPolicy policy = Looper::OVERFLOW_REJECT) {
+        auto bound = bound_.load(std::memory_order_acquire);
+        if (!bound) {
+          auto created = new TaskBound();
+          if (bound_.compare_exchange_strong(
+                bound, created, std::memory_order_acq_rel)) {
+            bound = created;
+          } else {
+            created->unref();
+          }
+        }
+        bound->setCapacity(capacity, policy);
+      }
+
+      // the future is completed with the result of call when it has run, or
+      // broken if the task is dropped (removed, detached, looper stopped),
+      // which TaskFuture::get() does not return from. the shared state comes from a pool, so this allocates no more than
+      // post() does
+      template <typename Callable, typename ...Args,
+               typename R = CallResult<decltype(std::bind(
+                 std::declval<Callable>(), std::declval<Args>()...))>>
+      TaskFuture<R> postWithResult(Callable &&call, Args &&...args) {
+        auto fn = std::bind(
+          std::forward<Callable>(call), std::forward<Args>(args)...);
+        auto promise = TaskPromise<R>();
+        auto future = promise.getFuture();
+        // a task that is not posted breaks the future on its way out
+        post(PromiseTask<R, decltype(fn)>{std::move(promise), std::move(fn)},
+             PostSite());
+        return future;
+      }
+
+      // run call on the looper and wait for its result. on the looper's own
+      // thread call runs inline, which would otherwise deadlock.
+      //
+      // NOTE: when the looper drops the task (it is stopped, or stops while
+      // the task is queued, or the queue is detached) call runs inline as
+      // well, on the calling thread, so that there is a result to return.
+      // call must be safe to run off the looper then, otherwise use
+      // postWithResult(), whose future tells a dropped task apart
+      template <typename Callable, typename ...Args,
+               typename R = CallResult<decltype(std::bind(
+                 std::declval<Callable>(), std::declval<Args>()...))>>
+      R postSync(Callable &&call, Args &&...args) {
+        auto fn = std::bind(
+          std::forward<Callable>(call), std::forward<Args>(args)...);
+        if (!looper_->isCurrentThread()) {
+          // fn stays here, a task that is dropped never touches it
+          auto future = postWithResult([&fn]{ return fn(); });
+          if (future.wait()) {
+            return future.get();
+          }
+        }
+        return fn();
+      }
+
+      // deferrable work (trimming pools, flushing stats), runs once the
+      // looper has no other ready task. an idle task that is posted while
+      // idle tasks run waits for the next idle period, which begins when
+      // the looper is woken up again
+      template <typename Callable, typename ...Args>
+      bool postIdle(Callable &&call, Args &&...args) {
+        return postWithPriority(
+          Looper::PRIORITY_IDLE, 0,
+          std::forward<Callable>(call), std::forward<Args>(args)...);
+      }
+
+      // the priority of the tasks posted afterwards with post(), defaults
+      // to Looper::PRIORITY_NORMAL
+      void setPriority(Looper::TaskPriority priority) {
+        priority_.store(priority, std::memory_order_relaxed);
       }
 
       template <typename Callable, typename ...Args>
       bool postDelayed(int64_t delayUs, Callable &&call, Args &&...args) {
         return postRepeatedInternal(
-          0, delayUs, 0,
+          PostSite(), 0, delayUs, 0,
+          std::forward<Callable>(call), std::forward<Args>(args)...);
+      }
+
+      template <typename Callable>
+      bool postDelayed(
+        int64_t delayUs, Callable &&call,
+        PostSite site = PostSite(NUL_CALLER_FILE, NUL_CALLER_LINE)) {
+        return postRepeatedInternal(
+          site, 0, delayUs, 0, std::forward<Callable>(call));
+      }
+
+      // the task may run up to slackUs after delayUs, which lets it share a
+      // wakeup with nearby timers, see setTimerSlack()
+      template <typename Callable, typename ...Args>
+      bool postDelayedWithSlack(
+        int64_t delayUs, int64_t slackUs, Callable &&call, Args &&...args) {
+        return postTimedInternal(
+          PostSite(), 0, delayUs, 0, slackUs,
           std::forward<Callable>(call), std::forward<Args>(args)...);
       }
 
@@ -343,18 +2294,34 @@ namespace nul {
       bool postDelayedWithId(
         int identity, int64_t delayUs, Callable &&call, Args &&...args) {
         return postRepeatedInternal(
-          identity, delayUs, 0,
+          PostSite(), identity, delayUs, 0,
           std::forward<Callable>(call), std::forward<Args>(args)...);
       }
 
+      template <typename Callable>
+      bool postDelayedWithId(
+        int identity, int64_t delayUs, Callable &&call,
+        PostSite site = PostSite(NUL_CALLER_FILE, NUL_CALLER_LINE)) {
+        return postRepeatedInternal(
+          site, identity, delayUs, 0, std::forward<Callable>(call));
+      }
+
       template <typename Callable, typename ...Args>
       bool postRepeated(
         int64_t delayUs, int64_t intervalUs, Callable &&call, Args &&...args) {
         return postRepeatedInternal(
-          0, delayUs, intervalUs,
+          PostSite(), 0, delayUs, intervalUs,
           std::forward<Callable>(call), std::forward<Args>(args)...);
       }
 
+      template <typename Callable>
+      bool postRepeated(
+        int64_t delayUs, int64_t intervalUs, Callable &&call,
+        PostSite site = PostSite(NUL_CALLER_FILE, NUL_CALLER_LINE)) {
+        return postRepeatedInternal(
+          site, 0, delayUs, intervalUs, std::forward<Callable>(call));
+      }
+
       // identity=0 means no name for this task, which will be deleted once
       // removeAllUnamedPendingTasks() is called
       template <typename Callable, typename ...Args>
@@ -362,10 +2329,142 @@ namespace nul {
         int identity, int64_t delayUs, int64_t intervalUs,
         Callable &&call, Args &&...args) {
         return postRepeatedInternal(
-          identity, delayUs, intervalUs,
+          PostSite(), identity, delayUs, intervalUs,
           std::forward<Callable>(call), std::forward<Args>(args)...);
       }
 
+      template <typename Callable>
+      bool postRepeatedWithId(
+        int identity, int64_t delayUs, int64_t intervalUs, Callable &&call,
+        PostSite site = PostSite(NUL_CALLER_FILE, NUL_CALLER_LINE)) {
+        return postRepeatedInternal(
+          site, identity, delayUs, intervalUs, std::forward<Callable>(call));
+      }
+
+      // the slack of the timed tasks that are posted afterwards, including
+      // every run of repeated tasks, 0 (the default) fires them as close to
+      // their time as the looper's wait allows (about 1ms on Linux),
+      // Looper::TIMER_SLACK_PRECISE asks for a precise wakeup
+      void setTimerSlack(int64_t slackUs) {
+        timerSlackUs_.store(slackUs, std::memory_order_relaxed);
+      }
+
+      // how the repeated tasks that are posted afterwards are scheduled
+      // again, Looper::RepeatPolicy bits, REPEAT_FIXED_RATE |
+      // REPEAT_CATCH_UP by default. a fixed rate task replays at most
+      // maxCatchUp missed runs (0 for all of them) with REPEAT_CATCH_UP
+      void setRepeatPolicy(int policy, uint32_t maxCatchUp = 0) {
+        repeatPolicy_.store(policy, std::memory_order_relaxed);
+        maxCatchUp_.store(maxCatchUp, std::memory_order_relaxed);
+      }
+
+      // tasks that are built up front and posted together with postBatch(),
+      // which takes the looper's lock at most once (for the timed tasks)
+      // and wakes the looper up at most once. immediate tasks keep their
+      // order, and every task keeps its identity for removePendingTasks().
+      //
+      //   auto batch = TaskQueue::PostBatch(tq);
+      //   for (auto &part : parts) {
+      //     batch.post(kPartTask, [&part]{ process(part); });
+      //   }
+      //   batch.postDelayed(1000000, []{ checkProgress(); });
+      //   tq.postBatch(batch);
+      //
+      // a batch is used on one thread, the tasks that are not posted are
+      // discarded with it
+      class PostBatch final {
+        public:
+          explicit PostBatch(TaskQueue &tq) : tq_(tq) {}
+          PostBatch(const PostBatch &) = delete;
+          PostBatch &operator=(const PostBatch &) = delete;
+
+          ~PostBatch() {
+            clear();
+          }
+
+          template <typename Callable, typename ...Args>
+          PostBatch &post(Callable &&call, Args &&...args) {
+            return post(
+              0, std::forward<Callable>(call), std::forward<Args>(args)...);
+          }
+
+          template <typename Callable, typename ...Args>
+          PostBatch &post(int identity, Callable &&call, Args &&...args) {
+            immediate_.pushBack(tq_.obtainImmediateTask(
+                PostSite(), tq_.currentPriority(), identity,
+                std::forward<Callable>(call), std::forward<Args>(args)...));
+            ++size_;
+            return *this;
+          }
+
+          // the delay counts from now, not from postBatch()
+          template <typename Callable, typename ...Args>
+          PostBatch &postDelayed(
+            int64_t delayUs, Callable &&call, Args &&...args) {
+            return postDelayedWithId(
+              0, delayUs,
+              std::forward<Callable>(call), std::forward<Args>(args)...);
+          }
+
+          template <typename Callable, typename ...Args>
+          PostBatch &postDelayedWithId(
+            int identity, int64_t delayUs, Callable &&call, Args &&...args) {
+            timed_.pushBack(tq_.obtainTimedTask(
+                PostSite(), identity, delayUs, 0,
+                tq_.timerSlackUs_.load(std::memory_order_relaxed),
+                std::forward<Callable>(call), std::forward<Args>(args)...));
+            ++size_;
+            return *this;
+          }
+
+          std::size_t size() const {
+            return size_;
+          }
+
+          void clear() {
+            tq_.discardTasks(immediate_);
+            tq_.discardTasks(timed_);
+            size_ = 0;
+          }
+
+        private:
+          friend class TaskQueue;
+          TaskQueue &tq_;
+          nul::MpscChain immediate_;
+          nul::MpscChain timed_;
+          std::size_t size_{0};
+      };
+
+      // post the tasks of batch, which is left empty. returns the number of
+      // tasks that are posted, it is less than batch.size() if the looper
+      // is not running or the bounds reject some of them, see setCapacity()
+      std::size_t postBatch(PostBatch &batch) {
+        assert(&batch.tq_ == this);
+        auto posted = std::size_t{0};
+        {
+          PostScope scope(*this);
+          if (scope) {
+            posted = looper_->postBatch(
+              batch.immediate_, batch.timed_,
+              bound_.load(std::memory_order_acquire), &detached_);
+          }
+        }
+        batch.clear();
+        return posted;
+      }
+
+#ifdef NUL_HAS_COROUTINES
+      // awaitables that resume a nul::Coroutine on the looper, see
+      // coroutine.hpp
+      class ScheduleAwaiter;
+      class SleepAwaiter;
+      class FdAwaiter;
+
+      ScheduleAwaiter schedule();
+      SleepAwaiter sleepFor(int64_t delayUs);
+      FdAwaiter waitFd(int fd, int events);
+#endif
+
       void removePendingTasks(int identity) {
         // no lock is needed here because looper_ itself is thread-safe
         if (!detached_) {
@@ -397,8 +2496,11 @@ namespace nul {
       void detachFromLooper() {
         auto lock = SpinLock(busyFlag_);
         if (!detached_) {
-          detached_ = true;
+          closeBound();
+          markDetached();
           looper_->removeAllPendingTasks(this);
+          looper_->unwatchFds(this);
+          looper_->removeQueueMetrics(this);
         }
       }
 
@@ -409,20 +2511,49 @@ namespace nul {
           return;
         }
 
-        detached_ = true;
+        closeBound();
+        markDetached();
         // remove all pending tasks before posting the last task
         looper_->removeAllPendingTasks(this);
+        looper_->unwatchFds(this);
+        looper_->removeQueueMetrics(this);
 
         // give the caller a chance to run the last task, the caller can use
         // this task to keep a reference (probably a shared_ptr from 
         // shared_from_this()) to the caller itself to avoid the case that
         // pending tasks access the caller object's raw pointer while the
-        // caller was already deallocated
-        looper_->postTask(std::make_unique<Task>(
-            this, 0, std::bind(
+        // caller was already deallocated. the finalizer does not belong to
+        // the queue any more, so it is posted without a marker
+        looper_->postTask(looper_->obtainTask(
+            nullptr, 0, 0, 0, std::bind(
               std::forward<Callable>(finalizer), std::forward<Args>(args)...)));
       }
 
+      // see Looper::watchFd(), the fds that are still watched are unwatched
+      // when the queue is detached
+      bool watchFd(int fd, int events, Looper::FdCallback callback) {
+        return !detached_ &&
+          looper_->watchFd(fd, events, std::move(callback), this);
+      }
+
+      bool updateFd(int fd, int events) {
+        return !detached_ && looper_->updateFd(fd, events);
+      }
+
+      bool unwatchFd(int fd) {
+        return looper_->unwatchFd(fd);
+      }
+
+      // the metrics of this queue, see Looper::setMetricsEnabled()
+      Looper::QueueMetrics getMetrics() const {
+        if (detached_) {
+          auto result = Looper::QueueMetrics{};
+          result.marker = this;
+          return result;
+        }
+        return looper_->getQueueMetrics(const_cast<TaskQueue *>(this));
+      }
+
       std::string getName() const {
         return !detached_ ? looper_->getName() : "";
       }
@@ -432,38 +2563,161 @@ namespace nul {
       }
 
     private:
+      template <typename R, typename Fn>
+      struct PromiseTask {
+        TaskPromise<R> promise;
+        Fn fn;
+
+        void operator()() {
+          promise.run(fn);
+        }
+      };
+
+      // posts do not lock, they register themselves in activePosts_ so
+      // that detachFromLooper() can wait for the in-flight ones, after which
+      // no task from this queue can sneak in behind the finalizer
+      class PostScope final {
+        public:
+          explicit PostScope(TaskQueue &tq) : tq_(tq) {
+            tq_.activePosts_.fetch_add(1, std::memory_order_seq_cst);
+            admitted_ = !tq_.detached_.load(std::memory_order_seq_cst);
+          }
+
+          PostScope(const PostScope &) = delete;
+          PostScope &operator=(const PostScope &) = delete;
+
+          ~PostScope() {
+            tq_.activePosts_.fetch_sub(1, std::memory_order_release);
+          }
+
+          explicit operator bool() const {
+            return admitted_;
+          }
+
+        private:
+          TaskQueue &tq_;
+          bool admitted_;
+      };
+
+      // busyFlag_ must be held when calling this function
+      // producers that wait for room in the queue would hold up detaching
+      void closeBound() {
+        if (auto bound = bound_.load(std::memory_order_acquire)) {
+          bound->close();
+        }
+      }
+
+      void markDetached() {
+        detached_.store(true, std::memory_order_seq_cst);
+        // posts that wait for room in the looper see the flag
+        looper_->bound_.wakeWaiters();
+        while (activePosts_.load(std::memory_order_acquire) > 0) {
+          std::this_thread::yield();
+        }
+      }
+
+      template <typename Callable, typename ...Args>
+      bool postImmediateInternal(
+        const PostSite &site, Looper::TaskPriority priority, int identity,
+        int64_t expireTimeUs, Callable &&call, Args &&...args) {
+        PostScope scope(*this);
+        if (!scope) {
+          return false;
+        }
+        auto task = obtainImmediateTask(
+          site, priority, identity,
+          std::forward<Callable>(call), std::forward<Args>(args)...);
+        task->expireTimeUs = expireTimeUs;
+        return looper_->postTask(
+          task, bound_.load(std::memory_order_acquire), &detached_);
+      }
+
+      template <typename Callable, typename ...Args>
+      Task *obtainImmediateTask(
+        const PostSite &site, Looper::TaskPriority priority, int identity,
+        Callable &&call, Args &&...args) {
+        auto task = looper_->obtainTask(
+          this, identity, 0, 0, std::bind(
+            std::forward<Callable>(call), std::forward<Args>(args)...));
+        task->priority = priority;
+        looper_->setPostSite(task, site);
+        return task;
+      }
+
+      Looper::TaskPriority currentPriority() const {
+        return static_cast<Looper::TaskPriority>(
+          priority_.load(std::memory_order_relaxed));
+      }
+
+      void discardTasks(nul::MpscChain &tasks) {
+        while (auto node = tasks.popFront()) {
+          looper_->recycleTask(static_cast<Task *>(node));
+        }
+      }
+
       template <typename Callable, typename ...Args>
       bool postRepeatedInternal(
-        int identity, int64_t delayUs, int64_t intervalUs,
+        const PostSite &site, int identity, int64_t delayUs, int64_t intervalUs,
         Callable &&call, Args &&...args) {
+        return postTimedInternal(
+          site, identity, delayUs, intervalUs,
+          timerSlackUs_.load(std::memory_order_relaxed),
+          std::forward<Callable>(call), std::forward<Args>(args)...);
+      }
 
-        auto lock = SpinLock(busyFlag_);
-        if (detached_) {
+      template <typename Callable, typename ...Args>
+      bool postTimedInternal(
+        const PostSite &site, int identity, int64_t delayUs, int64_t intervalUs,
+        int64_t slackUs, Callable &&call, Args &&...args) {
+
+        PostScope scope(*this);
+        if (!scope) {
           return false;
         }
+        return looper_->postTimedTask(obtainTimedTask(
+            site, identity, delayUs, intervalUs, slackUs,
+            std::forward<Callable>(call), std::forward<Args>(args)...));
+      }
 
+      template <typename Callable, typename ...Args>
+      Task *obtainTimedTask(
+        const PostSite &site, int identity, int64_t delayUs,
+        int64_t intervalUs, int64_t slackUs, Callable &&call, Args &&...args) {
         if (delayUs < 0) {
           delayUs = 0;
         }
 
-        using namespace std::chrono;
-        auto triggerTimeUs = duration_cast<microseconds>(
-          high_resolution_clock::now().time_since_epoch()).count() + delayUs;
-
-        auto timedTask = std::make_unique<TimedTask>(
-          this, identity, triggerTimeUs, intervalUs,
+        auto dueTimeUs = looper_->clockNowUs() + delayUs;
+        auto timedTask = looper_->obtainTask(
+          this, identity, dueTimeUs, intervalUs,
           std::bind(std::forward<Callable>(call), std::forward<Args>(args)...)
         );
-
-        return looper_->postTimedTask(std::move(timedTask));
+        timedTask->isTimed = true;
+        timedTask->slackUs = slackUs < 0 ? Looper::TIMER_SLACK_PRECISE : slackUs;
+        if (intervalUs > 0) {
+          timedTask->repeatPolicy = repeatPolicy_.load(std::memory_order_relaxed);
+          timedTask->maxCatchUp = maxCatchUp_.load(std::memory_order_relaxed);
+        }
+        looper_->setPostSite(timedTask, site);
+        return timedTask;
       }
 
     private:
       std::shared_ptr<Looper> looper_;
-      bool detached_{false};
-      std::atomic_flag busyFlag_ = ATOMIC_FLAG_INIT;
+      std::atomic<bool> detached_{false};
+      std::atomic<int> activePosts_{0};
+      std::atomic<int64_t> timerSlackUs_{0};
+      std::atomic<int> repeatPolicy_{Looper::REPEAT_FIXED_RATE};
+      std::atomic<uint32_t> maxCatchUp_{0};
+      std::atomic<int> priority_{Looper::PRIORITY_NORMAL};
+      std::atomic_flag busyFlag_ = ATOMIC_FLAG_INIT;  // serializes detaching
+      std::atomic<TaskBound *> bound_{nullptr};       // see setCapacity()
   };
 
 } /* end of namespace: nul */
 
+#ifdef NUL_HAS_COROUTINES
+#include "coroutine.hpp"
+#endif
+
 #endif /* end of include guard: LOOPER_H_ */
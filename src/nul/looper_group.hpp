@@ -0,0 +1,311 @@
+/*******************************************************************************
+**          File: looper_group.hpp
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-16 Fri 06:10 PM
+**   Description: a pool of worker threads that run strands, loopers without a
+**                thread of their own, idle workers steal strands from the
+**                busy ones
+*******************************************************************************/
+#ifndef LOOPER_GROUP_H_
+#define LOOPER_GROUP_H_
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <memory>
+
+#include "looper.hpp"
+
+namespace nul {
+
+  // a strand is a Looper that is run by the workers of a group, so the
+  // TaskQueue API works on it unchanged: the tasks of a strand run in FIFO
+  // order and never concurrently, but on whichever worker is free.
+  //
+  //   auto group = LooperGroup::create("worker", 4);
+  //   group->start();
+  //   auto tq = TaskQueue(group->createStrand("session"));
+  //
+  // every worker has its own queue of runnable strands, a strand that is
+  // woken up on a worker goes to the queue of that worker, idle workers
+  // steal from the others. a strand runs one batch (see
+  // Looper::setBatchSize()) at a time and goes to the end of the queue if it
+  // still has work, so a busy strand cannot starve the others. delayed tasks
+  // stay in the strands, the group only keeps one timer per parked strand
+  class LooperGroup final {
+    public:
+      static constexpr std::size_t STRAND_BATCH_SIZE = 16;
+
+      // threadCount=0 creates one worker per CPU
+      static std::shared_ptr<LooperGroup> create(
+        const std::string &name = "", std::size_t threadCount = 0) {
+        return std::shared_ptr<LooperGroup>(new LooperGroup(name, threadCount));
+      }
+
+      // the strands are stopped with the group, see stop()
+      ~LooperGroup() {
+        stop();
+        for (auto &thread : threads_) {
+          thread->join();
+        }
+        // strands may still hold the core, but the timer looper must be
+        // released here, not on its own thread
+        core_->setTimerQueue(nullptr);
+      }
+
+      void start() {
+        std::lock_guard<std::mutex> lock(core_->idleMutex);
+        if (core_->running || !threads_.empty()) {
+          return;
+        }
+        core_->running = true;
+        for (std::size_t i = 0; i < core_->workers.size(); ++i) {
+          threads_.emplace_back(
+            std::make_unique<std::thread>(&LooperGroup::runWorker, this, i));
+        }
+        timerLooper_->start();
+      }
+
+      // the strands stop as well, like a Looper that is stopped: their
+      // queued tasks are dropped and later posts fail. a group that is
+      // stopped cannot be started again
+      void stop() {
+        {
+          std::lock_guard<std::mutex> lock(core_->idleMutex);
+          core_->running = false;
+          core_->idleCond.notify_all();
+        }
+        timerLooper_->stop();
+
+        auto strands = std::vector<std::weak_ptr<Looper>>{};
+        {
+          std::lock_guard<std::mutex> lock(core_->strandsMutex);
+          core_->stopped = true;
+          strands.swap(core_->strands);
+        }
+        for (auto &weakStrand : strands) {
+          if (auto strand = weakStrand.lock()) {
+            strand->stop();
+            // no worker may be left to run the strand once more
+            strand->dropPendingTasksIfStopped();
+          }
+        }
+      }
+
+      // the strand keeps a weak reference to the group, it can be used with
+      // any number of TaskQueues, which then share its order. a strand
+      // created after stop() is stopped already
+      std::shared_ptr<Looper> createStrand(const std::string &name = "") {
+        auto strand = std::shared_ptr<Looper>(new Looper(
+            name.empty() ? name_ : name,
+            std::weak_ptr<Looper::Scheduler>(core_)));
+        strand->batchSize_ = STRAND_BATCH_SIZE;
+
+        std::lock_guard<std::mutex> lock(core_->strandsMutex);
+        if (core_->stopped) {
+          return strand;
+        }
+        auto &strands = core_->strands;
+        // forget the strands that are gone before the list has to grow
+        if (strands.size() == strands.capacity()) {
+          strands.erase(
+            std::remove_if(strands.begin(), strands.end(),
+                           [](const std::weak_ptr<Looper> &weakStrand) {
+                             return weakStrand.expired();
+                           }),
+            strands.end());
+        }
+        strands.push_back(strand);
+        strand->running_ = true;
+        return strand;
+      }
+
+      std::string getName() const {
+        return name_;
+      }
+
+      std::size_t getThreadCount() const {
+        return core_->workers.size();
+      }
+
+      bool isRunning() const {
+        return core_->running;
+      }
+
+    private:
+      struct Worker {
+        std::mutex mutex;
+        std::deque<std::shared_ptr<Looper>> strands;  // guarded by mutex
+        const void *core{nullptr};
+        std::size_t index{0};
+      };
+
+      // the part of the group that strands refer to. a strand may briefly
+      // hold the last reference on any thread, so the core owns no threads
+      class Core final : public Looper::Scheduler {
+        public:
+          explicit Core(std::size_t threadCount) {
+            for (std::size_t i = 0; i < threadCount; ++i) {
+              workers.emplace_back(std::make_unique<Worker>());
+              workers.back()->core = this;
+              workers.back()->index = i;
+            }
+          }
+
+          void schedule(const std::shared_ptr<Looper> &strand) override {
+            // keep the strand on the current worker if there is one, it is
+            // likely to touch the same data as the task that woke it up
+            auto worker = currentWorker();
+            auto index = worker ? worker->index :
+              nextWorker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+            enqueue(index, strand, true);
+          }
+
+          void scheduleAfter(
+            const std::shared_ptr<Looper> &strand, int64_t delayUs) override {
+            // the timer must not keep the strand alive
+            auto weakStrand = std::weak_ptr<Looper>(strand);
+            std::lock_guard<std::mutex> lock(timerMutex_);
+            if (timerQueue_) {
+              timerQueue_->postDelayed(delayUs, [weakStrand]{
+                if (auto strand = weakStrand.lock()) {
+                  strand->onWakeUpDue();
+                }
+              });
+            }
+          }
+
+          void setTimerQueue(std::unique_ptr<TaskQueue> timerQueue) {
+            std::lock_guard<std::mutex> lock(timerMutex_);
+            timerQueue_ = std::move(timerQueue);
+          }
+
+          // wakeIdle=false is used by a worker that requeues the strand it
+          // has just run into its own empty queue, it runs the strand next
+          // anyway
+          void enqueue(
+            std::size_t index, const std::shared_ptr<Looper> &strand,
+            bool wakeIdle) {
+            auto &worker = *workers[index];
+            {
+              std::lock_guard<std::mutex> lock(worker.mutex);
+              wakeIdle = wakeIdle || !worker.strands.empty();
+              worker.strands.push_back(strand);
+              pendingCount.fetch_add(1, std::memory_order_seq_cst);
+            }
+
+            // pairs with waitForWork(), which raises idleCount before
+            // checking pendingCount
+            if (wakeIdle && idleCount.load(std::memory_order_seq_cst) > 0) {
+              std::lock_guard<std::mutex> lock(idleMutex);
+              idleCond.notify_one();
+            }
+          }
+
+          // take from the front of the own queue, or steal from the back of
+          // the others, starting from the next worker
+          std::shared_ptr<Looper> take(std::size_t index) {
+            auto count = workers.size();
+            for (std::size_t i = 0; i < count; ++i) {
+              auto &worker = *workers[(index + i) % count];
+              std::lock_guard<std::mutex> lock(worker.mutex);
+              if (worker.strands.empty()) {
+                continue;
+              }
+
+              std::shared_ptr<Looper> strand;
+              if (i == 0) {
+                strand = std::move(worker.strands.front());
+                worker.strands.pop_front();
+              } else {
+                strand = std::move(worker.strands.back());
+                worker.strands.pop_back();
+              }
+              pendingCount.fetch_sub(1, std::memory_order_relaxed);
+              return strand;
+            }
+            return nullptr;
+          }
+
+          void waitForWork() {
+            std::unique_lock<std::mutex> lock(idleMutex);
+            idleCount.fetch_add(1, std::memory_order_seq_cst);
+            while (running &&
+                   pendingCount.load(std::memory_order_seq_cst) == 0) {
+              idleCond.wait(lock);
+            }
+            idleCount.fetch_sub(1, std::memory_order_relaxed);
+          }
+
+          // the worker that runs on the calling thread, if it belongs to
+          // this core
+          Worker *currentWorker() const {
+            auto worker = reinterpret_cast<Worker *>(
+              pthread_getspecific(getThreadLocalWorkerKey()));
+            return worker && worker->core == this ? worker : nullptr;
+          }
+
+          static pthread_key_t getThreadLocalWorkerKey() {
+            static pthread_key_t workerKey;
+            static std::once_flag flag;
+            std::call_once(flag, [] {
+              pthread_key_create(&workerKey, nullptr);
+            });
+            return workerKey;
+          }
+
+        public:
+          std::vector<std::unique_ptr<Worker>> workers;
+          std::atomic<std::size_t> nextWorker{0};
+          std::atomic<std::size_t> pendingCount{0};  // strands in all queues
+          std::atomic<std::size_t> idleCount{0};
+          std::mutex idleMutex;
+          std::condition_variable idleCond;
+          std::atomic<bool> running{false};
+          std::mutex strandsMutex;
+          std::vector<std::weak_ptr<Looper>> strands;  // guarded by strandsMutex
+          bool stopped{false};                         // guarded by strandsMutex
+
+        private:
+          std::mutex timerMutex_;
+          std::unique_ptr<TaskQueue> timerQueue_;     // guarded by timerMutex_
+      };
+
+      LooperGroup(const std::string &name, std::size_t threadCount) :
+        name_(name),
+        core_(std::make_shared<Core>(threadCount > 0 ? threadCount :
+                std::max(1u, std::thread::hardware_concurrency()))),
+        timerLooper_(Looper::create(name.empty() ? "" : name + "-timer")) {
+        // fires the wakeups armed by parked strands
+        core_->setTimerQueue(std::make_unique<TaskQueue>(timerLooper_));
+      }
+
+      void runWorker(std::size_t index) {
+        auto &core = *core_;
+        pthread_setspecific(Core::getThreadLocalWorkerKey(),
+                            core.workers[index].get());
+        if (!name_.empty()) {
+          Looper::setThreadName(name_ + "-" + std::to_string(index));
+        }
+
+        while (core.running) {
+          auto strand = core.take(index);
+          if (!strand) {
+            core.waitForWork();
+            continue;
+          }
+          if (strand->runSlice()) {
+            core.enqueue(index, strand, false);
+          }
+        }
+      }
+
+    private:
+      std::string name_;
+      std::shared_ptr<Core> core_;
+      std::shared_ptr<Looper> timerLooper_;
+      std::vector<std::unique_ptr<std::thread>> threads_;
+  };
+
+} /* end of namespace: nul */
+
+#endif /* end of include guard: LOOPER_GROUP_H_ */
@@ -0,0 +1,322 @@
+/*******************************************************************************
+**          File: looper_watchdog.hpp
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-16 Fri 11:50 PM
+**   Description: a thread that watches all the loopers for tasks that run
+**                too long, and reports them with their post sites
+*******************************************************************************/
+#ifndef LOOPER_WATCHDOG_H_
+#define LOOPER_WATCHDOG_H_
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "looper.hpp"
+#include "log.h"
+
+// capturing the stack of another thread needs backtrace() from glibc
+#if defined(__linux__) && defined(__GLIBC__)
+#define NUL_HAS_STALL_STACKS 1
+#include <execinfo.h>
+#include <signal.h>
+#endif
+
+namespace nul {
+
+  struct StallReport {
+    std::string looperName;
+    const void *queue{nullptr};  // the TaskQueue that posted the task
+    int identity{0};
+    const char *file{nullptr};   // the post site, if known
+    int line{0};
+    int fd{-1};                  // the fd whose callback stalled, if any
+    int64_t runningUs{0};        // how long the task had run when reported
+    // the frames of the stalled thread, if captureStack is set
+    std::vector<std::string> stack;
+  };
+
+  struct WatchdogOptions {
+    // a task that runs this long is reported, once
+    int64_t thresholdUs{1000000};
+    // how often the loopers are checked, 0 for a quarter of the threshold
+    int64_t checkIntervalUs{0};
+    // signal the stalled thread to capture its stack, Linux with glibc only
+    bool captureStack{false};
+    // the signal used for that, 0 for SIGRTMIN + 7. the handler is
+    // installed the first time a stack is captured
+    int stackSignal{0};
+  };
+
+  // watches every Looper and strand that exists while it runs, their tasks
+  // and fd callbacks. a report is made on the watchdog thread, at most one
+  // per task, the default callback logs it. stalls are counted per watchdog
+  // and in Looper::Metrics.
+  //
+  //   auto options = nul::WatchdogOptions{};
+  //   options.thresholdUs = 200000;
+  //   nul::LooperWatchdog watchdog(options);
+  //   watchdog.start();
+  //
+  // tasks are only watched while a watchdog runs, otherwise a batch pays
+  // one relaxed load for it
+  class LooperWatchdog final {
+    public:
+      using Callback = std::function<void(const StallReport &report)>;
+
+      explicit LooperWatchdog(
+        const WatchdogOptions &options = WatchdogOptions(),
+        Callback callback = logStall) :
+        options_(options), callback_(std::move(callback)) {
+        if (options_.checkIntervalUs <= 0) {
+          options_.checkIntervalUs = std::max<int64_t>(
+            options_.thresholdUs / 4, 1000);
+        }
+      }
+
+      LooperWatchdog(const LooperWatchdog &) = delete;
+      LooperWatchdog &operator=(const LooperWatchdog &) = delete;
+
+      ~LooperWatchdog() {
+        stop();
+      }
+
+      void start() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (running_) {
+          return;
+        }
+        running_ = true;
+        Looper::getWatchdogCount().fetch_add(1, std::memory_order_relaxed);
+#ifdef NUL_HAS_STALL_STACKS
+        if (options_.captureStack) {
+          // the first call to backtrace() loads libgcc, which must not
+          // happen in the signal handler
+          void *frame;
+          backtrace(&frame, 1);
+        }
+#endif
+        thread_ = std::thread([this]{ run(); });
+      }
+
+      void stop() {
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          if (!running_) {
+            return;
+          }
+          running_ = false;
+          cond_.notify_one();
+        }
+        thread_.join();
+        Looper::getWatchdogCount().fetch_sub(1, std::memory_order_relaxed);
+      }
+
+      uint64_t getStallCount() const {
+        return stallCount_.load(std::memory_order_relaxed);
+      }
+
+      static void logStall(const StallReport &report) {
+        if (report.fd >= 0) {
+          LOG_W("looper '%s' stalled: callback of fd %d watched by queue %p, "
+                "has run for %" PRId64 "us", report.looperName.c_str(),
+                report.fd, report.queue, report.runningUs);
+        } else {
+          LOG_W("looper '%s' stalled: task of queue %p, identity %d, "
+                "posted at %s:%d, has run for %" PRId64 "us",
+                report.looperName.c_str(), report.queue, report.identity,
+                report.file ? report.file : "?", report.line,
+                report.runningUs);
+        }
+        for (auto &frame : report.stack) {
+          LOG_W("    %s", frame.c_str());
+          static_cast<void>(frame);  // LOG_W may be compiled out
+        }
+      }
+
+    private:
+      void run() {
+        auto lock = std::unique_lock<std::mutex>(mutex_);
+        while (running_) {
+          cond_.wait_for(
+            lock, std::chrono::microseconds(options_.checkIntervalUs));
+          if (!running_) {
+            break;
+          }
+          lock.unlock();
+          for (auto &report : check()) {
+            callback_(report);
+          }
+          lock.lock();
+        }
+      }
+
+      // the stalled loopers are picked under the registry lock and kept
+      // alive, their stacks are captured after it is released, which may
+      // take a while, so that loopers can still come and go meanwhile
+      std::vector<StallReport> check() {
+        struct Stall {
+          std::shared_ptr<Looper> looper;
+          uint32_t seq;
+          pthread_t thread;
+          StallReport report;
+        };
+        auto stalls = std::vector<Stall>{};
+        auto reported = std::unordered_map<const Looper *, uint32_t>{};
+        auto nowUs = Looper::nowUs();
+        {
+          auto &registry = Looper::getRegistry();
+          std::lock_guard<std::mutex> lock(registry.mutex);
+          for (auto looper : registry.loopers) {
+            auto &probe = looper->probe_;
+            auto seq = probe.seq.load(std::memory_order_acquire);
+            if (seq % 2 != 0) {
+              continue;
+            }
+            auto report = StallReport{};
+            auto startUs = probe.startUs.load(std::memory_order_relaxed);
+            report.queue = probe.marker.load(std::memory_order_relaxed);
+            report.identity = probe.identity.load(std::memory_order_relaxed);
+            report.file = probe.file.load(std::memory_order_relaxed);
+            report.line = probe.line.load(std::memory_order_relaxed);
+            report.fd = probe.fd.load(std::memory_order_relaxed);
+            auto thread = probe.thread.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (probe.seq.load(std::memory_order_relaxed) != seq ||
+                startUs == 0 || nowUs - startUs < options_.thresholdUs) {
+              continue;
+            }
+
+            // the task keeps its seq until it finishes
+            auto it = lastReported_.find(looper);
+            reported[looper] = seq;
+            if (it != lastReported_.end() && it->second == seq) {
+              continue;
+            }
+
+            // a looper that is being destroyed is not reported
+            auto alive = looper->weak_from_this().lock();
+            if (!alive) {
+              continue;
+            }
+            report.looperName = looper->getName();
+            report.runningUs = nowUs - startUs;
+            stalls.push_back(
+              Stall{std::move(alive), seq, thread, std::move(report)});
+          }
+        }
+        // forget the loopers that are gone or no longer stalled
+        lastReported_.swap(reported);
+
+        auto reports = std::vector<StallReport>{};
+        for (auto &stall : stalls) {
+#ifdef NUL_HAS_STALL_STACKS
+          if (options_.captureStack) {
+            stall.report.stack = captureStack(stall.thread);
+            // the stack is of another task if this one finished meanwhile
+            if (stall.looper->probe_.seq.load(std::memory_order_acquire) !=
+                stall.seq) {
+              stall.report.stack.clear();
+            }
+          }
+#endif
+          stall.looper->stalledTasks_.fetch_add(1, std::memory_order_relaxed);
+          stallCount_.fetch_add(1, std::memory_order_relaxed);
+          reports.push_back(std::move(stall.report));
+        }
+        return reports;
+      }
+
+#ifdef NUL_HAS_STALL_STACKS
+      static constexpr int MAX_FRAMES = 64;
+
+      // one capture at a time, the handler only fills the frames if the
+      // capture still waits for them
+      struct StackCapture {
+        std::mutex mutex;
+        std::atomic<bool> requested{false};
+        std::atomic<int> depth{-1};
+        void *frames[MAX_FRAMES];
+        int installedSignal{0};  // guarded by mutex
+      };
+
+      static StackCapture &getStackCapture() {
+        static auto capture = new StackCapture();
+        return *capture;
+      }
+
+      static void onStackSignal(int) {
+        auto &capture = getStackCapture();
+        if (capture.requested.exchange(false, std::memory_order_acq_rel)) {
+          capture.depth.store(
+            backtrace(capture.frames, MAX_FRAMES), std::memory_order_release);
+        }
+      }
+
+      std::vector<std::string> captureStack(pthread_t thread) {
+        auto &capture = getStackCapture();
+        std::lock_guard<std::mutex> lock(capture.mutex);
+        auto signal = options_.stackSignal > 0 ?
+          options_.stackSignal : SIGRTMIN + 7;
+        if (capture.installedSignal != signal) {
+          struct sigaction action{};
+          action.sa_handler = onStackSignal;
+          action.sa_flags = SA_RESTART;
+          sigemptyset(&action.sa_mask);
+          if (sigaction(signal, &action, nullptr) != 0) {
+            return {};
+          }
+          capture.installedSignal = signal;
+        }
+
+        capture.depth.store(-1, std::memory_order_relaxed);
+        capture.requested.store(true, std::memory_order_release);
+        if (pthread_kill(thread, signal) != 0) {
+          capture.requested.store(false, std::memory_order_relaxed);
+          return {};
+        }
+        // a thread that is blocked in the kernel takes the signal right
+        // away, give up on one that does not within 100ms
+        auto deadlineUs = Looper::nowUs() + 100000;
+        while (capture.depth.load(std::memory_order_acquire) < 0) {
+          if (Looper::nowUs() >= deadlineUs &&
+              capture.requested.exchange(false, std::memory_order_acq_rel)) {
+            return {};
+          }
+          std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+
+        auto depth = capture.depth.load(std::memory_order_acquire);
+        auto result = std::vector<std::string>{};
+        if (auto symbols = backtrace_symbols(capture.frames, depth)) {
+          // the first frames are the handler and the signal trampoline
+          for (int i = 2; i < depth; ++i) {
+            result.push_back(symbols[i]);
+          }
+          free(symbols);
+        }
+        return result;
+      }
+#endif
+
+    private:
+      WatchdogOptions options_;
+      Callback callback_;
+      std::mutex mutex_;
+      std::condition_variable cond_;
+      bool running_{false};                             // guarded by mutex_
+      std::thread thread_;
+      std::atomic<uint64_t> stallCount_{0};
+      // the seq of the last task reported per looper, watchdog thread only
+      std::unordered_map<const Looper *, uint32_t> lastReported_;
+  };
+
+} /* end of namespace: nul */
+
+#endif /* end of include guard: LOOPER_WATCHDOG_H_ */
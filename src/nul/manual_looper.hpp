@@ -0,0 +1,140 @@
+/*******************************************************************************
+**          File: manual_looper.hpp
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-16 Fri 11:58 PM
+**   Description: a looper that runs on the caller's thread in virtual time,
+**                for tests and simulations of timer driven code
+*******************************************************************************/
+#ifndef MANUAL_LOOPER_H_
+#define MANUAL_LOOPER_H_
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "looper.hpp"
+
+namespace nul {
+
+  // a clock that only moves when it is told to
+  class ManualClock final : public Looper::Clock {
+    public:
+      // the clock may start anywhere, the default leaves room for tests
+      // that look back in time
+      explicit ManualClock(int64_t startUs = 1000000) : nowUs_(startUs) {
+      }
+
+      int64_t nowUs() override {
+        return nowUs_.load(std::memory_order_acquire);
+      }
+
+      // the clock never goes backwards, an earlier time is ignored
+      void advanceTo(int64_t timeUs) {
+        auto now = nowUs_.load(std::memory_order_relaxed);
+        while (now < timeUs && !nowUs_.compare_exchange_weak(
+              now, timeUs, std::memory_order_acq_rel)) {
+        }
+      }
+
+      void advanceBy(int64_t us) {
+        advanceTo(nowUs() + us);
+      }
+
+    private:
+      std::atomic<int64_t> nowUs_;
+  };
+
+  // a Looper that runs nothing until it is told to, on the thread that
+  // tells it, and whose clock only moves then. timers fire in the same
+  // order as on a Looper with a thread, at their trigger times, which is
+  // what the tasks see on the clock, so hours of timeouts and retries run
+  // in as long as their tasks take.
+  //
+  //   auto looper = nul::ManualLooper("sim");
+  //   auto tq = nul::TaskQueue(looper.getLooper());
+  //   tq.postDelayed(30000000, []{ ... });
+  //   looper.advanceBy(30000000);  // runs the task
+  //
+  // tasks may be posted from any thread, but only run in runUntilIdle()
+  // and advanceBy(), which must not be called from two threads at once
+  class ManualLooper final {
+    public:
+      explicit ManualLooper(
+        const std::string &name = "", int64_t startUs = 1000000) :
+        clock_(std::make_shared<ManualClock>(startUs)),
+        scheduler_(std::make_shared<NullScheduler>()),
+        looper_(new Looper(name, scheduler_)) {
+        looper_->setClock(clock_);
+        looper_->start();
+      }
+
+      ManualLooper(const ManualLooper &) = delete;
+      ManualLooper &operator=(const ManualLooper &) = delete;
+
+      // the looper is stopped, TaskQueues that still hold it cannot post
+      ~ManualLooper() {
+        looper_->stop();
+      }
+
+      std::shared_ptr<Looper> getLooper() const {
+        return looper_;
+      }
+
+      // a task may move the clock itself, to stand for a run that takes
+      // that long
+      std::shared_ptr<ManualClock> getClock() const {
+        return clock_;
+      }
+
+      int64_t nowUs() const {
+        return clock_->nowUs();
+      }
+
+      // run the tasks that are ready, and those they post, without moving
+      // the clock. a task that keeps posting itself keeps this from
+      // returning
+      void runUntilIdle() {
+        while (looper_->runSlice()) {
+        }
+      }
+
+      // move the clock to each timer that comes due within us, in order,
+      // and run what is ready there, then leave the clock at now + us
+      void advanceBy(int64_t us) {
+        advanceTo(clock_->nowUs() + us);
+      }
+
+      void advanceTo(int64_t timeUs) {
+        runUntilIdle();
+        while (true) {
+          // the wheel may only know a lower bound, which then moves up
+          // as the clock gets there
+          auto nextTimeUs = looper_->nextTimerTimeUs();
+          if (nextTimeUs < 0 || nextTimeUs > timeUs) {
+            break;
+          }
+          clock_->advanceTo(nextTimeUs);
+          runUntilIdle();
+        }
+        clock_->advanceTo(timeUs);
+        runUntilIdle();
+      }
+
+    private:
+      // nothing to schedule, the looper only runs when it is told to
+      class NullScheduler final : public Looper::Scheduler {
+        public:
+          void schedule(const std::shared_ptr<Looper> &) override {
+          }
+          void scheduleAfter(
+            const std::shared_ptr<Looper> &, int64_t) override {
+          }
+      };
+
+      std::shared_ptr<ManualClock> clock_;
+      std::shared_ptr<Looper::Scheduler> scheduler_;
+      std::shared_ptr<Looper> looper_;
+  };
+
+} /* end of namespace: nul */
+
+#endif /* end of include guard: MANUAL_LOOPER_H_ */
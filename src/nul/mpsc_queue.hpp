@@ -0,0 +1,155 @@
+/*******************************************************************************
+**          File: mpsc_queue.hpp
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-16 Fri 02:10 PM
+**   Description: intrusive lock-free multi-producer/single-consumer queue,
+**                producers never block, each push is a single atomic exchange
+*******************************************************************************/
+#ifndef MPSC_QUEUE_H_
+#define MPSC_QUEUE_H_
+#include <atomic>
+#include <cstddef>
+
+namespace nul {
+
+  // intrusive hook, embed it in the object that is to be queued
+  class MpscNode {
+    private:
+      friend class MpscQueue;
+      friend class MpscChain;
+      std::atomic<MpscNode *> mpscNext_{nullptr};
+  };
+
+  // nodes that are linked up front by one thread and then pushed with a
+  // single exchange, see MpscQueue::push(MpscChain &)
+  class MpscChain final {
+    public:
+      MpscChain() = default;
+      MpscChain(const MpscChain &) = delete;
+      MpscChain &operator=(const MpscChain &) = delete;
+
+      bool empty() const {
+        return !first_;
+      }
+
+      void pushBack(MpscNode *node) {
+        node->mpscNext_.store(nullptr, std::memory_order_relaxed);
+        if (last_) {
+          last_->mpscNext_.store(node, std::memory_order_relaxed);
+        } else {
+          first_ = node;
+        }
+        last_ = node;
+      }
+
+      MpscNode *popFront() {
+        auto node = first_;
+        if (node) {
+          first_ = node->mpscNext_.load(std::memory_order_relaxed);
+          if (!first_) {
+            last_ = nullptr;
+          }
+        }
+        return node;
+      }
+
+    private:
+      friend class MpscQueue;
+      MpscNode *first_{nullptr};
+      MpscNode *last_{nullptr};
+  };
+
+  // Dmitry Vyukov's intrusive MPSC queue. push() may be called from any
+  // thread, pop() and empty() must only be called by one consumer at a time,
+  // the caller is responsible for serializing consumers
+  class MpscQueue final {
+    public:
+      MpscQueue() : head_(&stub_), tail_(&stub_) {}
+      MpscQueue(const MpscQueue &) = delete;
+      MpscQueue &operator=(const MpscQueue &) = delete;
+
+      // the exchange is sequentially consistent so that a producer that
+      // checks a "consumer is parked" flag after pushing cannot miss a
+      // consumer that checks empty() after raising the flag
+      void push(MpscNode *node) {
+        node->mpscNext_.store(nullptr, std::memory_order_relaxed);
+        auto prev = head_.exchange(node, std::memory_order_seq_cst);
+        prev->mpscNext_.store(node, std::memory_order_release);
+      }
+
+      // push all the nodes of chain in order, which leaves it empty
+      void push(MpscChain &chain) {
+        if (chain.empty()) {
+          return;
+        }
+        auto prev = head_.exchange(chain.last_, std::memory_order_seq_cst);
+        prev->mpscNext_.store(chain.first_, std::memory_order_release);
+        chain.first_ = chain.last_ = nullptr;
+      }
+
+      // returns nullptr if the queue is empty, or if a producer is in the
+      // middle of a push, in which case empty() still returns false
+      MpscNode *pop() {
+        auto tail = tail_;
+        auto next = tail->mpscNext_.load(std::memory_order_acquire);
+        if (tail == &stub_) {
+          if (!next) {
+            return nullptr;
+          }
+          tail_ = next;
+          tail = next;
+          next = next->mpscNext_.load(std::memory_order_acquire);
+        }
+
+        if (next) {
+          tail_ = next;
+          return tail;
+        }
+
+        if (tail != head_.load(std::memory_order_acquire)) {
+          return nullptr;
+        }
+
+        push(&stub_);
+        next = tail->mpscNext_.load(std::memory_order_acquire);
+        if (next) {
+          tail_ = next;
+          return tail;
+        }
+        return nullptr;
+      }
+
+      bool empty() const {
+        return tail_ == &stub_ &&
+          head_.load(std::memory_order_seq_cst) == &stub_;
+      }
+
+      // the node pushed last, any thread may call it, a different result
+      // than before means that something was pushed or popped since
+      const MpscNode *lastPushed() const {
+        return head_.load(std::memory_order_seq_cst);
+      }
+
+      // any thread may call it, true means that every node pushed so far
+      // has been popped, false may also mean that a pop is under way
+      bool drained() const {
+        return head_.load(std::memory_order_seq_cst) == &stub_;
+      }
+
+    private:
+      static constexpr std::size_t CACHE_LINE_SIZE = 64;
+
+      // keep producers and the consumer on separate cache lines. padded by
+      // hand rather than with alignas, which would over-align the owner,
+      // and new does not honor that before C++17
+      char headPadding_[CACHE_LINE_SIZE];
+      std::atomic<MpscNode *> head_;              // producers push here
+      char tailPadding_[CACHE_LINE_SIZE - sizeof(std::atomic<MpscNode *>)];
+      MpscNode *tail_;                            // consumer pops here
+      MpscNode stub_;
+      char stubPadding_[CACHE_LINE_SIZE];
+  };
+
+} /* end of namespace: nul */
+
+#endif /* end of include guard: MPSC_QUEUE_H_ */
@@ -0,0 +1,165 @@
+/*******************************************************************************
+**          File: node_pool.hpp
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-16 Fri 04:30 PM
+**   Description: thread-safe lock-free pool of recycled objects, memory is
+**                allocated in chunks of doubling size and never shrinks
+*******************************************************************************/
+#ifndef NODE_POOL_H_
+#define NODE_POOL_H_
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <cstdint>
+#include <type_traits>
+
+namespace nul {
+
+  // objects are addressed by 32-bit slot indices, the free list head packs
+  // a 32-bit tag next to the index so that a stale compare-and-swap fails
+  // instead of corrupting the list (the ABA problem), slots are never
+  // returned to the system before the pool is destroyed, so reading the
+  // link of a slot that has just been taken by another thread is harmless
+  template <typename T>
+  class NodePool final {
+    public:
+      NodePool() = default;
+      NodePool(const NodePool &) = delete;
+      NodePool &operator=(const NodePool &) = delete;
+
+      // all objects must have been released before the pool is destroyed
+      ~NodePool() {
+        for (auto &chunk : chunks_) {
+          delete [] chunk.load(std::memory_order_relaxed);
+        }
+      }
+
+      template <typename ...Args>
+      T *acquire(Args &&...args) {
+        auto slot = popFree();
+        if (!slot) {
+          slot = grow();
+        }
+        return new (&slot->storage) T(std::forward<Args>(args)...);
+      }
+
+      void release(T *obj) {
+        obj->~T();
+        auto slot = reinterpret_cast<Slot *>(obj);
+        if (slot->index == HEAP_INDEX) {
+          delete slot;
+        } else {
+          pushFree(slot, slot);
+        }
+      }
+
+      // number of slots allocated so far, for diagnostics
+      std::size_t capacity() const {
+        auto count = chunkCount_.load(std::memory_order_acquire);
+        return count == 0 ? 0 : chunkSize(count - 1) * 2 - FIRST_CHUNK_SIZE;
+      }
+
+    private:
+      static constexpr uint32_t FIRST_CHUNK_BITS = 6;
+      static constexpr uint32_t FIRST_CHUNK_SIZE = 1u << FIRST_CHUNK_BITS;
+      static constexpr uint32_t MAX_CHUNK_COUNT = 24;  // ~1 billion slots
+      static constexpr uint32_t HEAP_INDEX = UINT32_MAX;
+
+      struct Slot {
+        // storage must come first, objects are converted back to slots
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+        std::atomic<uint32_t> next{0};  // index + 1 of the next free slot
+        uint32_t index{HEAP_INDEX};
+      };
+
+      static std::size_t chunkSize(uint32_t chunk) {
+        return std::size_t{FIRST_CHUNK_SIZE} << chunk;
+      }
+
+      // chunk k holds the indices [FIRST_CHUNK_SIZE * (2^k - 1), ...)
+      Slot *slotAt(uint32_t index) const {
+        auto biased = index + FIRST_CHUNK_SIZE;
+        auto chunk = 31 - __builtin_clz(biased) - FIRST_CHUNK_BITS;
+        auto offset = biased - (FIRST_CHUNK_SIZE << chunk);
+        return &chunks_[chunk].load(std::memory_order_acquire)[offset];
+      }
+
+      Slot *popFree() {
+        auto head = freeHead_.load(std::memory_order_acquire);
+        while (true) {
+          auto link = static_cast<uint32_t>(head);
+          if (link == 0) {
+            return nullptr;
+          }
+          auto slot = slotAt(link - 1);
+          auto next = slot->next.load(std::memory_order_relaxed);
+          auto newHead = nextTag(head) | next;
+          if (freeHead_.compare_exchange_weak(
+                head, newHead,
+                std::memory_order_acquire, std::memory_order_acquire)) {
+            return slot;
+          }
+        }
+      }
+
+      // push the chain first..last, which is already linked through next
+      void pushFree(Slot *first, Slot *last) {
+        auto head = freeHead_.load(std::memory_order_relaxed);
+        while (true) {
+          last->next.store(
+            static_cast<uint32_t>(head), std::memory_order_relaxed);
+          auto newHead = nextTag(head) | (first->index + 1);
+          if (freeHead_.compare_exchange_weak(
+                head, newHead,
+                std::memory_order_release, std::memory_order_relaxed)) {
+            return;
+          }
+        }
+      }
+
+      static uint64_t nextTag(uint64_t head) {
+        return ((head >> 32) + 1) << 32;
+      }
+
+      Slot *grow() {
+        std::lock_guard<std::mutex> lock(growMutex_);
+        // another thread may have refilled the free list in the meantime
+        auto slot = popFree();
+        if (slot) {
+          return slot;
+        }
+
+        auto chunk = chunkCount_.load(std::memory_order_relaxed);
+        if (chunk == MAX_CHUNK_COUNT) {
+          return new Slot();
+        }
+
+        auto size = chunkSize(chunk);
+        auto base = static_cast<uint32_t>(size - FIRST_CHUNK_SIZE);
+        auto slots = new Slot[size];
+        for (std::size_t i = 0; i < size; ++i) {
+          slots[i].index = base + static_cast<uint32_t>(i);
+          if (i + 1 < size) {
+            slots[i].next.store(base + i + 2, std::memory_order_relaxed);
+          }
+        }
+        chunks_[chunk].store(slots, std::memory_order_release);
+        chunkCount_.store(chunk + 1, std::memory_order_release);
+
+        // keep the first slot, hand the rest to the free list
+        if (size > 1) {
+          pushFree(&slots[1], &slots[size - 1]);
+        }
+        return &slots[0];
+      }
+
+    private:
+      std::atomic<uint64_t> freeHead_{0};  // (tag << 32) | (index + 1)
+      std::atomic<Slot *> chunks_[MAX_CHUNK_COUNT]{};
+      std::atomic<uint32_t> chunkCount_{0};
+      std::mutex growMutex_;
+  };
+
+} /* end of namespace: nul */
+
+#endif /* end of include guard: NODE_POOL_H_ */
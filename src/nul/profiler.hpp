@@ -9,6 +9,8 @@
 #include <chrono>
 #include <string>
 #include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
 #include <type_traits>
 #include <time.h>
 #include <sys/time.h>
@@ -0,0 +1,121 @@
+/*******************************************************************************
+**          File: task_bound.hpp
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-16 Fri 10:40 PM
+**   Description: a counter of pending tasks with a capacity, producers that
+**                find it full can park on it until a task leaves
+*******************************************************************************/
+#ifndef TASK_BOUND_H_
+#define TASK_BOUND_H_
+#include <atomic>
+#include <cstdint>
+#include <algorithm>
+
+#include "task_future.hpp"
+
+namespace nul {
+
+  // the count is only kept while the capacity is set, tasks that were
+  // admitted remember so and release what they acquired. a bound is
+  // refcounted by its owner and the tasks that hold a slot, so that a
+  // TaskQueue can go away before its tasks do
+  class TaskBound final {
+    public:
+      void setCapacity(std::size_t capacity, int policy) {
+        capacity_.store(static_cast<uint32_t>(
+            std::min<std::size_t>(capacity, UINT32_MAX)),
+          std::memory_order_relaxed);
+        policy_.store(policy, std::memory_order_relaxed);
+        wakeWaiters();
+      }
+
+      // 0 for no bound
+      uint32_t capacity() const {
+        return capacity_.load(std::memory_order_relaxed);
+      }
+
+      int policy() const {
+        return policy_.load(std::memory_order_relaxed);
+      }
+
+      uint32_t pending() const {
+        return pending_.load(std::memory_order_relaxed);
+      }
+
+      // take a slot if there is room, otherwise seen is the count that was
+      // found, see waitForRoom()
+      bool tryAcquire(uint32_t &seen) {
+        auto count = pending_.load(std::memory_order_relaxed);
+        while (true) {
+          auto capacity = capacity_.load(std::memory_order_relaxed);
+          if (closed_.load(std::memory_order_relaxed) ||
+              (capacity != 0 && count >= capacity)) {
+            seen = count;
+            return false;
+          }
+          if (pending_.compare_exchange_weak(
+                count, count + 1, std::memory_order_relaxed)) {
+            return true;
+          }
+        }
+      }
+
+      // take a slot beyond the capacity
+      void acquire() {
+        pending_.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      void release() {
+        pending_.fetch_sub(1, std::memory_order_seq_cst);
+        if (waiters_.load(std::memory_order_seq_cst) > 0) {
+          AddressParker::wakeAll(&pending_);
+        }
+      }
+
+      // park until the count moves away from seen, or for up to timeoutUs
+      void waitForRoom(uint32_t seen, int64_t timeoutUs) {
+        waiters_.fetch_add(1, std::memory_order_seq_cst);
+        if (!closed_.load(std::memory_order_seq_cst)) {
+          AddressParker::wait(&pending_, seen, timeoutUs);
+        }
+        waiters_.fetch_sub(1, std::memory_order_relaxed);
+      }
+
+      void wakeWaiters() {
+        if (waiters_.load(std::memory_order_seq_cst) > 0) {
+          AddressParker::wakeAll(&pending_);
+        }
+      }
+
+      // no slot is handed out any more, parked producers give up
+      void close() {
+        closed_.store(true, std::memory_order_seq_cst);
+        AddressParker::wakeAll(&pending_);
+      }
+
+      bool isClosed() const {
+        return closed_.load(std::memory_order_relaxed);
+      }
+
+      void retain() {
+        refs_.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      void unref() {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          delete this;
+        }
+      }
+
+    private:
+      std::atomic<uint32_t> pending_{0};
+      std::atomic<uint32_t> waiters_{0};
+      std::atomic<uint32_t> capacity_{0};
+      std::atomic<int> policy_{0};
+      std::atomic<bool> closed_{false};
+      std::atomic<int> refs_{1};  // the owner and the tasks holding a slot
+  };
+
+} /* end of namespace: nul */
+
+#endif /* end of include guard: TASK_BOUND_H_ */
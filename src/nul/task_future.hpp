@@ -0,0 +1,335 @@
+/*******************************************************************************
+**          File: task_future.hpp
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-16 Fri 08:40 PM
+**   Description: one-shot promise/future pair for the result of a posted
+**                task, the shared state comes from a pool and waiting parks
+**                on a futex, so neither heap nor mutex is involved
+*******************************************************************************/
+#ifndef TASK_FUTURE_H_
+#define TASK_FUTURE_H_
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+
+#include "node_pool.hpp"
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <ctime>
+#endif
+
+namespace nul {
+
+  template <typename R> class TaskPromise;
+
+  // what calling a Fn lvalue with no arguments returns, std::result_of is
+  // deprecated in C++17 and removed in C++20
+  template <typename Fn>
+  using CallResult = decltype(std::declval<Fn &>()());
+
+  // sleep while *addr == expected, for up to timeoutUs (-1 for infinity),
+  // may return spuriously. outside Linux, waiters share a small table of
+  // mutexes and condition variables instead of owning one each
+  class AddressParker final {
+    public:
+      static void wait(
+        std::atomic<uint32_t> *addr, uint32_t expected, int64_t timeoutUs) {
+#ifdef __linux__
+        timespec ts;
+        if (timeoutUs >= 0) {
+          ts.tv_sec = timeoutUs / 1000000;
+          ts.tv_nsec = (timeoutUs % 1000000) * 1000;
+        }
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr),
+                FUTEX_WAIT_PRIVATE, expected,
+                timeoutUs >= 0 ? &ts : nullptr, nullptr, 0);
+#else
+        auto &bucket = bucketOf(addr);
+        std::unique_lock<std::mutex> lock(bucket.mutex);
+        if (addr->load(std::memory_order_acquire) != expected) {
+          return;
+        }
+        if (timeoutUs < 0) {
+          bucket.cond.wait(lock);
+        } else {
+          bucket.cond.wait_for(lock, std::chrono::microseconds(timeoutUs));
+        }
+#endif
+      }
+
+      static void wakeAll(std::atomic<uint32_t> *addr) {
+#ifdef __linux__
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr),
+                FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+#else
+        auto &bucket = bucketOf(addr);
+        std::lock_guard<std::mutex> lock(bucket.mutex);
+        bucket.cond.notify_all();
+#endif
+      }
+
+#ifndef __linux__
+    private:
+      struct Bucket {
+        std::mutex mutex;
+        std::condition_variable cond;
+      };
+
+      static Bucket &bucketOf(const void *addr) {
+        static Bucket buckets[64];
+        return buckets[(reinterpret_cast<uintptr_t>(addr) >> 4) % 64];
+      }
+#endif
+  };
+
+  // the state shared by a TaskPromise and its TaskFuture
+  template <typename R>
+  class TaskState final {
+    public:
+      enum Status : uint32_t {
+        PENDING = 0,
+        READY = 1,    // the task ran, the result can be taken
+        BROKEN = 2,   // the task was dropped without running
+        WAITING = 4,  // flag, a waiter is parked on status
+      };
+
+      static TaskState *create() {
+        return pool().acquire();
+      }
+
+      void release() {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          if (status.load(std::memory_order_relaxed) == READY) {
+            result.destroy();
+          }
+          pool().release(this);
+        }
+      }
+
+      // READY requires the result to have been set
+      void complete(uint32_t newStatus) {
+        auto old = status.exchange(newStatus, std::memory_order_acq_rel);
+        if (old & WAITING) {
+          AddressParker::wakeAll(&status);
+        }
+      }
+
+      // returns the status, PENDING only if timeoutUs (-1 for infinity)
+      // elapsed
+      uint32_t wait(int64_t timeoutUs) {
+        using namespace std::chrono;
+        auto deadline = steady_clock::now() + microseconds(timeoutUs);
+        while (true) {
+          auto current = status.load(std::memory_order_acquire);
+          if (current == READY || current == BROKEN) {
+            return current;
+          }
+          auto remainingUs = int64_t{-1};
+          if (timeoutUs >= 0) {
+            remainingUs = duration_cast<microseconds>(
+              deadline - steady_clock::now()).count();
+            if (remainingUs <= 0) {
+              return PENDING;
+            }
+          }
+          // tell the completer that it has to wake us up
+          if (current == PENDING &&
+              !status.compare_exchange_strong(
+                current, PENDING | WAITING, std::memory_order_acquire)) {
+            continue;
+          }
+          AddressParker::wait(&status, PENDING | WAITING, remainingUs);
+        }
+      }
+
+    private:
+      template <typename T, typename = void>
+      struct Result {
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+        template <typename U>
+        void set(U &&value) {
+          new (&storage) T(std::forward<U>(value));
+        }
+        T take() {
+          return std::move(*reinterpret_cast<T *>(&storage));
+        }
+        void destroy() {
+          reinterpret_cast<T *>(&storage)->~T();
+        }
+      };
+
+      template <typename Unused>
+      struct Result<void, Unused> {
+        void set() {}
+        void take() {}
+        void destroy() {}
+      };
+
+    public:
+      std::atomic<uint32_t> status{PENDING};
+      std::atomic<int> refs{2};  // the promise and the future
+      Result<R> result;
+
+    private:
+      static NodePool<TaskState> &pool() {
+        static NodePool<TaskState> statePool;
+        return statePool;
+      }
+  };
+
+  template <typename R>
+  class TaskFuture final {
+    using State = TaskState<R>;
+
+    public:
+      enum Status {
+        PENDING = State::PENDING,
+        READY = State::READY,
+        BROKEN = State::BROKEN,
+      };
+
+      TaskFuture() = default;
+      TaskFuture(TaskFuture &&other) noexcept : state_(other.state_) {
+        other.state_ = nullptr;
+      }
+      TaskFuture &operator=(TaskFuture &&other) noexcept {
+        if (this != &other) {
+          reset();
+          state_ = other.state_;
+          other.state_ = nullptr;
+        }
+        return *this;
+      }
+      TaskFuture(const TaskFuture &) = delete;
+      TaskFuture &operator=(const TaskFuture &) = delete;
+
+      ~TaskFuture() {
+        reset();
+      }
+
+      bool valid() const {
+        return state_ != nullptr;
+      }
+
+      Status status() const {
+        auto status = state_->status.load(std::memory_order_acquire);
+        return static_cast<Status>(status & ~State::WAITING);
+      }
+
+      // true if the task ran, false if it was dropped without running
+      // (removed, or the looper stopped or the queue was detached)
+      bool wait() {
+        return state_->wait(-1) == State::READY;
+      }
+
+      // PENDING if the task has not completed within timeoutUs
+      Status waitFor(int64_t timeoutUs) {
+        return static_cast<Status>(state_->wait(std::max<int64_t>(timeoutUs, 0)));
+      }
+
+      // waits for the result, which can be taken once, after which the
+      // future is invalid. the task must have run: get() aborts if it was
+      // dropped, so call wait() first where that may happen
+      R get() {
+        if (!wait()) {
+          std::abort();
+        }
+        struct Releaser {
+          State *state;
+          ~Releaser() { state->release(); }
+        } releaser{state_};
+        state_ = nullptr;
+        return releaser.state->result.take();
+      }
+
+    private:
+      friend class TaskPromise<R>;
+      explicit TaskFuture(State *state) : state_(state) {}
+
+      void reset() {
+        if (state_) {
+          state_->release();
+          state_ = nullptr;
+        }
+      }
+
+    private:
+      State *state_{nullptr};
+  };
+
+  // held by the posted task, a promise that is destroyed without being
+  // completed breaks its future
+  template <typename R>
+  class TaskPromise final {
+    using State = TaskState<R>;
+
+    public:
+      TaskPromise() : state_(State::create()) {}
+      TaskPromise(TaskPromise &&other) noexcept : state_(other.state_) {
+        other.state_ = nullptr;
+      }
+      TaskPromise &operator=(TaskPromise &&) = delete;
+      TaskPromise(const TaskPromise &) = delete;
+      TaskPromise &operator=(const TaskPromise &) = delete;
+
+      ~TaskPromise() {
+        if (state_) {
+          state_->complete(State::BROKEN);
+          state_->release();
+        }
+      }
+
+      // must be called once, before the promise is moved into a task
+      TaskFuture<R> getFuture() {
+        return TaskFuture<R>(state_);
+      }
+
+      // run fn and complete the future with what it returns
+      template <typename Fn>
+      void run(Fn &fn) {
+        Invoker<R>::run(*this, fn);
+      }
+
+      template <typename ...T>
+      void setValue(T &&...value) {
+        state_->result.set(std::forward<T>(value)...);
+        state_->complete(State::READY);
+        state_->release();
+        state_ = nullptr;
+      }
+
+    private:
+      template <typename T, typename = void>
+      struct Invoker {
+        template <typename Fn>
+        static void run(TaskPromise &promise, Fn &fn) {
+          promise.setValue(fn());
+        }
+      };
+
+      template <typename Unused>
+      struct Invoker<void, Unused> {
+        template <typename Fn>
+        static void run(TaskPromise &promise, Fn &fn) {
+          fn();
+          promise.setValue();
+        }
+      };
+
+    private:
+      State *state_;
+  };
+
+} /* end of namespace: nul */
+
+#endif /* end of include guard: TASK_FUTURE_H_ */
@@ -3,7 +3,7 @@
 **        Author: neevek <i@neevek.net>.
 ** Creation Time: 2019-08-25 Sun 10:36 AM
 **   Description: a class that schedules and runs queued tasks in a dedicated
-**                thread or in std thread pool using std::async
+**                thread or in a pool of worker threads
 *******************************************************************************/
 #ifndef TASK_QUEUE_H_
 #define TASK_QUEUE_H_
@@ -14,8 +14,11 @@
 #include <functional>
 #include <queue>
 #include <deque>
+#include <algorithm>
+#include <memory>
 #include <chrono>
 #include <future>
+#include <vector>
 #include <pthread.h>
 
 #ifdef __ANDROID__
@@ -72,13 +75,36 @@ namespace nul {
       std::string name;
       int64_t triggerTimeMs;
       int64_t intervalMs; // zero if no repeat
+      int repeatPolicy{0}; // TaskQueue::RepeatPolicy bits
+      uint32_t maxCatchUp{0};
+      // set by TaskQueue::remove() while a repeated task is out of the
+      // queue for a run, guarded by the mutex of the TaskQueue
+      bool removed{false};
       std::function<void()> task;
   };
 
   class TaskQueue final {
     public:
-      TaskQueue(const std::string &name = "", bool useStdAsync = false) :
-        name_(name), useStdAsync_(useStdAsync) {}
+      // how a repeated task is scheduled again after a run, one REPEAT_FIXED_*
+      // mode or'ed with one policy for the runs that a fixed rate task
+      // missed because the queue was busy or stalled
+      enum RepeatPolicy {
+        REPEAT_FIXED_RATE = 0,            // runs at delay + n * interval
+        REPEAT_FIXED_DELAY = 1 << 0,      // runs interval after a run ends
+        REPEAT_CATCH_UP = 0,              // missed runs go back to back
+        REPEAT_SKIP_MISSED = 1 << 1,      // the next run is the next tick
+        REPEAT_COALESCE_MISSED = 1 << 2,  // one run for all of them, now
+      };
+
+      // with useWorkerPool, the queue thread only schedules, tasks run on
+      // workerCount persistent threads (0 for one per CPU) in parallel, and
+      // a repeated task is scheduled again after its run finishes. the
+      // workers share a queue of a few tasks per worker, the queue thread
+      // waits for room in it, the tasks behind stay here
+      TaskQueue(
+        const std::string &name = "", bool useWorkerPool = false,
+        std::size_t workerCount = 0) :
+        name_(name), useWorkerPool_(useWorkerPool), workerCount_(workerCount) {}
       TaskQueue(const TaskQueue &) = delete;
       TaskQueue &operator=(const TaskQueue &) = delete;
 
@@ -89,6 +115,9 @@ namespace nul {
           stop(true);
           t_->join();
         }
+        // the workers finish what they have been given, which may post
+        // repeated tasks back to us
+        pool_.reset();
       }
 
       template <typename Callable, typename ...Args>
@@ -173,9 +202,26 @@ namespace nul {
           name, delayMs, intervalMs, task, std::forward<Args>(args)...);
       }
 
+      // applies to the tasks that are posted to postAtInterval() afterwards,
+      // REPEAT_FIXED_RATE | REPEAT_CATCH_UP by default. a fixed rate task
+      // replays at most maxCatchUp missed runs (0 for all of them) with
+      // REPEAT_CATCH_UP
+      void setRepeatPolicy(int policy, uint32_t maxCatchUp = 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        repeatPolicy_ = policy;
+        maxCatchUp_ = maxCatchUp;
+      }
+
+      // a repeated task that is being run is not run again
       void remove(const std::string &name) {
         std::lock_guard<std::mutex> lock(mutex_);
 
+        for (auto timedTask : runningTimedTasks_) {
+          if (name == timedTask->name) {
+            timedTask->removed = true;
+          }
+        }
+
         auto it = delayedQ_.begin();
         while (it != delayedQ_.end()) {
           if (name == (*it)->name) {
@@ -192,6 +238,9 @@ namespace nul {
         std::lock_guard<std::mutex> lock(mutex_);
         if (!t_) {
           running_ = true;
+          if (useWorkerPool_) {
+            pool_ = std::make_unique<WorkerPool>(name_, workerCount_);
+          }
           t_ = std::make_unique<std::thread>(&TaskQueue::run, this);
         }
       }
@@ -216,14 +265,87 @@ namespace nul {
       }
 
     private:
-      void run() {
-        if (!name_.empty()) {
+      // a fixed number of threads that take tasks from one shared queue,
+      // tasks that are queued when the pool is destroyed still run
+      class WorkerPool final {
+        public:
+          static constexpr std::size_t MAX_QUEUED_PER_WORKER = 4;
+
+          WorkerPool(const std::string &name, std::size_t workerCount) {
+            if (workerCount == 0) {
+              workerCount = std::max(std::thread::hardware_concurrency(), 1u);
+            }
+            capacity_ = workerCount * MAX_QUEUED_PER_WORKER;
+            for (std::size_t i = 0; i < workerCount; ++i) {
+              workers_.emplace_back([this, name, i]{
+                setThreadName(
+                  name.empty() ? name : name + "-" + std::to_string(i));
+                work();
+              });
+            }
+          }
+
+          ~WorkerPool() {
+            {
+              std::lock_guard<std::mutex> lock(mutex_);
+              stopping_ = true;
+              cond_.notify_all();
+            }
+            for (auto &worker : workers_) {
+              worker.join();
+            }
+          }
+
+          // waits while the queue is full
+          void post(std::function<void()> task) {
+            auto lock = std::unique_lock<std::mutex>(mutex_);
+            notFullCond_.wait(lock, [this]{ return q_.size() < capacity_; });
+            q_.push(std::move(task));
+            cond_.notify_one();
+          }
+
+        private:
+          void work() {
+            auto lock = std::unique_lock<std::mutex>(mutex_);
+            while (true) {
+              cond_.wait(lock, [this]{ return stopping_ || !q_.empty(); });
+              if (q_.empty()) {
+                break;
+              }
+              auto task = std::move(q_.front());
+              q_.pop();
+              notFullCond_.notify_one();
+              lock.unlock();
+              task();
+              lock.lock();
+            }
+          }
+
+        private:
+          std::queue<std::function<void()>> q_;
+          std::size_t capacity_;
+          std::vector<std::thread> workers_;
+          std::condition_variable cond_;
+          std::condition_variable notFullCond_;
+          std::mutex mutex_;
+          bool stopping_{false};
+      };
+
+      static void setThreadName(const std::string &name) {
+        if (!name.empty()) {
 #ifdef __ANDROID__
-          prctl(PR_SET_NAME, (unsigned long)name_.c_str(), 0, 0, 0);
+          prctl(PR_SET_NAME, (unsigned long)name.c_str(), 0, 0, 0);
 #elif __APPLE__
-          pthread_setname_np(name_.c_str());
+          pthread_setname_np(name.c_str());
+#elif __linux__
+          // longer names are rejected, 15 characters and the terminator
+          pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
 #endif
         }
+      }
+
+      void run() {
+        setThreadName(name_);
 
         using namespace std::chrono;
 
@@ -234,8 +356,8 @@ namespace nul {
             q_.pop();
 
             lock.unlock();
-            if (useStdAsync_) {
-              std::async(std::launch::async, std::cref(task));
+            if (pool_) {
+              pool_->post(std::move(task));
             } else {
               task();
             }
@@ -245,23 +367,25 @@ namespace nul {
             lock = std::unique_lock<std::mutex>(mutex_);
           }
           if (!delayedQ_.empty()) {
-            auto now = duration_cast<milliseconds>(
-              system_clock::now().time_since_epoch()).count();
+            auto now = nowMs();
             auto &timedTaskRef = delayedQ_.front();
             if (now >= timedTaskRef->triggerTimeMs) {
               auto timedTask = std::move(delayedQ_.front());
               delayedQ_.pop_front();
+              if (timedTask->intervalMs > 0) {
+                runningTimedTasks_.push_back(timedTask.get());
+              }
               lock.unlock();
 
-              if (useStdAsync_) {
-                std::async(std::launch::async, std::cref(timedTask->task));
+              if (pool_) {
+                // std::function must be copyable, the worker takes the
+                // task back over, so that runs of it never overlap
+                auto rawTask = timedTask.release();
+                pool_->post([this, rawTask]{
+                  runTimedTask(std::unique_ptr<TimedTask>(rawTask));
+                });
               } else {
-                timedTask->task();
-              }
-
-              if (timedTask->intervalMs > 0) {
-                timedTask->triggerTimeMs += timedTask->intervalMs;
-                addTimedTask(std::move(timedTask));
+                runTimedTask(std::move(timedTask));
               }
             }
           }
@@ -278,8 +402,7 @@ namespace nul {
 
             if (!delayedQ_.empty()) {
               auto triggerTimeMs = delayedQ_.front()->triggerTimeMs;
-              auto delay = triggerTimeMs - duration_cast<milliseconds>(
-                system_clock::now().time_since_epoch()).count();
+              auto delay = triggerTimeMs - nowMs();
               cond_.wait_for(lock, milliseconds(delay > 0 ? delay : 0));
 
             } else {
@@ -289,6 +412,67 @@ namespace nul {
         }
       }
 
+      // monotonic, so that adjusting the wall clock does not move timers
+      static int64_t nowMs() {
+        using namespace std::chrono;
+        return duration_cast<milliseconds>(
+          steady_clock::now().time_since_epoch()).count();
+      }
+
+      // a repeated task is in runningTimedTasks_ from the time it leaves
+      // delayedQ_, a removal in the meantime flags it, which keeps it from
+      // running if it has not started yet, and from being queued again
+      void runTimedTask(std::unique_ptr<TimedTask> timedTask) {
+        if (timedTask->intervalMs <= 0) {
+          timedTask->task();
+          return;
+        }
+
+        if (!isRemoved(*timedTask)) {
+          timedTask->task();
+        }
+        scheduleNextRun(*timedTask);
+        std::lock_guard<std::mutex> lock(mutex_);
+        runningTimedTasks_.erase(std::find(
+            runningTimedTasks_.begin(), runningTimedTasks_.end(),
+            timedTask.get()));
+        if (!timedTask->removed) {
+          addTimedTaskLocked(std::move(timedTask));
+        }
+      }
+
+      bool isRemoved(const TimedTask &timedTask) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return timedTask.removed;
+      }
+
+      // the runs of a fixed rate task that are due already have been
+      // missed, those that are kept run back to back, the others are
+      // dropped, so the task stays on its grid of ticks
+      static void scheduleNextRun(TimedTask &timedTask) {
+        auto now = nowMs();
+        if (timedTask.repeatPolicy & REPEAT_FIXED_DELAY) {
+          timedTask.triggerTimeMs = now + timedTask.intervalMs;
+          return;
+        }
+
+        timedTask.triggerTimeMs += timedTask.intervalMs;
+        if (timedTask.triggerTimeMs > now) {
+          return;
+        }
+        auto missed =
+          (now - timedTask.triggerTimeMs) / timedTask.intervalMs + 1;
+        auto kept = missed;
+        if (timedTask.repeatPolicy & REPEAT_SKIP_MISSED) {
+          kept = 0;
+        } else if (timedTask.repeatPolicy & REPEAT_COALESCE_MISSED) {
+          kept = 1;
+        } else if (timedTask.maxCatchUp > 0) {
+          kept = std::min<int64_t>(missed, timedTask.maxCatchUp);
+        }
+        timedTask.triggerTimeMs += (missed - kept) * timedTask.intervalMs;
+      }
+
       template <typename Callable, typename ...Args>
       bool postAtIntervalInternal(
         const std::string &name, int64_t delayMs,
@@ -298,20 +482,25 @@ namespace nul {
           delayMs = 0;
         }
 
-        using namespace std::chrono;
-        auto triggerTimeMs = duration_cast<milliseconds>(
-          system_clock::now().time_since_epoch()).count() + delayMs;
-
         auto timedTask = std::make_unique<TimedTask>(
-          name, triggerTimeMs, intervalMs,
+          name, nowMs() + delayMs, intervalMs,
           std::bind(task, std::forward<Args>(args)...)
         );
+        if (intervalMs > 0) {
+          std::lock_guard<std::mutex> lock(mutex_);
+          timedTask->repeatPolicy = repeatPolicy_;
+          timedTask->maxCatchUp = maxCatchUp_;
+        }
 
         return addTimedTask(std::move(timedTask));
       }
 
       bool addTimedTask(std::unique_ptr<TimedTask> timedTask) {
         std::lock_guard<std::mutex> lock(mutex_);
+        return addTimedTaskLocked(std::move(timedTask));
+      }
+
+      bool addTimedTaskLocked(std::unique_ptr<TimedTask> timedTask) {
         if (!running_ || gracefulStopping_) {
           return false;
         }
@@ -337,14 +526,20 @@ namespace nul {
     private:
       std::queue<std::function<void()>> q_;
       std::deque<std::unique_ptr<TimedTask>> delayedQ_;
+      // the repeated tasks that have left delayedQ_ to run
+      std::vector<TimedTask *> runningTimedTasks_;
       std::unique_ptr<std::thread> t_{nullptr};
       std::condition_variable cond_;
       mutable std::mutex mutex_;
 
       std::string name_;
-      bool useStdAsync_;
+      bool useWorkerPool_;
+      std::size_t workerCount_;
       bool running_{false};
       bool gracefulStopping_{false};
+      int repeatPolicy_{REPEAT_FIXED_RATE};
+      uint32_t maxCatchUp_{0};
+      std::unique_ptr<WorkerPool> pool_;  // set by start() if useWorkerPool_
   };
 
 } /* end of namespace: nul */
@@ -0,0 +1,352 @@
+/*******************************************************************************
+**          File: timer_wheel.hpp
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-16 Fri 10:20 AM
+**   Description: hierarchical timing wheel with O(1) insertion and removal,
+**                timers that share the same trigger time fire in FIFO order
+*******************************************************************************/
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
+
+namespace nul {
+
+  class TimerList;
+
+  // intrusive hook, embed it in the object that is to be scheduled
+  class TimerNode {
+    public:
+      int64_t triggerTimeUs{0};
+
+    private:
+      friend class TimerList;
+      friend class TimerWheel;
+
+      TimerNode *prev_{nullptr};
+      TimerNode *next_{nullptr};
+      TimerList *list_{nullptr};  // the list that holds this node
+      uint64_t seq_{0};           // insertion order, used to break ties
+  };
+
+  class TimerList final {
+    public:
+      bool empty() const {
+        return head_ == nullptr;
+      }
+
+      TimerNode *front() const {
+        return head_;
+      }
+
+      void pushBack(TimerNode *node) {
+        insertBefore(nullptr, node);
+      }
+
+      // insert node in (triggerTimeUs, seq) order, scan from the tail because
+      // new timers tend to trigger later than the ones already queued
+      void insertSorted(TimerNode *node) {
+        auto pos = tail_;
+        while (pos && (node->triggerTimeUs < pos->triggerTimeUs ||
+                       (node->triggerTimeUs == pos->triggerTimeUs &&
+                        node->seq_ < pos->seq_))) {
+          pos = pos->prev_;
+        }
+        insertBefore(pos ? pos->next_ : head_, node);
+      }
+
+      void remove(TimerNode *node) {
+        assert(node->list_ == this);
+        if (node->prev_) {
+          node->prev_->next_ = node->next_;
+        } else {
+          head_ = node->next_;
+        }
+        if (node->next_) {
+          node->next_->prev_ = node->prev_;
+        } else {
+          tail_ = node->prev_;
+        }
+        node->prev_ = node->next_ = nullptr;
+        node->list_ = nullptr;
+      }
+
+      // detach all nodes, returns the head of the detached chain
+      TimerNode *release() {
+        auto head = head_;
+        head_ = tail_ = nullptr;
+        return head;
+      }
+
+    private:
+      void insertBefore(TimerNode *pos, TimerNode *node) {
+        node->list_ = this;
+        node->next_ = pos;
+        node->prev_ = pos ? pos->prev_ : tail_;
+        if (node->prev_) {
+          node->prev_->next_ = node;
+        } else {
+          head_ = node;
+        }
+        if (pos) {
+          pos->prev_ = node;
+        } else {
+          tail_ = node;
+        }
+      }
+
+    private:
+      friend class TimerWheel;
+
+      TimerNode *head_{nullptr};
+      TimerNode *tail_{nullptr};
+  };
+
+  // time is divided into ticks of 2^TICK_SHIFT microseconds, a timer is put
+  // into the slot of the lowest level that can represent its distance to the
+  // current tick, and is cascaded to lower levels as time goes by. timers
+  // whose tick has been reached are moved to a due list sorted by trigger time,
+  // so the wheel yields timers in exactly the same order as a sorted queue
+  class TimerWheel final {
+    public:
+      static constexpr int TICK_SHIFT = 10;     // 1 tick = 1024us
+      static constexpr int SLOT_BITS = 6;
+      static constexpr int SLOT_COUNT = 1 << SLOT_BITS;
+      static constexpr int LEVEL_COUNT = 6;     // 2^36 ticks, about 2.2 years
+
+      TimerWheel() = default;
+      TimerWheel(const TimerWheel &) = delete;
+      TimerWheel &operator=(const TimerWheel &) = delete;
+
+      bool empty() const {
+        return size_ == 0;
+      }
+
+      std::size_t size() const {
+        return size_;
+      }
+
+      bool contains(const TimerNode *node) const {
+        return node->list_ != nullptr;
+      }
+
+      void add(TimerNode *node) {
+        assert(node->list_ == nullptr);
+        node->seq_ = nextSeq_++;
+        ++size_;
+        place(node);
+      }
+
+      void remove(TimerNode *node) {
+        auto list = node->list_;
+        assert(list != nullptr);
+        list->remove(node);
+        if (list == &due_) {
+          --dueSize_;
+        } else {
+          auto index = list - &slots_[0][0];
+          if (list->empty()) {
+            bitmaps_[index / SLOT_COUNT] &=
+              ~(uint64_t{1} << (index % SLOT_COUNT));
+          }
+        }
+        --size_;
+      }
+
+      // move timers whose tick has been reached to the due list, this skips
+      // over empty slots, so it costs nothing when the wheel is idle
+      void advance(int64_t nowUs) {
+        auto nowTick = nowUs >> TICK_SHIFT;
+        if (size_ == dueSize_) {
+          if (curTick_ <= nowTick) {
+            curTick_ = nowTick + 1;
+          }
+          return;
+        }
+
+        while (curTick_ <= nowTick) {
+          for (int level = 1; level < LEVEL_COUNT; ++level) {
+            auto mask = (int64_t{1} << (level * SLOT_BITS)) - 1;
+            if ((curTick_ & mask) != 0) {
+              break;
+            }
+            cascade(level, slotIndex(curTick_, level));
+          }
+
+          auto index = slotIndex(curTick_, 0);
+          if (bitmaps_[0] & (uint64_t{1} << index)) {
+            bitmaps_[0] &= ~(uint64_t{1} << index);
+            auto node = slots_[0][index].release();
+            while (node) {
+              auto next = node->next_;
+              node->prev_ = node->next_ = nullptr;
+              due_.insertSorted(node);
+              ++dueSize_;
+              node = next;
+            }
+          }
+
+          ++curTick_;
+          auto nextTick = nextEventTick();
+          if (nextTick < 0 || nextTick > nowTick) {
+            curTick_ = nowTick + 1;
+            break;
+          }
+          curTick_ = nextTick;
+        }
+      }
+
+      // the earliest timer whose tick has been reached, advance() must be
+      // called before this to get an up-to-date result
+      TimerNode *front() const {
+        return due_.front();
+      }
+
+      // remove and return the front timer if its trigger time has come
+      TimerNode *popExpired(int64_t nowUs) {
+        advance(nowUs);
+        auto node = due_.front();
+        if (node && node->triggerTimeUs <= nowUs) {
+          remove(node);
+          return node;
+        }
+        return nullptr;
+      }
+
+      // the earliest time at which a timer may expire, it is not later than
+      // the trigger time of any timer in the wheel, -1 if the wheel is empty
+      int64_t nextTimeUs() const {
+        if (!due_.empty()) {
+          return due_.front()->triggerTimeUs;
+        }
+        auto nextTick = nextEventTick();
+        return nextTick < 0 ? -1 : (nextTick << TICK_SHIFT);
+      }
+
+      // visit every timer in the wheel, visitor is allowed to remove the
+      // timer that is being visited
+      template <typename Visitor>
+      void forEach(Visitor &&visitor) {
+        visitList(due_, visitor);
+        for (int level = 0; level < LEVEL_COUNT; ++level) {
+          auto bitmap = bitmaps_[level];
+          while (bitmap) {
+            auto index = lowestBit(bitmap);
+            bitmap &= bitmap - 1;
+            visitList(slots_[level][index], visitor);
+          }
+        }
+      }
+
+    private:
+      static int slotIndex(int64_t tick, int level) {
+        return static_cast<int>((tick >> (level * SLOT_BITS)) & (SLOT_COUNT - 1));
+      }
+
+      static int lowestBit(uint64_t bitmap) {
+        return __builtin_ctzll(bitmap);
+      }
+
+      static uint64_t rotateRight(uint64_t bitmap, int n) {
+        return n == 0 ? bitmap : (bitmap >> n) | (bitmap << (SLOT_COUNT - n));
+      }
+
+      void place(TimerNode *node) {
+        auto tick = node->triggerTimeUs >> TICK_SHIFT;
+        if (tick < curTick_) {
+          due_.insertSorted(node);
+          ++dueSize_;
+          return;
+        }
+
+        auto delta = tick - curTick_;
+        int level = 0;
+        while (level < LEVEL_COUNT - 1 &&
+               delta >= (int64_t{1} << ((level + 1) * SLOT_BITS))) {
+          ++level;
+        }
+
+        // timers that are too far away stay in the last slot of the top
+        // level, they will be placed again when that slot is cascaded
+        auto maxDelta = (int64_t{1} << (LEVEL_COUNT * SLOT_BITS)) - 1;
+        if (delta > maxDelta) {
+          tick = curTick_ + maxDelta;
+        }
+
+        auto index = slotIndex(tick, level);
+        slots_[level][index].pushBack(node);
+        bitmaps_[level] |= uint64_t{1} << index;
+      }
+
+      void cascade(int level, int index) {
+        if (!(bitmaps_[level] & (uint64_t{1} << index))) {
+          return;
+        }
+        bitmaps_[level] &= ~(uint64_t{1} << index);
+        auto node = slots_[level][index].release();
+        while (node) {
+          auto next = node->next_;
+          node->prev_ = node->next_ = nullptr;
+          node->list_ = nullptr;
+          place(node);
+          node = next;
+        }
+      }
+
+      // the earliest tick at which the wheel has to do some work, either
+      // moving a level-0 slot to the due list or cascading a slot
+      int64_t nextEventTick() const {
+        int64_t result = -1;
+        for (int level = 0; level < LEVEL_COUNT; ++level) {
+          if (!bitmaps_[level]) {
+            continue;
+          }
+          auto shift = level * SLOT_BITS;
+          auto current = slotIndex(curTick_, level);
+          auto bitmap = rotateRight(bitmaps_[level], current);
+
+          int64_t tick;
+          if (level == 0) {
+            tick = curTick_ + lowestBit(bitmap);
+          } else {
+            // the current slot of a higher level is cascaded when its
+            // boundary is reached, anything found there afterwards belongs
+            // to the next round
+            auto atBoundary = (curTick_ & ((int64_t{1} << shift) - 1)) == 0;
+            int distance = SLOT_COUNT;
+            if (atBoundary || (bitmap & ~uint64_t{1})) {
+              distance = lowestBit(atBoundary ? bitmap : bitmap & ~uint64_t{1});
+            }
+            tick = ((curTick_ >> shift) + distance) << shift;
+          }
+          if (result < 0 || tick < result) {
+            result = tick;
+          }
+        }
+        return result;
+      }
+
+      template <typename Visitor>
+      void visitList(TimerList &list, Visitor &visitor) {
+        auto node = list.front();
+        while (node) {
+          auto next = node->next_;
+          visitor(node);
+          node = next;
+        }
+      }
+
+    private:
+      TimerList slots_[LEVEL_COUNT][SLOT_COUNT];
+      uint64_t bitmaps_[LEVEL_COUNT]{};
+      TimerList due_;
+      std::size_t dueSize_{0};
+      std::size_t size_{0};
+      int64_t curTick_{0};  // the next tick to be processed
+      uint64_t nextSeq_{0};
+  };
+
+} /* end of namespace: nul */
+
+#endif /* end of include guard: TIMER_WHEEL_H_ */
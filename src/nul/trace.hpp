@@ -0,0 +1,387 @@
+/*******************************************************************************
+**          File: trace.hpp
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-16 Fri 11:20 PM
+**   Description: opt-in tracing of Looper tasks into per-thread buffers,
+**                dumped as Chrome trace-event JSON (chrome://tracing,
+**                ui.perfetto.dev)
+*******************************************************************************/
+#ifndef TRACE_H_
+#define TRACE_H_
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+// the file and line of the caller when used as a default argument
+#if defined(__GNUC__) || defined(__clang__)
+#define NUL_CALLER_FILE __builtin_FILE()
+#define NUL_CALLER_LINE __builtin_LINE()
+#else
+#define NUL_CALLER_FILE nullptr
+#define NUL_CALLER_LINE 0
+#endif
+
+namespace nul {
+
+  // where a task was posted, file is a string literal
+  struct PostSite {
+    PostSite() = default;
+    PostSite(const char *file, int line) : file(file), line(line) {}
+
+    const char *file{nullptr};
+    int line{0};
+  };
+
+  // events are recorded only between start() and stop(), otherwise a
+  // recording site costs a relaxed load. every thread appends to its own
+  // buffer without locking, a buffer that is full drops further events.
+  //
+  //   nul::Tracer::start();
+  //   ...
+  //   nul::Tracer::stop();
+  //   nul::Tracer::dumpToFile("/tmp/looper.json");
+  class Tracer final {
+    public:
+      enum EventType : uint8_t {
+        EVENT_POST,   // a task is posted, on the posting thread
+        EVENT_TASK,   // a task has run, durationUs is its run time
+        EVENT_TIMER,  // a timed task is due, durationUs is how late it is
+        EVENT_WAIT,   // a looper was parked for durationUs
+      };
+
+      struct Event {
+        int64_t timeUs;
+        int64_t durationUs;
+        const void *looper;
+        const void *queue;
+        const char *file;   // the post site
+        int line;
+        int identity;
+        uint64_t flowId;    // links a post to the run of its task, 0 if none
+        EventType type;
+      };
+
+      static constexpr std::size_t CHUNK_SIZE = 4096;
+      static constexpr std::size_t MAX_CHUNKS = 64;  // events per thread
+
+      static bool isEnabled() {
+        return enabled().load(std::memory_order_relaxed);
+      }
+
+      // clears what was recorded before, the buffers are reset by their
+      // threads when they record next
+      static void start() {
+        auto &registry = getRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        for (auto it = registry.buffers.begin(); it != registry.buffers.end(); ) {
+          if ((*it)->exited.load(std::memory_order_acquire)) {
+            it = registry.buffers.erase(it);
+          } else {
+            ++it;
+          }
+        }
+        generation().fetch_add(1, std::memory_order_release);
+        enabled().store(true, std::memory_order_release);
+      }
+
+      static void stop() {
+        enabled().store(false, std::memory_order_release);
+      }
+
+      // monotonic, the clock of Looper as well
+      static int64_t nowUs() {
+        using namespace std::chrono;
+        return duration_cast<microseconds>(
+          steady_clock::now().time_since_epoch()).count();
+      }
+
+      static uint64_t nextFlowId() {
+        static std::atomic<uint64_t> flowId{0};
+        return flowId.fetch_add(1, std::memory_order_relaxed) + 1;
+      }
+
+      static void record(const Event &event) {
+        auto buffer = getThreadBuffer();
+        auto currentGeneration = generation().load(std::memory_order_acquire);
+        if (buffer->generation.load(std::memory_order_relaxed) !=
+            currentGeneration) {
+          buffer->size.store(0, std::memory_order_relaxed);
+          buffer->dropped.store(0, std::memory_order_relaxed);
+          buffer->generation.store(currentGeneration, std::memory_order_release);
+        }
+        buffer->append(event);
+      }
+
+      // the name of the calling thread in the trace
+      static void setThreadName(const std::string &name) {
+        getThreadName() = name;
+        if (auto buffer = getThreadBufferIfCreated()) {
+          std::lock_guard<std::mutex> lock(getRegistry().mutex);
+          buffer->threadName = name;
+        }
+      }
+
+      // what has been recorded since start(), in the JSON object format.
+      // buffers are read as their threads publish them, call it after
+      // stop() for a consistent picture
+      static std::string dump() {
+        auto out = std::string("{\"traceEvents\":[");
+        auto pid = static_cast<int>(getpid());
+        auto first = true;
+        auto separate = [&out, &first]{
+          if (!first) {
+            out += ",\n";
+          }
+          first = false;
+        };
+
+        auto &registry = getRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        auto currentGeneration = generation().load(std::memory_order_acquire);
+        for (auto &buffer : registry.buffers) {
+          if (buffer->generation.load(std::memory_order_acquire) !=
+              currentGeneration) {
+            continue;
+          }
+          separate();
+          appendf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                  "\"tid\":%d,\"args\":{\"name\":", pid, buffer->tid);
+          appendString(out, buffer->threadName.empty() ?
+                       "thread" : buffer->threadName.c_str());
+          out += "}}";
+
+          auto size = buffer->size.load(std::memory_order_acquire);
+          for (std::size_t i = 0; i < size; ++i) {
+            separate();
+            appendEvent(out, buffer->at(i), pid, buffer->tid);
+          }
+          if (auto dropped = buffer->dropped.load(std::memory_order_relaxed)) {
+            separate();
+            appendf(out, "{\"name\":\"dropped %" PRIu64 " events\","
+                    "\"ph\":\"i\",\"s\":\"t\",\"ts\":%" PRId64 ",\"pid\":%d,"
+                    "\"tid\":%d}", dropped, nowUs(), pid, buffer->tid);
+          }
+        }
+        out += "],\"displayTimeUnit\":\"ms\"}\n";
+        return out;
+      }
+
+      static bool dumpToFile(const std::string &path) {
+        auto file = fopen(path.c_str(), "w");
+        if (!file) {
+          return false;
+        }
+        auto json = dump();
+        auto ok = fwrite(json.data(), 1, json.size(), file) == json.size();
+        return fclose(file) == 0 && ok;
+      }
+
+    private:
+      // written by its thread only, read by dump()
+      struct Buffer {
+        std::atomic<std::size_t> size{0};
+        std::atomic<uint64_t> generation{0};
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<bool> exited{false};
+        std::unique_ptr<Event[]> chunks[MAX_CHUNKS];
+        std::string threadName;  // guarded by the registry mutex
+        int tid{0};
+
+        void append(const Event &event) {
+          auto index = size.load(std::memory_order_relaxed);
+          auto chunk = index / CHUNK_SIZE;
+          if (chunk >= MAX_CHUNKS) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+          }
+          if (!chunks[chunk]) {
+            chunks[chunk].reset(new Event[CHUNK_SIZE]);
+          }
+          chunks[chunk][index % CHUNK_SIZE] = event;
+          // publishes the event and the chunk it is in
+          size.store(index + 1, std::memory_order_release);
+        }
+
+        const Event &at(std::size_t index) const {
+          return chunks[index / CHUNK_SIZE][index % CHUNK_SIZE];
+        }
+      };
+
+      struct Registry {
+        std::mutex mutex;
+        std::vector<std::shared_ptr<Buffer>> buffers;
+      };
+
+      // marks the buffer of an exiting thread, start() drops it
+      struct ThreadBufferHolder {
+        std::shared_ptr<Buffer> buffer;
+
+        ~ThreadBufferHolder() {
+          if (buffer) {
+            buffer->exited.store(true, std::memory_order_release);
+          }
+        }
+      };
+
+      static std::atomic<bool> &enabled() {
+        static std::atomic<bool> enabled{false};
+        return enabled;
+      }
+
+      static std::atomic<uint64_t> &generation() {
+        static std::atomic<uint64_t> generation{0};
+        return generation;
+      }
+
+      static Registry &getRegistry() {
+        static auto registry = new Registry();  // threads may outlive statics
+        return *registry;
+      }
+
+      static std::string &getThreadName() {
+        static thread_local std::string name;
+        return name;
+      }
+
+      static ThreadBufferHolder &getThreadBufferHolder() {
+        static thread_local ThreadBufferHolder holder;
+        return holder;
+      }
+
+      static Buffer *getThreadBufferIfCreated() {
+        return getThreadBufferHolder().buffer.get();
+      }
+
+      static Buffer *getThreadBuffer() {
+        auto &holder = getThreadBufferHolder();
+        if (!holder.buffer) {
+          auto buffer = std::make_shared<Buffer>();
+#ifdef __linux__
+          buffer->tid = static_cast<int>(syscall(SYS_gettid));
+#else
+          static std::atomic<int> nextTid{1};
+          buffer->tid = nextTid.fetch_add(1, std::memory_order_relaxed);
+#endif
+          auto &registry = getRegistry();
+          std::lock_guard<std::mutex> lock(registry.mutex);
+          buffer->threadName = getThreadName();
+          registry.buffers.push_back(buffer);
+          holder.buffer = std::move(buffer);
+        }
+        return holder.buffer.get();
+      }
+
+      static void appendEvent(
+        std::string &out, const Event &event, int pid, int tid) {
+        switch (event.type) {
+          case EVENT_POST:
+            appendf(out, "{\"name\":\"post\",\"cat\":\"looper\",\"ph\":\"i\","
+                    "\"s\":\"t\",\"ts\":%" PRId64 ",\"pid\":%d,\"tid\":%d",
+                    event.timeUs, pid, tid);
+            appendArgs(out, event);
+            out += "}}";
+            if (event.flowId != 0) {
+              appendf(out, ",\n{\"name\":\"task\",\"cat\":\"looper\","
+                      "\"ph\":\"s\",\"id\":%" PRIu64 ",\"ts\":%" PRId64 ","
+                      "\"pid\":%d,\"tid\":%d}",
+                      event.flowId, event.timeUs, pid, tid);
+            }
+            break;
+
+          case EVENT_TASK:
+            out += "{\"name\":";
+            if (event.file) {
+              appendString(out, siteOf(event).c_str());
+            } else {
+              out += "\"task\"";
+            }
+            appendf(out, ",\"cat\":\"looper\",\"ph\":\"X\",\"ts\":%" PRId64
+                    ",\"dur\":%" PRId64 ",\"pid\":%d,\"tid\":%d",
+                    event.timeUs, event.durationUs, pid, tid);
+            appendArgs(out, event);
+            out += "}}";
+            if (event.flowId != 0) {
+              appendf(out, ",\n{\"name\":\"task\",\"cat\":\"looper\","
+                      "\"ph\":\"f\",\"bp\":\"e\",\"id\":%" PRIu64 ","
+                      "\"ts\":%" PRId64 ",\"pid\":%d,\"tid\":%d}",
+                      event.flowId, event.timeUs, pid, tid);
+            }
+            break;
+
+          case EVENT_TIMER:
+            appendf(out, "{\"name\":\"timer\",\"cat\":\"looper\",\"ph\":\"i\","
+                    "\"s\":\"t\",\"ts\":%" PRId64 ",\"pid\":%d,\"tid\":%d",
+                    event.timeUs, pid, tid);
+            appendArgs(out, event);
+            appendf(out, ",\"lateUs\":%" PRId64 "}}", event.durationUs);
+            break;
+
+          case EVENT_WAIT:
+            appendf(out, "{\"name\":\"wait\",\"cat\":\"looper\",\"ph\":\"X\","
+                    "\"ts\":%" PRId64 ",\"dur\":%" PRId64 ",\"pid\":%d,"
+                    "\"tid\":%d,\"args\":{\"looper\":\"%p\"}}",
+                    event.timeUs, event.durationUs, pid, tid, event.looper);
+            break;
+        }
+      }
+
+      // leaves the args object open for the caller to add to and close
+      static void appendArgs(std::string &out, const Event &event) {
+        appendf(out, ",\"args\":{\"looper\":\"%p\",\"queue\":\"%p\","
+                "\"identity\":%d", event.looper, event.queue, event.identity);
+        if (event.file) {
+          out += ",\"site\":";
+          appendString(out, siteOf(event).c_str());
+        }
+      }
+
+      static std::string siteOf(const Event &event) {
+        return std::string(event.file) + ":" + std::to_string(event.line);
+      }
+
+      static void appendString(std::string &out, const char *str) {
+        out += '"';
+        for (; *str; ++str) {
+          auto c = static_cast<unsigned char>(*str);
+          if (c == '"' || c == '\\') {
+            out += '\\';
+            out += static_cast<char>(c);
+          } else if (c < 0x20) {
+            appendf(out, "\\u%04x", c);
+          } else {
+            out += static_cast<char>(c);
+          }
+        }
+        out += '"';
+      }
+
+      __attribute__((format(printf, 2, 3)))
+      static void appendf(std::string &out, const char *fmt, ...) {
+        char buf[512];
+        va_list args;
+        va_start(args, fmt);
+        auto len = vsnprintf(buf, sizeof(buf), fmt, args);
+        va_end(args);
+        if (len > 0) {
+          out.append(buf, std::min<std::size_t>(len, sizeof(buf) - 1));
+        }
+      }
+  };
+
+} /* end of namespace: nul */
+
+#endif /* end of include guard: TRACE_H_ */
@@ -0,0 +1,70 @@
+/*******************************************************************************
+**          File: circular_buffer.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-16 Fri 05:00 PM
+**   Description: measures the throughput of CircularBuffer against
+**                SpscCircularBuffer with one producer and one consumer, and
+**                against MpmcCircularBuffer with 1 to 32 of each
+*******************************************************************************/
+#include "nul/circular_buffer.hpp"
+#include <cstdio>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+namespace {
+  constexpr int ITEMS = 4000000;
+  constexpr std::size_t RING_SIZE = 1024;
+
+  // every producer puts its share of ITEMS, every consumer takes its share
+  template <typename Buffer>
+  void bench(const char *name, int threads) {
+    auto buffer = new Buffer();
+    auto perThread = ITEMS / threads;
+    auto sums = std::vector<int64_t>(threads);
+    auto workers = std::vector<std::thread>{};
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; ++t) {
+      workers.emplace_back([buffer, perThread]{
+        for (int i = 1; i <= perThread; ++i) {
+          buffer->put(i);
+        }
+      });
+      workers.emplace_back([buffer, perThread, &sums, t]{
+        auto sum = int64_t{0};
+        for (int i = 0; i < perThread; ++i) {
+          sum += buffer->take();
+        }
+        sums[t] = sum;
+      });
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    delete buffer;
+
+    auto sum = int64_t{0};
+    for (auto s : sums) {
+      sum += s;
+    }
+    auto items = perThread * threads;
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      elapsed).count();
+    printf("%-20s %2d+%-2d threads %10d items %8.1f ns/item %8.1f M items/s%s\n",
+           name, threads, threads, items, static_cast<double>(ns) / items,
+           items * 1e3 / ns,
+           sum == int64_t{threads} * perThread * (perThread + 1) / 2 ?
+           "" : " (lost items)");
+  }
+}
+
+int main() {
+  bench<nul::CircularBuffer<int, RING_SIZE>>("CircularBuffer", 1);
+  bench<nul::SpscCircularBuffer<int, RING_SIZE>>("SpscCircularBuffer", 1);
+  for (int threads = 1; threads <= 32; threads *= 2) {
+    bench<nul::CircularBuffer<int, RING_SIZE>>("CircularBuffer", threads);
+    bench<nul::MpmcCircularBuffer<int, RING_SIZE>>("MpmcCircularBuffer", threads);
+  }
+  return 0;
+}
@@ -0,0 +1,157 @@
+/*******************************************************************************
+**          File: looper_post.cc
+**        Author: neevek <i@neevek.net>.
+** Creation Time: 2026-10-16 Fri 03:40 PM
+**   Description: measures posting throughput of Looper/TaskQueue and counts
+**                heap allocations made in steady state, which should be zero,
+**                and the round trip to an idle looper with and without spin
+*******************************************************************************/
+#include "nul/looper.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <new>
+
+namespace {
+  std::atomic<uint64_t> gAllocCount{0};
+}
+
+void *operator new(std::size_t size) {
+  gAllocCount.fetch_add(1, std::memory_order_relaxed);
+  if (auto p = std::malloc(size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+  std::free(p);
+}
+
+namespace {
+  constexpr int ROUNDS = 1000;
+  constexpr int TASKS_PER_ROUND = 1000;
+
+  template <typename PostFunc>
+  void runRounds(
+    nul::TaskQueue &tq, std::atomic<int> &executed, int rounds,
+    PostFunc &post) {
+    for (int round = 0; round < rounds; ++round) {
+      executed.store(0, std::memory_order_relaxed);
+      for (int i = 0; i < TASKS_PER_ROUND; ++i) {
+        post(tq, executed, i);
+      }
+      while (executed.load(std::memory_order_acquire) < TASKS_PER_ROUND) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  template <typename PostFunc>
+  void bench(const char *name, PostFunc post) {
+    auto looper = nul::Looper::create("bench");
+    looper->start();
+    nul::TaskQueue tq(looper);
+    std::atomic<int> executed{0};
+
+    // the first round grows the task pool to its steady-state size
+    runRounds(tq, executed, 1, post);
+
+    auto allocCount = gAllocCount.load();
+    auto start = std::chrono::steady_clock::now();
+    runRounds(tq, executed, ROUNDS, post);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    allocCount = gAllocCount.load() - allocCount;
+
+    auto tasks = static_cast<double>(ROUNDS) * TASKS_PER_ROUND;
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      elapsed).count();
+    printf("%-20s %10.0f tasks %8.1f ns/task %8.4f allocations/task\n",
+           name, tasks, ns / tasks, allocCount / tasks);
+  }
+
+  // one task at a time, the looper goes idle between them
+  void benchRoundTrip(const char *name, int64_t maxSpinUs) {
+    constexpr int TRIPS = 10000;
+    auto looper = nul::Looper::create("bench");
+    looper->setMaxIdleSpin(maxSpinUs);
+    looper->start();
+    nul::TaskQueue tq(looper);
+    std::atomic<bool> done{false};
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < TRIPS; ++i) {
+      done.store(false, std::memory_order_relaxed);
+      tq.post([&done] {
+        done.store(true, std::memory_order_release);
+      });
+      while (!done.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      elapsed).count();
+    printf("%-20s %10d trips %8.1f ns/trip\n", name, TRIPS,
+           static_cast<double>(ns) / TRIPS);
+  }
+}
+
+int main() {
+  bench("post", [](nul::TaskQueue &tq, std::atomic<int> &executed, int) {
+    tq.post([&executed] {
+      executed.fetch_add(1, std::memory_order_release);
+    });
+  });
+
+  bench("post with args",
+        [](nul::TaskQueue &tq, std::atomic<int> &executed, int i) {
+    tq.post([](std::atomic<int> *executed, int, int64_t) {
+      executed->fetch_add(1, std::memory_order_release);
+    }, &executed, i, int64_t{i});
+  });
+
+  bench("postDelayed",
+        [](nul::TaskQueue &tq, std::atomic<int> &executed, int i) {
+    tq.postDelayed(i % 10, [&executed] {
+      executed.fetch_add(1, std::memory_order_release);
+    });
+  });
+
+  bench("postBatch of 100",
+        [](nul::TaskQueue &tq, std::atomic<int> &executed, int i) {
+    if (i % 100 != 0) {
+      return;
+    }
+    auto batch = nul::TaskQueue::PostBatch(tq);
+    for (int j = 0; j < 100; ++j) {
+      batch.post([&executed] {
+        executed.fetch_add(1, std::memory_order_release);
+      });
+    }
+    tq.postBatch(batch);
+  });
+
+  // the tasks are posted by a task, on the looper's own thread
+  bench("post from looper",
+        [](nul::TaskQueue &tq, std::atomic<int> &executed, int i) {
+    if (i % 100 != 0) {
+      return;
+    }
+    tq.post([&tq, &executed] {
+      for (int j = 0; j < 100; ++j) {
+        tq.post([&executed] {
+          executed.fetch_add(1, std::memory_order_release);
+        });
+      }
+    });
+  });
+
+  benchRoundTrip("round trip", 0);
+  benchRoundTrip("round trip, spin", 50);
+  return 0;
+}
@@ -4,6 +4,8 @@
 #include <future>
 #include <thread>
 #include <functional>
+#include <memory>
+#include <vector>
 
 #define ENABLE_PROFILING
 #include "nul/profiler.hpp"
@@ -85,3 +87,170 @@ TEST(CircularBuffer, UniquePointer) {
   f2.get();
   f1.get();
 }
+
+TEST(SpscCircularBuffer, Test) {
+  constexpr auto MAX_SIZE = 3;
+  nul::SpscCircularBuffer<int, MAX_SIZE> cbuf;
+  ASSERT_TRUE(cbuf.size() == 0);
+  ASSERT_TRUE(cbuf.empty());
+  ASSERT_TRUE(cbuf.capacity() == MAX_SIZE);
+  ASSERT_TRUE(cbuf.take(0) == 0);
+
+  cbuf.put(1);
+  cbuf.put(2);
+  cbuf.put(3);
+  ASSERT_TRUE(cbuf.size() == 3);
+
+  ASSERT_TRUE(cbuf.take() == 1);
+  cbuf.put(4);
+  ASSERT_TRUE(cbuf.size() == 3);
+  ASSERT_TRUE(cbuf.take() == 2);
+  ASSERT_TRUE(cbuf.takeOrDefault() == 3);
+  ASSERT_TRUE(cbuf.take(10) == 4);
+  ASSERT_TRUE(cbuf.take(10) == 0);
+
+  cbuf.put(5);
+  cbuf.interrupt();
+  ASSERT_FALSE(cbuf.put(6));
+  ASSERT_FALSE(cbuf.interruptedAndEmpty());
+  ASSERT_TRUE(cbuf.take() == 5);
+  ASSERT_TRUE(cbuf.interruptedAndEmpty());
+}
+
+TEST(SpscCircularBuffer, ConcurrentAccess) {
+  constexpr auto COUNT = 1000000;
+  nul::SpscCircularBuffer<int, 64> cbuf;
+
+  auto producer = std::async(std::launch::async, [&](){
+    for (int i = 1; i <= COUNT; ++i) {
+      cbuf.put(i);
+    }
+  });
+
+  // the values arrive in order, the consumer parks when it runs dry and
+  // the producer parks when the ring is full
+  auto outOfOrder = 0;
+  for (int i = 1; i <= COUNT; ++i) {
+    if (cbuf.take() != i) {
+      ++outOfOrder;
+    }
+  }
+  producer.get();
+  ASSERT_EQ(outOfOrder, 0);
+  ASSERT_TRUE(cbuf.empty());
+}
+
+TEST(SpscCircularBuffer, InterruptWakesUpBothSides) {
+  nul::SpscCircularBuffer<std::unique_ptr<int>, 1> cbuf;
+  auto consumer = std::async(std::launch::async, [&](){
+    return cbuf.take();
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  cbuf.interrupt();
+  ASSERT_TRUE(consumer.get() == nullptr);
+
+  nul::SpscCircularBuffer<int, 1> full;
+  full.put(1);
+  auto producer = std::async(std::launch::async, [&](){
+    return full.put(2);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  full.interrupt();
+  ASSERT_FALSE(producer.get());
+  ASSERT_TRUE(full.take() == 1);
+}
+
+TEST(MpmcCircularBuffer, Test) {
+  constexpr auto MAX_SIZE = 3;
+  nul::MpmcCircularBuffer<std::unique_ptr<int>, MAX_SIZE> cbuf;
+  ASSERT_TRUE(cbuf.empty());
+  ASSERT_TRUE(cbuf.capacity() == MAX_SIZE);
+
+  auto data = std::unique_ptr<int>();
+  ASSERT_FALSE(cbuf.tryTake(data));
+  for (int i = 1; i <= MAX_SIZE; ++i) {
+    ASSERT_TRUE(cbuf.tryPut(std::unique_ptr<int>(new int(i))));
+  }
+  ASSERT_TRUE(cbuf.size() == 3);
+
+  // a failed put leaves the data with the caller
+  auto extra = std::unique_ptr<int>(new int(4));
+  ASSERT_FALSE(cbuf.tryPut(std::move(extra)));
+  ASSERT_TRUE(extra && *extra == 4);
+
+  ASSERT_TRUE(cbuf.tryTake(data) && *data == 1);
+  ASSERT_TRUE(cbuf.tryPut(std::move(extra)));
+  ASSERT_TRUE(*cbuf.take() == 2);
+  ASSERT_TRUE(*cbuf.takeOrDefault() == 3);
+  ASSERT_TRUE(*cbuf.take(10) == 4);
+  ASSERT_TRUE(cbuf.take(10) == nullptr);
+
+  cbuf.put(std::unique_ptr<int>(new int(5)));
+  cbuf.interrupt();
+  ASSERT_FALSE(cbuf.put(std::unique_ptr<int>(new int(6))));
+  ASSERT_FALSE(cbuf.interruptedAndEmpty());
+  ASSERT_TRUE(*cbuf.take() == 5);
+  ASSERT_TRUE(cbuf.interruptedAndEmpty());
+  ASSERT_TRUE(cbuf.take() == nullptr);
+}
+
+TEST(MpmcCircularBuffer, ConcurrentAccess) {
+  constexpr auto THREADS = 4;
+  constexpr auto COUNT = 100000;
+  nul::MpmcCircularBuffer<int, 16> cbuf;
+
+  auto producers = std::vector<std::future<void>>{};
+  auto consumers = std::vector<std::future<int64_t>>{};
+  for (int t = 0; t < THREADS; ++t) {
+    producers.push_back(std::async(std::launch::async, [&](){
+      for (int i = 1; i <= COUNT; ++i) {
+        cbuf.put(i);
+      }
+    }));
+    consumers.push_back(std::async(std::launch::async, [&](){
+      auto sum = int64_t{0};
+      for (int i = 0; i < COUNT; ++i) {
+        sum += cbuf.take();
+      }
+      return sum;
+    }));
+  }
+
+  auto sum = int64_t{0};
+  for (int t = 0; t < THREADS; ++t) {
+    producers[t].get();
+    sum += consumers[t].get();
+  }
+  ASSERT_EQ(sum, int64_t{THREADS} * COUNT * (COUNT + 1) / 2);
+  ASSERT_TRUE(cbuf.empty());
+}
+
+TEST(MpmcCircularBuffer, InterruptWakesUpAllWaiters) {
+  nul::MpmcCircularBuffer<int, 2> cbuf;
+  auto consumers = std::vector<std::future<int>>{};
+  for (int i = 0; i < 3; ++i) {
+    consumers.push_back(std::async(std::launch::async, [&](){
+      return cbuf.take();
+    }));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  cbuf.interrupt();
+  for (auto &consumer : consumers) {
+    ASSERT_EQ(consumer.get(), 0);
+  }
+
+  nul::MpmcCircularBuffer<int, 2> full;
+  full.put(1);
+  full.put(2);
+  auto producers = std::vector<std::future<bool>>{};
+  for (int i = 0; i < 3; ++i) {
+    producers.push_back(std::async(std::launch::async, [&](){
+      return full.put(3);
+    }));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  full.interrupt();
+  for (auto &producer : producers) {
+    ASSERT_FALSE(producer.get());
+  }
+}
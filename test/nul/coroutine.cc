@@ -0,0 +1,201 @@
+#include <gtest/gtest.h>
+#include "nul/coroutine.hpp"
+#include <vector>
+#include <future>
+#include <atomic>
+#include <thread>
+#include <cstring>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace nul;
+
+namespace {
+
+Coroutine scheduleAndSleep(
+  TaskQueue &tq, std::vector<int> &result, std::promise<void> &done) {
+  result.push_back(1);
+  co_await tq.schedule();
+  result.push_back(Looper::getCurrent() ? 2 : -1);
+  co_await tq.sleepFor(10000);
+  result.push_back(3);
+  done.set_value();
+}
+
+struct Guard {
+  std::promise<void> &destroyed;
+  ~Guard() { destroyed.set_value(); }
+};
+
+Coroutine sleepForever(TaskQueue &tq, std::promise<void> &destroyed) {
+  auto guard = Guard{destroyed};
+  co_await tq.sleepFor(INT32_MAX);
+  ADD_FAILURE() << "must not resume";
+}
+
+Coroutine waitFdForever(TaskQueue &tq, int fd, std::promise<void> &destroyed) {
+  auto guard = Guard{destroyed};
+  co_await tq.schedule();
+  co_await tq.waitFd(fd, Looper::FD_EVENT_READ);
+  ADD_FAILURE() << "must not resume";
+}
+
+Coroutine readLines(
+  TaskQueue &tq, int fd, std::vector<int> &result, std::promise<void> &done) {
+  co_await tq.schedule();
+  while (true) {
+    auto events = co_await tq.waitFd(fd, Looper::FD_EVENT_READ);
+    EXPECT_EQ(Looper::FD_EVENT_READ, events);
+    char c;
+    EXPECT_EQ(1, read(fd, &c, 1));
+    if (c == '.') {
+      break;
+    }
+    result.push_back(c - '0');
+  }
+  done.set_value();
+}
+
+Coroutine yieldMany(TaskQueue &tq, int count, std::atomic<int> &left) {
+  for (int i = 0; i < count; ++i) {
+    co_await tq.schedule();
+  }
+  --left;
+}
+
+} /* end of anonymous namespace */
+
+TEST(Coroutine, ScheduleAndSleep) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  auto result = std::vector<int>{};
+  auto done = std::promise<void>();
+  scheduleAndSleep(tq, result, done);
+  done.get_future().wait();
+  ASSERT_EQ((std::vector<int>{1, 2, 3}), result);
+}
+
+TEST(Coroutine, DroppedResumptionDestroysFrame) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  auto destroyed = std::promise<void>();
+  sleepForever(tq, destroyed);
+  tq.removeAllPendingTasks();
+  destroyed.get_future().wait();
+
+  // the task cannot even be posted
+  looper->stop();
+  auto destroyedAfterStop = std::promise<void>();
+  sleepForever(tq, destroyedAfterStop);
+  ASSERT_EQ(std::future_status::ready,
+            destroyedAfterStop.get_future().wait_for(std::chrono::seconds(0)));
+}
+
+TEST(Coroutine, WaitFd) {
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  auto result = std::vector<int>{};
+  auto done = std::promise<void>();
+  readLines(tq, fds[0], result, done);
+  for (auto c : {'1', '2', '3', '.'}) {
+    ASSERT_EQ(1, write(fds[1], &c, 1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  done.get_future().wait();
+  ASSERT_EQ((std::vector<int>{1, 2, 3}), result);
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(Coroutine, UnwatchedFdDestroysFrame) {
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+  auto looper = Looper::create("test");
+  looper->start();
+
+  // the queue is detached while the coroutine waits, which it does once
+  // the task that resumed it on the looper has run
+  auto tq = TaskQueue(looper);
+  auto destroyed = std::promise<void>();
+  waitFdForever(tq, fds[0], destroyed);
+  tq.postSync([]{});
+  tq.detachFromLooper();
+  ASSERT_EQ(std::future_status::ready,
+            destroyed.get_future().wait_for(std::chrono::seconds(5)));
+
+  // the looper stops while it waits
+  auto tq2 = TaskQueue(looper);
+  auto destroyed2 = std::promise<void>();
+  waitFdForever(tq2, fds[0], destroyed2);
+  tq2.postSync([]{});
+  looper->stop();
+  ASSERT_EQ(std::future_status::ready,
+            destroyed2.get_future().wait_for(std::chrono::seconds(5)));
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(Coroutine, FramesFromArena) {
+  auto looper = Looper::create("test");
+  looper->enableFrameArena();
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  // coroutines started on the looper thread
+  auto left = std::atomic<int>{100};
+  for (int i = 0; i < 100; ++i) {
+    tq.post([&tq, &left]{ yieldMany(tq, 10, left); });
+  }
+  while (left > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  // the arena outlives the looper while one of its frames is alive, the
+  // frame sleeps on another looper here
+  auto otherLooper = Looper::create("other");
+  otherLooper->start();
+  auto otherTq = TaskQueue(otherLooper);
+  auto result = std::vector<int>{};
+  auto done = std::promise<void>();
+  auto started = std::promise<void>();
+  tq.post([&]{
+    scheduleAndSleep(otherTq, result, done);
+    started.set_value();
+  });
+  started.get_future().wait();
+  tq.detachFromLooper();
+  looper.reset();
+  done.get_future().wait();
+  ASSERT_EQ((std::vector<int>{1, 2, 3}), result);
+}
+
+TEST(FrameArena, AllocateAndFree) {
+  auto arena = new FrameArena();
+  for (auto size : {1, 100, 112, 113, 500, 2032, 2033, 100000}) {
+    auto a = FrameArena::allocateFrame(arena, size);
+    auto b = FrameArena::allocateFrame(nullptr, size);
+    memset(a, 0xab, size);
+    memset(b, 0xcd, size);
+    FrameArena::freeFrame(a, size);
+    // a recycled block is handed out again
+    auto c = FrameArena::allocateFrame(arena, size);
+    if (size + FrameArena::HEADER_SIZE <= 2048) {
+      ASSERT_EQ(a, c);
+    }
+    FrameArena::freeFrame(c, size);
+    FrameArena::freeFrame(b, size);
+  }
+  arena->release();
+}
@@ -0,0 +1,38 @@
+#include <gtest/gtest.h>
+#include "nul/histogram.hpp"
+
+using namespace nul;
+
+TEST(Histogram, Buckets) {
+  auto histogram = Histogram{};
+  ASSERT_EQ(0, histogram.percentile(50));
+
+  histogram.record(0);
+  histogram.record(1);
+  histogram.record(3);
+  histogram.record(1000);
+  ASSERT_EQ(4, histogram.count());
+  ASSERT_EQ(1, histogram.bucketCount(0));
+  ASSERT_EQ(1, histogram.bucketCount(1));
+  ASSERT_EQ(1, histogram.bucketCount(2));
+  ASSERT_EQ(1, histogram.bucketCount(10));
+  ASSERT_EQ(1000, histogram.max());
+  ASSERT_DOUBLE_EQ(251, histogram.mean());
+}
+
+TEST(Histogram, Percentile) {
+  auto histogram = Histogram{};
+  for (int i = 1; i <= 1000; ++i) {
+    histogram.record(i);
+  }
+  // the result is the upper bound of the bucket that holds the rank
+  ASSERT_EQ(511, histogram.percentile(50));
+  ASSERT_EQ(1000, histogram.percentile(99));
+  ASSERT_EQ(1, histogram.percentile(0));
+
+  histogram.record(int64_t{1} << 50);
+  ASSERT_EQ(int64_t{1} << 50, histogram.percentile(100));
+
+  histogram.reset();
+  ASSERT_EQ(0, histogram.count());
+}
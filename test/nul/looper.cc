@@ -0,0 +1,1014 @@
+#include <gtest/gtest.h>
+#include "nul/looper.hpp"
+#include <vector>
+#include <future>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <functional>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace nul;
+
+TEST(Looper, PostInOrder) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  auto result = std::vector<int>{};
+  auto done = std::promise<void>();
+  for (int i = 0; i < 100; ++i) {
+    tq.post([&result, i]{ result.push_back(i); });
+  }
+  tq.post([&done]{ done.set_value(); });
+  done.get_future().wait();
+
+  ASSERT_EQ(100, result.size());
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(i, result[i]);
+  }
+}
+
+TEST(Looper, DelayedTasksFireInTriggerTimeOrder) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  auto result = std::vector<int>{};
+  auto done = std::promise<void>();
+  // tasks with the same delay run in the order they were posted
+  tq.postDelayed(30000, [&result]{ result.push_back(3); });
+  tq.postDelayed(10000, [&result]{ result.push_back(1); });
+  tq.postDelayed(20000, [&result]{ result.push_back(2); });
+  tq.postDelayed(30000, [&result]{ result.push_back(4); });
+  tq.postDelayed(40000, [&done]{ done.set_value(); });
+  done.get_future().wait();
+
+  ASSERT_EQ((std::vector<int>{1, 2, 3, 4}), result);
+}
+
+TEST(Looper, RemovePendingTasks) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  auto count = std::atomic<int>{0};
+  auto done = std::promise<void>();
+  tq.postDelayedWithId(1, 10000, [&count]{ count += 1; });
+  tq.postDelayedWithId(2, 10000, [&count]{ count += 10; });
+  tq.postRepeatedWithId(3, 0, 1000, [&count]{ count += 100; });
+  tq.removePendingTasks(1);
+  tq.removePendingTasks(3);
+  tq.postDelayed(20000, [&done]{ done.set_value(); });
+  done.get_future().wait();
+
+  ASSERT_EQ(10, count.load() % 100);
+}
+
+TEST(Looper, RepeatedTask) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  auto count = 0;
+  auto done = std::promise<void>();
+  tq.postRepeatedWithId(1, 0, 1000, [&]{
+    if (++count == 5) {
+      tq.removePendingTasks(1);
+      done.set_value();
+    }
+  });
+  done.get_future().wait();
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+  tq.post([]{});
+  ASSERT_EQ(5, count);
+}
+
+TEST(Looper, ConcurrentProducers) {
+  auto looper = Looper::create("test");
+  looper->start();
+
+  constexpr auto PRODUCERS = 4;
+  constexpr auto N = 20000;
+  auto last = std::vector<int>(PRODUCERS, -1);
+  auto outOfOrder = 0;
+  auto count = 0;
+
+  auto producers = std::vector<std::thread>{};
+  for (int p = 0; p < PRODUCERS; ++p) {
+    producers.emplace_back([&, p]{
+      auto tq = TaskQueue(looper);
+      for (int i = 0; i < N; ++i) {
+        tq.post([&, p, i]{
+          outOfOrder += last[p] + 1 != i;
+          last[p] = i;
+          ++count;
+        });
+      }
+    });
+  }
+  for (auto &t : producers) {
+    t.join();
+  }
+
+  auto done = std::promise<void>();
+  TaskQueue(looper).post([&done]{ done.set_value(); });
+  done.get_future().wait();
+  ASSERT_EQ(0, outOfOrder);
+  ASSERT_EQ(PRODUCERS * N, count);
+}
+
+TEST(Looper, LocalPostsKeepOrderWithOtherThreads) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  auto result = std::vector<std::string>{};
+  // a task that reacts to a post from another thread runs after it
+  auto started = std::promise<void>();
+  auto reacted = std::promise<void>();
+  auto signaled = std::atomic<bool>{false};
+  tq.post([&]{
+    started.set_value();
+    while (!signaled) {
+      std::this_thread::yield();
+    }
+    tq.post([&result]{ result.push_back("reaction"); });
+    reacted.set_value();
+  });
+  started.get_future().wait();
+  tq.post([&result]{ result.push_back("post"); });
+  signaled = true;
+  reacted.get_future().wait();
+  tq.postSync([]{});
+  ASSERT_EQ((std::vector<std::string>{"post", "reaction"}), result);
+
+  // and the other way round
+  result.clear();
+  auto posted = std::promise<void>();
+  auto signaledBack = std::atomic<bool>{false};
+  tq.post([&]{
+    tq.post([&result]{ result.push_back("post"); });
+    posted.set_value();
+    while (!signaledBack) {
+      std::this_thread::yield();
+    }
+  });
+  posted.get_future().wait();
+  tq.post([&result]{ result.push_back("reaction"); });
+  signaledBack = true;
+  tq.postSync([]{});
+  ASSERT_EQ((std::vector<std::string>{"post", "reaction"}), result);
+}
+
+TEST(Looper, LocalPostsRaceWithRemovals) {
+  // removals drain the submissions from other threads while the looper
+  // checks them for its local posts, run it under TSan
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  constexpr int POSTS = 20000;
+  auto ran = 0;
+  auto done = std::promise<void>();
+  auto stop = std::atomic<bool>{false};
+  auto remover = std::thread([&]{
+    while (!stop) {
+      tq.removePendingTasks(1);
+      tq.post(1, []{});
+    }
+  });
+  std::function<void()> repost = [&]{
+    if (++ran == POSTS) {
+      done.set_value();
+      return;
+    }
+    tq.post(repost);
+  };
+  tq.post(repost);
+  done.get_future().wait();
+  stop = true;
+  remover.join();
+  ASSERT_EQ(POSTS, ran);
+}
+
+TEST(Looper, BatchObservesRemovals) {
+  auto looper = Looper::create("test");
+  looper->setBatchSize(64);
+  auto tq = TaskQueue(looper);
+
+  // the first task holds the looper until everything else is queued, so
+  // that the remaining tasks end up in the same batch
+  auto result = std::vector<int>{};
+  auto done = std::promise<void>();
+  looper->start();
+  auto gate = std::promise<void>();
+  tq.post([&gate]{ gate.get_future().wait(); });
+  tq.post([&]{ result.push_back(1); tq.removePendingTasks(2); });
+  tq.post(2, [&]{ result.push_back(2); });
+  tq.post([&]{ result.push_back(3); });
+  tq.post([&done]{ done.set_value(); });
+  gate.set_value();
+  done.get_future().wait();
+
+  ASSERT_EQ((std::vector<int>{1, 3}), result);
+}
+
+TEST(Looper, BatchDoesNotStarveTimers) {
+  auto looper = Looper::create("test");
+  looper->setBatchSize(16);
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  // a task that keeps reposting itself always leaves a ready task behind
+  auto stop = std::atomic<bool>{false};
+  std::function<void()> spin = [&]{
+    if (!stop) {
+      tq.post(spin);
+    }
+  };
+  tq.post(spin);
+
+  auto fired = std::promise<void>();
+  tq.postDelayed(1000, [&]{ stop = true; fired.set_value(); });
+  ASSERT_EQ(std::future_status::ready,
+            fired.get_future().wait_for(std::chrono::seconds(5)));
+}
+
+TEST(Looper, RemoveByIdentityAmongManyTasks) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq1 = TaskQueue(looper);
+  auto tq2 = TaskQueue(looper);
+
+  // hold the looper, so that nothing fires before the removals are done
+  auto gate = std::promise<void>();
+  tq2.post([&gate]{ gate.get_future().wait(); });
+
+  constexpr auto N = 50000;
+  auto count = std::atomic<int>{0};
+  for (int i = 0; i < N; ++i) {
+    tq1.postDelayedWithId(i % 10, 1000, [&count]{ ++count; });
+    tq2.postDelayedWithId(i % 10, 1000, [&count]{ ++count; });
+  }
+  tq1.postRepeatedWithId(3, 1000, 1000000, [&count]{ ++count; });
+  tq2.post(1, [&count]{ ++count; });
+
+  // each removal only touches the tasks it removes
+  for (int id = 0; id < 10; ++id) {
+    if (id != 3) {
+      tq1.removePendingTasks(id);
+    }
+  }
+  tq1.removeAllNonRepeatedTasks();
+  tq2.removeAllUnamedPendingTasks();
+  tq2.removePendingTasks(1);
+  gate.set_value();
+
+  auto done = std::promise<void>();
+  tq2.postDelayed(20000, [&done]{ done.set_value(); });
+  done.get_future().wait();
+
+  // tq1 keeps its repeated task, tq2 keeps identities 2-9
+  ASSERT_EQ(1 + N / 10 * 8, count.load());
+  tq1.detachFromLooper();
+  tq2.detachFromLooper();
+}
+
+TEST(Looper, DetachWithFinalizer) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  auto result = std::vector<int>{};
+  auto done = std::promise<void>();
+  auto gate = std::promise<void>();
+  tq.post([&gate]{ gate.get_future().wait(); });
+  tq.post([&result]{ result.push_back(1); });
+  tq.postDelayed(1000, [&result]{ result.push_back(2); });
+  tq.detachFromLooper([&]{ result.push_back(3); done.set_value(); });
+  gate.set_value();
+  done.get_future().wait();
+
+  ASSERT_EQ((std::vector<int>{3}), result);
+  ASSERT_FALSE(tq.post([]{}));
+}
+
+TEST(Looper, WatchFd) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds));
+
+  auto received = std::string{};
+  auto done = std::promise<void>();
+  auto thread = std::this_thread::get_id();
+  ASSERT_TRUE(tq.watchFd(fds[0], Looper::FD_EVENT_READ, [&](int fd, int events){
+    ASSERT_EQ(fds[0], fd);
+    ASSERT_TRUE(events & Looper::FD_EVENT_READ);
+    ASSERT_NE(thread, std::this_thread::get_id());
+    char buf[64];
+    auto n = read(fd, buf, sizeof(buf));
+    received.append(buf, n);
+    if (received == "hello world") {
+      tq.unwatchFd(fd);
+      done.set_value();
+    }
+  }));
+  // an fd is watched only once
+  ASSERT_FALSE(tq.watchFd(fds[0], Looper::FD_EVENT_READ, [](int, int){}));
+
+  ASSERT_EQ(6, write(fds[1], "hello ", 6));
+  tq.postDelayed(5000, [&fds]{ ASSERT_EQ(5, write(fds[1], "world", 5)); });
+  done.get_future().wait();
+  ASSERT_EQ("hello world", received);
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(Looper, WatchFdWritable) {
+  auto looper = Looper::create("test");
+  looper->start();
+
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+
+  auto done = std::promise<void>();
+  auto events = std::atomic<int>{0};
+  ASSERT_TRUE(looper->watchFd(fds[0], Looper::FD_EVENT_READ, [&](int fd, int ev){
+    events |= ev;
+    looper->unwatchFd(fd);
+    done.set_value();
+  }));
+  ASSERT_TRUE(looper->watchFd(fds[1], 0, [&](int fd, int ev){
+    // the pipe is writable right away, write once and stop watching
+    ASSERT_EQ(1, write(fd, "x", 1));
+    looper->unwatchFd(fd);
+  }));
+  ASSERT_TRUE(looper->updateFd(fds[1], Looper::FD_EVENT_WRITE));
+  done.get_future().wait();
+  ASSERT_EQ(Looper::FD_EVENT_READ, events.load());
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(Looper, Metrics) {
+  auto looper = Looper::create("test");
+  looper->start();
+  looper->setMetricsEnabled(true);
+  auto tq1 = TaskQueue(looper);
+  auto tq2 = TaskQueue(looper);
+
+  auto done = std::promise<void>();
+  for (int i = 0; i < 10; ++i) {
+    tq1.post([]{});
+  }
+  tq2.postDelayed(1000, []{
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  });
+  tq2.postDelayed(60000000, []{});
+  tq2.postDelayed(5000, [&done]{ done.set_value(); });
+  done.get_future().wait();
+
+  // a task is recorded after it returns
+  auto metrics = looper->getMetrics();
+  for (int i = 0; i < 100 && metrics.executedTasks < 12; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    metrics = looper->getMetrics();
+  }
+  ASSERT_EQ(12, metrics.executedTasks);
+  ASSERT_EQ(10, metrics.queueLatency.count());
+  ASSERT_EQ(2, metrics.timerLateness.count());
+  ASSERT_EQ(12, metrics.runTime.count());
+  ASSERT_GE(metrics.runTime.max(), 2000);
+  ASSERT_EQ(0, metrics.pendingTasks);
+  ASSERT_EQ(1, metrics.pendingTimers);
+  ASSERT_GT(metrics.tasksPerSecond, 0);
+  ASSERT_EQ(2, metrics.queues.size());
+
+  auto q1 = tq1.getMetrics();
+  ASSERT_EQ(10, q1.executedTasks);
+  ASSERT_EQ(0, q1.pendingTasks);
+  auto q2 = tq2.getMetrics();
+  ASSERT_EQ(2, q2.executedTasks);
+  ASSERT_EQ(1, q2.pendingTasks);
+
+  tq2.detachFromLooper();
+  ASSERT_EQ(1, looper->getMetrics().queues.size());
+}
+
+TEST(Looper, TimersWithSlackShareAWakeup) {
+  using namespace std::chrono;
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+  tq.setTimerSlack(40000);
+
+  // all of them are due before the earliest deadline (45ms), so they run
+  // together when it comes
+  auto start = steady_clock::now();
+  auto times = std::vector<steady_clock::time_point>{};
+  auto done = std::promise<void>();
+  for (int i = 1; i <= 5; ++i) {
+    tq.postDelayed(i * 5000, [&times, &done]{
+      times.push_back(steady_clock::now());
+      if (times.size() == 5) {
+        done.set_value();
+      }
+    });
+  }
+  done.get_future().wait();
+
+  ASSERT_GE(times.front() - start, milliseconds(25));
+  ASSERT_LT(times.back() - times.front(), milliseconds(5));
+}
+
+TEST(Looper, PreciseTimer) {
+  using namespace std::chrono;
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  auto start = steady_clock::now();
+  auto done = std::promise<steady_clock::time_point>();
+  tq.postDelayedWithSlack(2500, Looper::TIMER_SLACK_PRECISE, [&done]{
+    done.set_value(steady_clock::now());
+  });
+  ASSERT_GE(done.get_future().get() - start, microseconds(2500));
+}
+
+TEST(Looper, PriorityLanes) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  // hold the looper so that all the tasks are queued before any runs
+  auto gate = std::promise<void>();
+  auto gateFuture = gate.get_future();
+  tq.post([&gateFuture]{ gateFuture.wait(); });
+
+  auto result = std::vector<int>{};
+  auto done = std::promise<void>();
+  tq.postIdle([&result]{ result.push_back(-1); });
+  for (int i = 0; i < 20; ++i) {
+    tq.postWithPriority(Looper::PRIORITY_BACKGROUND, 0, [&result]{
+      result.push_back(2);
+    });
+  }
+  for (int i = 0; i < 20; ++i) {
+    tq.postWithPriority(Looper::PRIORITY_URGENT, 0, [&result]{
+      result.push_back(0);
+    });
+  }
+  tq.postIdle([&done]{ done.set_value(); });
+  gate.set_value();
+  done.get_future().wait();
+
+  ASSERT_EQ(41, result.size());
+  // a background task gets in after every MAX_PASSED_OVER urgent ones
+  auto expected = std::vector<int>{};
+  for (int i = 0; i < 20; ++i) {
+    expected.push_back(0);
+    if ((i + 1) % Looper::MAX_PASSED_OVER == 0) {
+      expected.push_back(2);
+    }
+  }
+  expected.resize(40, 2);
+  expected.push_back(-1);
+  ASSERT_EQ(expected, result);
+}
+
+TEST(Looper, IdleTaskRunsOncePerIdlePeriod) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  auto count = std::atomic<int>{0};
+  std::function<void()> idle = [&]{
+    ++count;
+    tq.postIdle(idle);
+  };
+  tq.postIdle(idle);
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  ASSERT_EQ(1, count);
+
+  // every wakeup starts a new idle period
+  auto done = std::promise<void>();
+  tq.post([&done]{ done.set_value(); });
+  done.get_future().wait();
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  ASSERT_EQ(2, count);
+  tq.detachFromLooper();
+}
+
+TEST(Looper, PostWithResult) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  auto future = tq.postWithResult([](int a, int b){ return a + b; }, 1, 2);
+  ASSERT_EQ(3, future.get());
+  ASSERT_FALSE(future.valid());
+
+  auto ran = false;
+  auto voidFuture = tq.postWithResult([&ran]{ ran = true; });
+  ASSERT_TRUE(voidFuture.wait());
+  ASSERT_TRUE(ran);
+
+  // a removed task breaks its future
+  auto gate = std::promise<void>();
+  auto gateFuture = gate.get_future();
+  tq.post([&gateFuture]{ gateFuture.wait(); });
+  auto removed = tq.postWithResult([]{ return std::string("removed"); });
+  tq.removeAllUnamedPendingTasks();
+  gate.set_value();
+  ASSERT_FALSE(removed.wait());
+  ASSERT_EQ(TaskFuture<std::string>::BROKEN, removed.status());
+  tq.detachFromLooper();
+}
+
+TEST(Looper, GetOnDroppedTaskAborts) {
+  ::testing::FLAGS_gtest_death_test_style = "threadsafe";
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  auto gate = std::promise<void>();
+  auto gateFuture = gate.get_future();
+  tq.post([&gateFuture]{ gateFuture.wait(); });
+  auto future = tq.postWithResult([]{ return 1; });
+  tq.removeAllPendingTasks();
+  gate.set_value();
+  ASSERT_DEATH(future.get(), "");
+  ASSERT_EQ(TaskFuture<int>::BROKEN, future.status());
+}
+
+TEST(Looper, PostSync) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  auto threadId = std::this_thread::get_id();
+  ASSERT_NE(threadId, tq.postSync([]{ return std::this_thread::get_id(); }));
+
+  // runs inline on the looper's own thread instead of deadlocking
+  auto inner = tq.postSync([&tq]{
+    auto looperThreadId = std::this_thread::get_id();
+    return tq.postSync([looperThreadId]{
+      return std::this_thread::get_id() == looperThreadId;
+    });
+  });
+  ASSERT_TRUE(inner);
+
+  // and on the caller's thread when the looper drops the task
+  looper->stop();
+  ASSERT_EQ(threadId, tq.postSync([]{ return std::this_thread::get_id(); }));
+}
+
+TEST(Looper, StopDropsQueuedTasks) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  auto started = std::promise<void>();
+  auto gate = std::promise<void>();
+  auto gateFuture = gate.get_future();
+  tq.post([&]{
+    started.set_value();
+    gateFuture.wait();
+  });
+  started.get_future().wait();
+
+  auto queued = tq.postWithResult([]{ return 1; });
+  auto timerDropped = std::promise<void>();
+  auto timer = std::shared_ptr<int>(new int(0), [&timerDropped](int *p){
+    delete p;
+    timerDropped.set_value();
+  });
+  tq.postDelayed(1000000, [timer]{});
+  timer.reset();
+  looper->stop();
+  gate.set_value();
+  ASSERT_EQ(TaskFuture<int>::BROKEN, queued.waitFor(5000000));
+  ASSERT_EQ(std::future_status::ready,
+            timerDropped.get_future().wait_for(std::chrono::seconds(5)));
+
+  // postSync() from another thread does not hang on a stopped looper
+  auto threadId = std::this_thread::get_id();
+  ASSERT_EQ(threadId, tq.postSync([]{ return std::this_thread::get_id(); }));
+  tq.detachFromLooper();
+}
+
+TEST(Looper, IdleSpinAdaptsToGaps) {
+  if (std::thread::hardware_concurrency() < 2) {
+    GTEST_SKIP() << "loopers do not spin on a single CPU";
+  }
+  auto looper = Looper::create("test");
+  looper->setMaxIdleSpin(20000);
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  // CPU time the looper thread spends over an idle gap
+  auto cpuTimeUs = []{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  };
+  auto spentIdle = [&](int gapMs) {
+    auto before = tq.postSync(cpuTimeUs);
+    std::this_thread::sleep_for(std::chrono::milliseconds(gapMs));
+    return tq.postSync(cpuTimeUs) - before;
+  };
+
+  // spins for the whole window at first, then work keeps arriving too
+  // late, so the window shrinks
+  ASSERT_GE(spentIdle(50), 10000);
+  for (int i = 0; i < 8; ++i) {
+    spentIdle(30);
+  }
+  ASSERT_LT(spentIdle(50), 5000);
+
+  // spinning loopers still see posts and timers
+  auto done = std::promise<void>();
+  tq.postDelayed(1000, [&]{ tq.post([&]{ done.set_value(); }); });
+  done.get_future().wait();
+}
+
+TEST(Looper, CapacityRejectsAndDropsOldest) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  auto gate = std::promise<void>();
+  auto gateFuture = gate.get_future().share();
+  auto started = std::promise<void>();
+  tq.post([&]{
+    started.set_value();
+    gateFuture.wait();
+  });
+  started.get_future().wait();
+
+  auto result = std::vector<int>{};
+  looper->setCapacity(4);
+  ASSERT_TRUE(tq.post([&result]{ result.push_back(1); }));
+  ASSERT_TRUE(tq.post([&result]{ result.push_back(2); }));
+
+  // a full queue rejects before the looper is full
+  auto tq2 = TaskQueue(looper);
+  tq2.setCapacity(1);
+  ASSERT_TRUE(tq2.post([&result]{ result.push_back(3); }));
+  ASSERT_FALSE(tq2.post([&result]{ result.push_back(-1); }));
+
+  // the looper is full now, dropping makes room in it
+  auto tq3 = TaskQueue(looper);
+  tq3.setCapacity(1, Looper::OVERFLOW_DROP_OLDEST);
+  ASSERT_TRUE(tq3.post([&result]{ result.push_back(-1); }));
+  ASSERT_FALSE(tq.post([&result]{ result.push_back(-1); }));
+  ASSERT_TRUE(tq3.post([&result]{ result.push_back(4); }));
+
+  looper->setCapacity(0);
+  auto done = std::promise<void>();
+  ASSERT_TRUE(tq.post([&done]{ done.set_value(); }));
+  gate.set_value();
+  done.get_future().wait();
+  ASSERT_EQ((std::vector<int>{1, 2, 3, 4}), result);
+}
+
+TEST(Looper, CapacityBlocksProducer) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+  tq.setCapacity(2, Looper::OVERFLOW_BLOCK);
+
+  auto gate = std::promise<void>();
+  auto gateFuture = gate.get_future().share();
+  tq.post([gateFuture]{ gateFuture.wait(); });
+
+  auto posted = std::atomic<int>{0};
+  auto result = std::vector<int>{};
+  auto producer = std::thread([&]{
+    for (int i = 0; i < 10; ++i) {
+      ASSERT_TRUE(tq.post([&result, &tq, i]{
+        // the looper thread itself is never blocked
+        if (i == 0) {
+          ASSERT_TRUE(tq.post([]{}));
+          ASSERT_TRUE(tq.post([]{}));
+          ASSERT_TRUE(tq.post([]{}));
+        }
+        result.push_back(i);
+      }));
+      ++posted;
+    }
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  // the gate task has left the queue, two more fill it
+  ASSERT_EQ(2, posted);
+
+  gate.set_value();
+  producer.join();
+  tq.postSync([]{});
+  ASSERT_EQ(10, result.size());
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_EQ(i, result[i]);
+  }
+
+  // detaching releases a blocked producer
+  auto gate2 = std::promise<void>();
+  auto gate2Future = gate2.get_future().share();
+  tq.post([gate2Future]{ gate2Future.wait(); });
+  tq.post([]{});
+  tq.post([]{});
+  auto rejected = std::async(std::launch::async, [&tq]{
+    return !tq.post([]{});
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  tq.detachFromLooper();
+  ASSERT_TRUE(rejected.get());
+  gate2.set_value();
+}
+
+TEST(Looper, DetachFromTaskReleasesProducerBlockedOnLooper) {
+  auto looper = Looper::create("test");
+  looper->setCapacity(2, Looper::OVERFLOW_BLOCK);
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  // the task detaches while the producer waits for room in the looper,
+  // which only the looper thread makes
+  auto started = std::promise<void>();
+  auto detached = std::promise<void>();
+  tq.post([&]{
+    started.set_value();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    tq.detachFromLooper();
+    detached.set_value();
+  });
+  started.get_future().wait();
+
+  auto ran = std::atomic<int>{0};
+  auto posted = std::atomic<int>{0};
+  auto producer = std::thread([&]{
+    for (int i = 0; i < 5; ++i) {
+      posted += tq.post([&ran]{ ++ran; });
+    }
+  });
+  ASSERT_EQ(std::future_status::ready,
+            detached.get_future().wait_for(std::chrono::seconds(5)));
+  producer.join();
+  ASSERT_EQ(2, posted);
+
+  auto done = std::promise<void>();
+  TaskQueue(looper).post([&done]{ done.set_value(); });
+  done.get_future().wait();
+  ASSERT_EQ(0, ran);
+}
+
+TEST(Looper, ExpiredTasksAreDiscarded) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  auto gate = std::promise<void>();
+  auto gateFuture = gate.get_future().share();
+  tq.post([gateFuture]{ gateFuture.wait(); });
+
+  auto result = std::vector<int>{};
+  tq.postWithExpiry(1000, [&result]{ result.push_back(-1); });
+  tq.postWithExpiry(1000000, [&result]{ result.push_back(1); });
+  tq.post([&result]{ result.push_back(2); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  gate.set_value();
+  tq.postSync([]{});
+  ASSERT_EQ((std::vector<int>{1, 2}), result);
+}
+
+TEST(Looper, PostBatch) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  auto gate = std::promise<void>();
+  auto gateFuture = gate.get_future().share();
+  tq.post([gateFuture]{ gateFuture.wait(); });
+
+  auto result = std::vector<int>{};
+  auto done = std::promise<void>();
+  auto batch = TaskQueue::PostBatch(tq);
+  batch.postDelayedWithId(2, 10000, [&result]{ result.push_back(-2); })
+    .postDelayed(20000, [&done]{ done.set_value(); });
+  for (int i = 0; i < 100; ++i) {
+    batch.post(i % 2 ? 1 : 0, [&result, i]{ result.push_back(i); });
+  }
+  ASSERT_EQ(102, batch.size());
+  ASSERT_EQ(102, tq.postBatch(batch));
+  ASSERT_EQ(0, batch.size());
+
+  // identities are kept
+  tq.removePendingTasks(1);
+  tq.removePendingTasks(2);
+  gate.set_value();
+  done.get_future().wait();
+
+  ASSERT_EQ(50, result.size());
+  for (int i = 0; i < 50; ++i) {
+    ASSERT_EQ(i * 2, result[i]);
+  }
+
+  // a batch that is not posted is discarded
+  auto count = std::atomic<int>{0};
+  {
+    auto discarded = TaskQueue::PostBatch(tq);
+    discarded.post([&count]{ ++count; });
+  }
+  looper->stop();
+  auto rejected = TaskQueue::PostBatch(tq);
+  rejected.post([&count]{ ++count; }).postDelayed(0, [&count]{ ++count; });
+  ASSERT_EQ(0, tq.postBatch(rejected));
+  ASSERT_EQ(0, count.load());
+}
+
+TEST(Looper, PostCoalesced) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  auto gate = std::promise<void>();
+  auto gateFuture = gate.get_future().share();
+  tq.post([gateFuture]{ gateFuture.wait(); });
+
+  auto result = std::vector<int>{};
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_TRUE(tq.postCoalesced(
+        1, Looper::COALESCE_KEEP_FIRST, [&result, i]{ result.push_back(i); }));
+    tq.post([&result]{ result.push_back(100); });
+    ASSERT_TRUE(tq.postCoalesced(
+        2, Looper::COALESCE_KEEP_LAST,
+        [&result, i]{ result.push_back(10 + i); }));
+  }
+  gate.set_value();
+  tq.postSync([]{});
+  ASSERT_EQ((std::vector<int>{0, 100, 12, 100, 100}), result);
+
+  // a task that has run does not absorb the next one
+  result.clear();
+  tq.postCoalesced(1, Looper::COALESCE_KEEP_FIRST, [&result]{
+    result.push_back(1);
+  });
+  tq.postSync([]{});
+  tq.postCoalesced(1, Looper::COALESCE_KEEP_FIRST, [&result]{
+    result.push_back(2);
+  });
+  tq.postSync([]{});
+  ASSERT_EQ((std::vector<int>{1, 2}), result);
+}
+
+TEST(Looper, PostDelayedCoalesced) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  auto result = std::vector<int>{};
+  auto done = std::promise<void>();
+  // the earliest deadline with the first callable
+  tq.postDelayedCoalesced(
+    1, 40000, Looper::COALESCE_KEEP_FIRST, [&result]{ result.push_back(1); });
+  tq.postDelayedCoalesced(
+    1, 10000, Looper::COALESCE_KEEP_FIRST, [&result]{ result.push_back(-1); });
+  // the latest deadline with the last callable, a debounce
+  auto debounce = Looper::COALESCE_KEEP_LAST | Looper::COALESCE_LATEST_DEADLINE;
+  tq.postDelayedCoalesced(2, 1000, debounce, [&result]{ result.push_back(-2); });
+  tq.postDelayedCoalesced(2, 30000, debounce, [&result]{ result.push_back(-3); });
+  tq.postDelayedCoalesced(2, 20000, debounce, [&result]{ result.push_back(2); });
+  // immediate and timed tasks do not coalesce with each other
+  tq.postCoalesced(3, Looper::COALESCE_KEEP_FIRST, [&result]{
+    result.push_back(0);
+  });
+  tq.postDelayedCoalesced(
+    3, 50000, Looper::COALESCE_KEEP_FIRST, [&result]{ result.push_back(3); });
+  // coalesced tasks can still be removed
+  tq.postDelayedCoalesced(
+    4, 5000, Looper::COALESCE_KEEP_FIRST, [&result]{ result.push_back(-4); });
+  tq.removePendingTasks(4);
+  tq.postDelayed(60000, [&done]{ done.set_value(); });
+  done.get_future().wait();
+
+  ASSERT_EQ((std::vector<int>{0, 1, 2, 3}), result);
+}
+
+TEST(Looper, PostFromLooperThread) {
+  auto looper = Looper::create("test");
+  looper->start();
+  auto tq = TaskQueue(looper);
+  ASSERT_FALSE(looper->isCurrentThread());
+
+  auto result = std::vector<int>{};
+  auto posted = std::promise<void>();
+  auto removed = std::promise<void>();
+  auto removedFuture = removed.get_future().share();
+  auto finished = std::promise<void>();
+  tq.post([&]{
+    EXPECT_TRUE(looper->isCurrentThread());
+    EXPECT_EQ(looper, Looper::getCurrent());
+    for (int i = 0; i < 10; ++i) {
+      tq.post(i % 2 + 1, [&result, i]{ result.push_back(i); });
+    }
+    posted.set_value();
+    removedFuture.wait();
+    // posted after the removal, it stays
+    tq.post(1, [&result]{ result.push_back(10); });
+    finished.set_value();
+  });
+  posted.get_future().wait();
+  tq.removePendingTasks(1);
+  removed.set_value();
+  // a post that races with the task's last post may run ahead of it
+  finished.get_future().wait();
+  tq.postSync([]{});
+
+  ASSERT_EQ((std::vector<int>{1, 3, 5, 7, 9, 10}), result);
+}
+
+#ifdef __linux__
+TEST(Looper, StartWithOptions) {
+  auto looper = Looper::create("looper-with-a-long-name");
+  auto options = LooperOptions{};
+  options.cpuAffinity = {0};
+  options.niceValue = 5;
+  options.stackSize = 1 << 20;
+  ASSERT_TRUE(looper->start(options));
+
+  auto tq = TaskQueue(looper);
+  auto name = tq.postSync([]{
+    char name[16];
+    pthread_getname_np(pthread_self(), name, sizeof(name));
+    return std::string(name);
+  });
+  ASSERT_EQ("looper-with-a-l", name);
+
+  auto cpus = tq.postSync([]{
+    cpu_set_t cpus;
+    sched_getaffinity(0, sizeof(cpus), &cpus);
+    return CPU_COUNT(&cpus) == 1 && CPU_ISSET(0, &cpus);
+  });
+  ASSERT_TRUE(cpus);
+
+  auto nice = tq.postSync([]{
+    return getpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)));
+  });
+  ASSERT_EQ(5, nice);
+
+  auto stackSize = tq.postSync([]{
+    pthread_attr_t attr;
+    pthread_getattr_np(pthread_self(), &attr);
+    std::size_t size = 0;
+    pthread_attr_getstacksize(&attr, &size);
+    pthread_attr_destroy(&attr);
+    return size;
+  });
+  ASSERT_GE(stackSize, std::size_t{1 << 20});
+}
+
+TEST(Looper, StartFailsWithInvalidOptions) {
+  auto looper = Looper::create("test");
+  auto options = LooperOptions{};
+  options.fifoPriority = 1000;
+  ASSERT_FALSE(looper->start(options));
+  ASSERT_FALSE(looper->isRunning());
+  ASSERT_FALSE(TaskQueue(looper).post([]{}));
+
+  ASSERT_TRUE(looper->start());
+  ASSERT_EQ(looper, TaskQueue(looper).postSync([]{
+    return Looper::getCurrent();
+  }));
+}
+
+TEST(Looper, PreciseTimersWithInjectedClock) {
+  // an hour ahead of CLOCK_MONOTONIC, precise timers must not arm the
+  // timerfd with its time
+  class AheadClock final : public Looper::Clock {
+    public:
+      int64_t nowUs() override {
+        using namespace std::chrono;
+        return duration_cast<microseconds>(
+          steady_clock::now().time_since_epoch()).count() +
+          3600LL * 1000000;
+      }
+  };
+  auto looper = Looper::create("test");
+  looper->setClock(std::make_shared<AheadClock>());
+  looper->start();
+  auto tq = TaskQueue(looper);
+  tq.setTimerSlack(Looper::TIMER_SLACK_PRECISE);
+
+  auto fired = std::promise<void>();
+  tq.postDelayed(1000, [&fired]{ fired.set_value(); });
+  ASSERT_EQ(std::future_status::ready,
+            fired.get_future().wait_for(std::chrono::seconds(5)));
+}
+#endif
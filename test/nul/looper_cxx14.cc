@@ -0,0 +1,34 @@
+// compiled as C++14 by the test build, only to check that looper.hpp is
+// still usable from C++14 code, and that nothing is over-aligned for new,
+// nothing here is run
+#include <memory>
+
+#include "nul/looper.hpp"
+#include "nul/circular_buffer.hpp"
+
+void useLooperFromCxx14() {
+  auto looper = nul::Looper::create("cxx14");
+  looper->start();
+  auto tq = std::make_shared<nul::TaskQueue>(looper);
+  tq->post([]{});
+  tq->postDelayed(1000, [](int){}, 1);
+  tq->postRepeatedWithId(1, 1000, 1000, []{});
+  tq->postCoalesced(2, nul::Looper::COALESCE_KEEP_LAST, []{});
+  auto future = tq->postWithResult([]{ return 1; });
+  future.waitFor(1000);
+  tq->postSync([]{});
+
+  nul::TaskQueue::PostBatch batch(*tq);
+  batch.post([]{}).postDelayed(1000, []{});
+  tq->postBatch(batch);
+  looper->stop();
+}
+
+void allocateCircularBuffersFromCxx14() {
+  auto spsc = std::unique_ptr<nul::SpscCircularBuffer<int, 16>>(
+    new nul::SpscCircularBuffer<int, 16>());
+  spsc->put(1);
+  auto mpmc = std::unique_ptr<nul::MpmcCircularBuffer<int, 16>>(
+    new nul::MpmcCircularBuffer<int, 16>());
+  mpmc->tryPut(1);
+}
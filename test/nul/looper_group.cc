@@ -0,0 +1,149 @@
+#include <gtest/gtest.h>
+#include "nul/looper_group.hpp"
+#include <vector>
+#include <future>
+#include <atomic>
+#include <memory>
+
+using namespace nul;
+
+TEST(LooperGroup, StrandsRunInOrderAndNeverConcurrently) {
+  auto group = LooperGroup::create("test", 4);
+  group->start();
+
+  constexpr int STRAND_COUNT = 8;
+  constexpr int PRODUCER_COUNT = 4;
+  constexpr int TASK_COUNT = 2000;
+
+  struct State {
+    std::atomic<bool> busy{false};
+    std::atomic<bool> overlapped{false};
+    std::vector<int> last = std::vector<int>(PRODUCER_COUNT, -1);
+    bool outOfOrder{false};
+    int count{0};
+  };
+
+  auto strands = std::vector<std::shared_ptr<Looper>>{};
+  auto queues = std::vector<std::unique_ptr<TaskQueue>>{};
+  auto states = std::vector<std::unique_ptr<State>>{};
+  for (int i = 0; i < STRAND_COUNT; ++i) {
+    strands.push_back(group->createStrand());
+    queues.emplace_back(new TaskQueue(strands.back()));
+    states.emplace_back(new State());
+  }
+
+  auto producers = std::vector<std::thread>{};
+  for (int p = 0; p < PRODUCER_COUNT; ++p) {
+    producers.emplace_back([&, p]{
+      for (int i = 0; i < TASK_COUNT; ++i) {
+        auto &state = *states[i % STRAND_COUNT];
+        queues[i % STRAND_COUNT]->post([&state, p, i]{
+          if (state.busy.exchange(true)) {
+            state.overlapped = true;
+          }
+          if (state.last[p] >= i) {
+            state.outOfOrder = true;
+          }
+          state.last[p] = i;
+          ++state.count;
+          state.busy = false;
+        });
+      }
+    });
+  }
+  for (auto &producer : producers) {
+    producer.join();
+  }
+
+  for (int i = 0; i < STRAND_COUNT; ++i) {
+    auto done = std::promise<void>();
+    queues[i]->post([&done]{ done.set_value(); });
+    done.get_future().wait();
+
+    auto &state = *states[i];
+    ASSERT_FALSE(state.overlapped);
+    ASSERT_FALSE(state.outOfOrder);
+    ASSERT_EQ(TASK_COUNT * PRODUCER_COUNT / STRAND_COUNT, state.count);
+  }
+}
+
+TEST(LooperGroup, DelayedAndRemovedTasks) {
+  auto group = LooperGroup::create("test", 2);
+  group->start();
+  auto tq = TaskQueue(group->createStrand());
+
+  auto result = std::vector<int>{};
+  auto done = std::promise<void>();
+  tq.postDelayed(30000, [&result]{ result.push_back(3); });
+  tq.postDelayedWithId(1, 10000, [&result]{ result.push_back(-1); });
+  tq.postDelayed(20000, [&result]{ result.push_back(2); });
+  tq.post([&result]{ result.push_back(1); });
+  tq.removePendingTasks(1);
+  tq.postDelayed(40000, [&done]{ done.set_value(); });
+  done.get_future().wait();
+
+  ASSERT_EQ((std::vector<int>{1, 2, 3}), result);
+}
+
+TEST(LooperGroup, RepeatedTaskOnStrand) {
+  auto group = LooperGroup::create("test", 2);
+  group->start();
+  auto tq = TaskQueue(group->createStrand());
+
+  auto count = 0;
+  auto done = std::promise<void>();
+  tq.postRepeatedWithId(1, 0, 1000, [&]{
+    if (++count == 5) {
+      tq.removePendingTasks(1);
+      done.set_value();
+    }
+  });
+  done.get_future().wait();
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  ASSERT_EQ(5, count);
+}
+
+TEST(LooperGroup, IdleWorkerStealsFromBlockedOne) {
+  auto group = LooperGroup::create("test", 2);
+  group->start();
+  auto strandA = group->createStrand();
+  auto strandB = group->createStrand();
+  auto tqA = TaskQueue(strandA);
+  auto tqB = TaskQueue(strandB);
+
+  // B is woken up on the worker that runs A, which then blocks until B has
+  // run, so B can only run if the other worker steals it
+  auto ran = std::promise<void>();
+  auto done = std::promise<void>();
+  tqA.post([&]{
+    ASSERT_EQ(strandA, Looper::getCurrent());
+    tqB.post([&]{
+      ASSERT_EQ(strandB, Looper::getCurrent());
+      ran.set_value();
+    });
+    ran.get_future().wait();
+    done.set_value();
+  });
+  done.get_future().wait();
+}
+
+TEST(LooperGroup, StrandStopsWithTheGroup) {
+  auto group = LooperGroup::create("test", 2);
+  group->start();
+  auto strand = group->createStrand();
+  auto tq = TaskQueue(strand);
+
+  // a task that is still queued is dropped with the group
+  auto token = std::make_shared<int>(0);
+  tq.postDelayed(10000000, [token]{});
+  ASSERT_EQ(2, token.use_count());
+  group.reset();
+  ASSERT_FALSE(strand->isRunning());
+  ASSERT_EQ(1, token.use_count());
+
+  // and later posts fail instead of waiting for a worker forever
+  ASSERT_FALSE(tq.post([]{}));
+  auto future = tq.postWithResult([]{ return 1; });
+  ASSERT_EQ(decltype(future)::BROKEN, future.waitFor(1000000));
+  ASSERT_EQ(2, tq.postSync([]{ return 2; }));
+}
@@ -0,0 +1,102 @@
+#include <gtest/gtest.h>
+#include "nul/looper_watchdog.hpp"
+#include <future>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace nul;
+
+TEST(LooperWatchdog, ReportsStalledTask) {
+  auto looper = Looper::create("stalled");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  auto mutex = std::mutex{};
+  auto reports = std::vector<StallReport>{};
+  auto options = WatchdogOptions{};
+  options.thresholdUs = 20000;
+  options.checkIntervalUs = 2000;
+#ifdef NUL_HAS_STALL_STACKS
+  options.captureStack = true;
+#endif
+  auto watchdog = LooperWatchdog(options, [&](const StallReport &report){
+    std::lock_guard<std::mutex> lock(mutex);
+    reports.push_back(report);
+  });
+  watchdog.start();
+
+  // quick tasks are not reported
+  for (int i = 0; i < 10; ++i) {
+    tq.post([]{ std::this_thread::sleep_for(std::chrono::milliseconds(1)); });
+  }
+  auto line = __LINE__; tq.post(9, []{
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  });
+  tq.postSync([]{});
+  watchdog.stop();
+
+  ASSERT_EQ(1, watchdog.getStallCount());
+  ASSERT_EQ(1, looper->getMetrics().stalledTasks);
+  std::lock_guard<std::mutex> lock(mutex);
+  ASSERT_EQ(1, reports.size());
+  auto &report = reports[0];
+  ASSERT_EQ("stalled", report.looperName);
+  ASSERT_EQ(&tq, report.queue);
+  ASSERT_EQ(9, report.identity);
+  ASSERT_STREQ(__FILE__, report.file);
+  ASSERT_EQ(line, report.line);
+  ASSERT_EQ(-1, report.fd);
+  ASSERT_LE(20000, report.runningUs);
+#ifdef NUL_HAS_STALL_STACKS
+  ASSERT_FALSE(report.stack.empty());
+#endif
+}
+
+#ifdef __linux__
+TEST(LooperWatchdog, ReportsStalledFdCallback) {
+  auto looper = Looper::create("stalled");
+  looper->start();
+  auto tq = TaskQueue(looper);
+
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds));
+
+  auto mutex = std::mutex{};
+  auto reports = std::vector<StallReport>{};
+  auto options = WatchdogOptions{};
+  options.thresholdUs = 20000;
+  options.checkIntervalUs = 2000;
+  auto watchdog = LooperWatchdog(options, [&](const StallReport &report){
+    std::lock_guard<std::mutex> lock(mutex);
+    reports.push_back(report);
+  });
+  watchdog.start();
+
+  auto done = std::promise<void>();
+  ASSERT_TRUE(tq.watchFd(fds[0], Looper::FD_EVENT_READ, [&](int fd, int){
+    char buf[8];
+    ASSERT_EQ(1, read(fd, buf, sizeof(buf)));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    tq.unwatchFd(fd);
+    done.set_value();
+  }));
+  ASSERT_EQ(1, write(fds[1], "x", 1));
+  done.get_future().wait();
+  tq.postSync([]{});
+  watchdog.stop();
+
+  ASSERT_EQ(1, watchdog.getStallCount());
+  std::lock_guard<std::mutex> lock(mutex);
+  ASSERT_EQ(1, reports.size());
+  auto &report = reports[0];
+  ASSERT_EQ(&tq, report.queue);
+  ASSERT_EQ(fds[0], report.fd);
+  ASSERT_EQ(nullptr, report.file);
+  ASSERT_LE(20000, report.runningUs);
+
+  close(fds[0]);
+  close(fds[1]);
+}
+#endif
@@ -0,0 +1,167 @@
+#include <gtest/gtest.h>
+#include "nul/manual_looper.hpp"
+#include <vector>
+#include <utility>
+#include <chrono>
+#include <thread>
+#include <functional>
+
+using namespace nul;
+
+TEST(ManualLooper, TimersFireInOrderAtTheirTimes) {
+  auto looper = ManualLooper("test");
+  auto tq = TaskQueue(looper.getLooper());
+  auto startUs = looper.nowUs();
+
+  auto fired = std::vector<std::pair<int, int64_t>>{};
+  auto record = [&](int id){
+    fired.emplace_back(id, looper.nowUs() - startUs);
+  };
+  tq.postDelayed(3000, [&]{ record(3); });
+  tq.postDelayed(1000, [&]{ record(1); });
+  tq.postDelayed(2000, [&]{ record(2); });
+  tq.postDelayed(2000, [&]{ record(4); });
+  tq.post([&]{
+    record(0);
+    // posted from a task, due at the time the task sees
+    tq.postDelayed(2500, [&]{ record(5); });
+  });
+  EXPECT_TRUE(fired.empty());
+
+  looper.runUntilIdle();
+  ASSERT_EQ(fired.size(), 1u);
+  EXPECT_EQ(looper.nowUs(), startUs);
+
+  looper.advanceBy(1500);
+  ASSERT_EQ(fired.size(), 2u);
+  EXPECT_EQ(looper.nowUs(), startUs + 1500);
+
+  looper.advanceBy(100000);
+  EXPECT_EQ(looper.nowUs(), startUs + 101500);
+  auto expected = std::vector<std::pair<int, int64_t>>{
+    {0, 0}, {1, 1000}, {2, 2000}, {4, 2000}, {5, 2500}, {3, 3000}
+  };
+  EXPECT_EQ(fired, expected);
+}
+
+TEST(ManualLooper, RepeatedTasksAndRemoval) {
+  auto looper = ManualLooper();
+  auto tq = TaskQueue(looper.getLooper());
+
+  auto ticks = 0;
+  auto retries = 0;
+  tq.postRepeatedWithId(1, 1000000, 1000000, [&]{ ++ticks; });
+  // a retry that keeps backing off until it gives up
+  std::function<void(int64_t)> retry = [&](int64_t backoffUs){
+    if (++retries < 10) {
+      tq.postDelayed(backoffUs, [&, backoffUs]{ retry(backoffUs * 2); });
+    }
+  };
+  tq.post([&]{ retry(1000); });
+
+  // one virtual hour
+  looper.advanceBy(3600LL * 1000000);
+  EXPECT_EQ(ticks, 3600);
+  EXPECT_EQ(retries, 10);
+
+  tq.removePendingTasks(1);
+  looper.advanceBy(10000000);
+  EXPECT_EQ(ticks, 3600);
+}
+
+TEST(ManualLooper, RepeatPolicies) {
+  // every task ticks each 1000us from startUs + 1000, the third run stalls
+  // for 3500us, which misses the runs at +4000, +5000 and +6000
+  auto runTimes = [](int policy, uint32_t maxCatchUp) {
+    auto looper = ManualLooper();
+    auto tq = TaskQueue(looper.getLooper());
+    tq.setRepeatPolicy(policy, maxCatchUp);
+    auto startUs = looper.nowUs();
+    auto runs = std::vector<int64_t>{};
+    tq.postRepeated(1000, 1000, [&]{
+      runs.push_back(looper.nowUs() - startUs);
+      if (runs.size() == 3) {
+        looper.getClock()->advanceBy(3500);
+      }
+    });
+    looper.advanceBy(9000);
+    return runs;
+  };
+
+  using Runs = std::vector<int64_t>;
+  EXPECT_EQ(runTimes(Looper::REPEAT_FIXED_RATE, 0),
+            (Runs{1000, 2000, 3000, 6500, 6500, 6500, 7000, 8000, 9000}));
+  EXPECT_EQ(runTimes(Looper::REPEAT_CATCH_UP, 2),
+            (Runs{1000, 2000, 3000, 6500, 6500, 7000, 8000, 9000}));
+  EXPECT_EQ(runTimes(Looper::REPEAT_COALESCE_MISSED, 0),
+            (Runs{1000, 2000, 3000, 6500, 7000, 8000, 9000}));
+  EXPECT_EQ(runTimes(Looper::REPEAT_SKIP_MISSED, 0),
+            (Runs{1000, 2000, 3000, 7000, 8000, 9000}));
+  EXPECT_EQ(runTimes(Looper::REPEAT_FIXED_DELAY, 0),
+            (Runs{1000, 2000, 3000, 7500, 8500}));
+}
+
+TEST(ManualLooper, RunsPostsFromOtherThreads) {
+  auto looper = ManualLooper();
+  auto tq = TaskQueue(looper.getLooper());
+
+  auto ran = 0;
+  auto producer = std::thread([&]{
+    for (int i = 0; i < 1000; ++i) {
+      tq.post([&]{ ++ran; });
+    }
+    tq.postDelayed(1000, [&]{ ran += 1000; });
+  });
+  producer.join();
+
+  looper.runUntilIdle();
+  EXPECT_EQ(ran, 1000);
+  looper.advanceBy(1000);
+  EXPECT_EQ(ran, 2000);
+}
+
+TEST(ManualLooper, SimulatesManyTimersQuickly) {
+  constexpr int TIMER_COUNT = 1000000;
+  auto looper = ManualLooper();
+  looper.getLooper()->setBatchSize(64);
+  auto tq = TaskQueue(looper.getLooper());
+
+  auto fired = 0;
+  auto lastUs = int64_t{0};
+  auto inOrder = true;
+  auto batch = TaskQueue::PostBatch(tq);
+  for (int i = 0; i < TIMER_COUNT; ++i) {
+    // spread over a virtual day, out of order
+    auto delayUs = (i * 7919LL) % (86400LL * 1000000);
+    batch.postDelayed(delayUs, [&]{
+      inOrder = inOrder && looper.nowUs() >= lastUs;
+      lastUs = looper.nowUs();
+      ++fired;
+    });
+  }
+  tq.postBatch(batch);
+
+  auto start = std::chrono::steady_clock::now();
+  looper.advanceBy(86400LL * 1000000);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  EXPECT_EQ(fired, TIMER_COUNT);
+  EXPECT_TRUE(inOrder);
+  EXPECT_LT(elapsed, std::chrono::seconds(30));
+}
+
+TEST(ManualLooper, ClockMayStartAtZero) {
+  auto looper = ManualLooper("test", 0);
+  auto tq = TaskQueue(looper.getLooper());
+
+  // a timed task due at time 0 is still told apart from an immediate one
+  auto result = std::vector<int>{};
+  tq.postDelayedCoalesced(1, 0, Looper::COALESCE_KEEP_LAST,
+                          [&result]{ result.push_back(1); });
+  tq.postCoalesced(1, Looper::COALESCE_KEEP_LAST,
+                   [&result]{ result.push_back(2); });
+  tq.postDelayedCoalesced(1, 0, Looper::COALESCE_KEEP_LAST,
+                          [&result]{ result.push_back(3); });
+  looper.runUntilIdle();
+  EXPECT_EQ((std::vector<int>{2, 3}), result);
+}
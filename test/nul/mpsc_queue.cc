@@ -0,0 +1,69 @@
+#include <gtest/gtest.h>
+#include "nul/mpsc_queue.hpp"
+#include <vector>
+#include <thread>
+
+using namespace nul;
+
+namespace {
+  struct Item : public MpscNode {
+    int producer{0};
+    int seq{0};
+  };
+}
+
+TEST(MpscQueue, SingleThread) {
+  MpscQueue q;
+  ASSERT_TRUE(q.empty());
+  ASSERT_EQ(nullptr, q.pop());
+
+  Item items[3];
+  for (auto &item : items) {
+    q.push(&item);
+  }
+  ASSERT_FALSE(q.empty());
+  for (auto &item : items) {
+    ASSERT_EQ(&item, q.pop());
+  }
+  ASSERT_TRUE(q.empty());
+  ASSERT_EQ(nullptr, q.pop());
+
+  q.push(&items[1]);
+  ASSERT_EQ(&items[1], q.pop());
+  ASSERT_TRUE(q.empty());
+}
+
+TEST(MpscQueue, MultipleProducers) {
+  constexpr auto PRODUCERS = 4;
+  constexpr auto N = 100000;
+  auto items = std::vector<Item>(PRODUCERS * N);
+
+  MpscQueue q;
+  auto producers = std::vector<std::thread>{};
+  for (int p = 0; p < PRODUCERS; ++p) {
+    producers.emplace_back([&, p]{
+      for (int i = 0; i < N; ++i) {
+        auto &item = items[p * N + i];
+        item.producer = p;
+        item.seq = i;
+        q.push(&item);
+      }
+    });
+  }
+
+  // every producer's items come out in the order they were pushed
+  auto next = std::vector<int>(PRODUCERS, 0);
+  auto count = 0;
+  while (count < PRODUCERS * N) {
+    auto item = static_cast<Item *>(q.pop());
+    if (!item) {
+      continue;
+    }
+    ASSERT_EQ(next[item->producer]++, item->seq);
+    ++count;
+  }
+  for (auto &t : producers) {
+    t.join();
+  }
+  ASSERT_TRUE(q.empty());
+}
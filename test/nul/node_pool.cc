@@ -0,0 +1,116 @@
+#include <gtest/gtest.h>
+#include "nul/node_pool.hpp"
+#include "nul/closure.hpp"
+#include <vector>
+#include <thread>
+#include <memory>
+#include <set>
+
+using namespace nul;
+
+namespace {
+  struct Node {
+    Node(int value) : value(value) {}
+    int value;
+    char padding[40];
+  };
+}
+
+TEST(NodePool, Recycle) {
+  NodePool<Node> pool;
+  ASSERT_EQ(0, pool.capacity());
+
+  auto n1 = pool.acquire(1);
+  ASSERT_EQ(1, n1->value);
+  auto capacity = pool.capacity();
+  ASSERT_GT(capacity, 0);
+
+  pool.release(n1);
+  auto n2 = pool.acquire(2);
+  ASSERT_EQ(n1, n2);
+  ASSERT_EQ(2, n2->value);
+  pool.release(n2);
+
+  // acquiring more nodes than the first chunk holds grows the pool
+  auto nodes = std::vector<Node *>{};
+  for (int i = 0; i < 1000; ++i) {
+    nodes.push_back(pool.acquire(i));
+  }
+  ASSERT_EQ(1000, std::set<Node *>(nodes.begin(), nodes.end()).size());
+  capacity = pool.capacity();
+  ASSERT_GE(capacity, 1000);
+  for (auto n : nodes) {
+    pool.release(n);
+  }
+  for (int i = 0; i < 1000; ++i) {
+    nodes[i] = pool.acquire(i);
+  }
+  ASSERT_EQ(capacity, pool.capacity());
+  for (auto n : nodes) {
+    pool.release(n);
+  }
+}
+
+TEST(NodePool, ConcurrentAcquireRelease) {
+  constexpr auto THREADS = 4;
+  constexpr auto N = 200000;
+  NodePool<Node> pool;
+
+  auto threads = std::vector<std::thread>{};
+  for (int t = 0; t < THREADS; ++t) {
+    threads.emplace_back([&pool, t]{
+      Node *held[8] = {};
+      for (int i = 0; i < N; ++i) {
+        auto &slot = held[i % 8];
+        if (slot) {
+          // nobody else may have been handed this node in the meantime
+          ASSERT_EQ(t * N + i - 8, slot->value);
+          pool.release(slot);
+        }
+        slot = pool.acquire(t * N + i);
+      }
+      for (auto n : held) {
+        pool.release(n);
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+}
+
+TEST(Closure, InlineAndHeap) {
+  auto count = 0;
+  Closure small = [&count]{ ++count; };
+  small();
+  ASSERT_EQ(1, count);
+
+  char big[Closure::INLINE_SIZE * 2] = {1};
+  Closure large = [&count, big]{ count += big[0]; };
+  large();
+  ASSERT_EQ(2, count);
+
+  // moving leaves the source empty
+  Closure moved = std::move(large);
+  ASSERT_FALSE(large);
+  moved();
+  ASSERT_EQ(3, count);
+  moved = std::move(small);
+  moved();
+  ASSERT_EQ(4, count);
+}
+
+TEST(Closure, MoveOnlyCapture) {
+  auto value = std::make_shared<int>(42);
+  auto weak = std::weak_ptr<int>(value);
+  {
+    auto result = 0;
+    Closure c = [p = std::make_unique<std::shared_ptr<int>>(std::move(value)),
+                 &result]{ result = **p; };
+    auto c2 = std::move(c);
+    c2();
+    ASSERT_EQ(42, result);
+    ASSERT_FALSE(weak.expired());
+  }
+  ASSERT_TRUE(weak.expired());
+}
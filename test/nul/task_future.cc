@@ -0,0 +1,53 @@
+#include <gtest/gtest.h>
+#include "nul/task_future.hpp"
+#include <string>
+#include <memory>
+#include <thread>
+
+using namespace nul;
+
+TEST(TaskFuture, ValueAcrossThreads) {
+  auto promise = TaskPromise<std::string>();
+  auto future = promise.getFuture();
+  ASSERT_EQ(TaskFuture<std::string>::PENDING, future.waitFor(1000));
+
+  auto thread = std::thread([&promise]{
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    promise.setValue(std::string(100, 'x'));
+  });
+  ASSERT_EQ(std::string(100, 'x'), future.get());
+  ASSERT_FALSE(future.valid());
+  thread.join();
+}
+
+TEST(TaskFuture, BrokenPromise) {
+  auto future = TaskFuture<std::unique_ptr<int>>();
+  {
+    auto promise = TaskPromise<std::unique_ptr<int>>();
+    future = promise.getFuture();
+  }
+  ASSERT_FALSE(future.wait());
+  ASSERT_EQ(TaskFuture<std::unique_ptr<int>>::BROKEN, future.status());
+}
+
+TEST(TaskFuture, RunAndDropUntakenResult) {
+  auto value = std::make_shared<int>(1);
+  {
+    auto promise = TaskPromise<std::shared_ptr<int>>();
+    auto future = promise.getFuture();
+    auto fn = [value]{ return value; };
+    promise.run(fn);
+    ASSERT_EQ(TaskFuture<std::shared_ptr<int>>::READY, future.status());
+    ASSERT_EQ(3, value.use_count());
+  }
+  // the result is destroyed along with the state
+  ASSERT_EQ(1, value.use_count());
+
+  auto promise = TaskPromise<void>();
+  auto future = promise.getFuture();
+  auto ran = false;
+  auto fn = [&ran]{ ran = true; };
+  promise.run(fn);
+  ASSERT_TRUE(future.wait());
+  ASSERT_TRUE(ran);
+}
@@ -0,0 +1,223 @@
+#include <gtest/gtest.h>
+#include "nul/task_queue.hpp"
+#include <vector>
+#include <set>
+#include <future>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <utility>
+
+using namespace nul;
+
+namespace {
+
+// tasks that record how many of them run at once
+struct Concurrency {
+  std::atomic<int> running{0};
+  std::atomic<int> maxRunning{0};
+
+  void enter() {
+    auto now = ++running;
+    auto max = maxRunning.load();
+    while (now > max && !maxRunning.compare_exchange_weak(max, now)) {
+    }
+  }
+
+  void leave() {
+    --running;
+  }
+};
+
+int64_t nowMs() {
+  using namespace std::chrono;
+  return duration_cast<milliseconds>(
+    steady_clock::now().time_since_epoch()).count();
+}
+
+// a task repeats every 50ms, its third run stalls for 175ms, which misses
+// the runs at 200, 250 and 300ms. returns the start times of the runs
+// after the stall, from its end, up to the first one that is on schedule
+std::vector<int64_t> runsAfterStall(int policy, uint32_t maxCatchUp) {
+  auto runs = std::vector<int64_t>{};
+  auto stallEndMs = int64_t{0};
+  auto done = std::promise<void>();
+  auto finished = false;
+  auto tq = TaskQueue("repeat");
+  tq.start();
+  tq.setRepeatPolicy(policy, maxCatchUp);
+  auto count = 0;
+  tq.postAtInterval(50, 50, [&]{
+    if (finished) {
+      return;
+    }
+    if (++count == 3) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(175));
+      stallEndMs = nowMs();
+      return;
+    }
+    if (count > 3) {
+      runs.push_back(nowMs() - stallEndMs);
+      // the first run that is not right after the stall
+      if (runs.back() >= 10) {
+        finished = true;
+        done.set_value();
+      }
+    }
+  });
+  done.get_future().wait();
+  return runs;
+}
+
+// the runs right after the stall, and the gap before the first one that
+// is not
+std::pair<int, int64_t> backToBack(const std::vector<int64_t> &runs) {
+  return {static_cast<int>(runs.size()) - 1, runs.back()};
+}
+
+} /* end of anonymous namespace */
+
+TEST(TaskQueue, WorkerPoolRunsTasksInParallel) {
+  constexpr int WORKERS = 4;
+  // every task waits until all of them have started, which only happens
+  // if they run at the same time. the queue is declared last, so that its
+  // workers are gone before what they touch
+  auto mutex = std::mutex{};
+  auto cond = std::condition_variable{};
+  auto started = 0;
+  auto allStarted = std::promise<void>();
+  auto tq = TaskQueue("pool", true, WORKERS);
+  tq.start();
+  for (int i = 0; i < WORKERS; ++i) {
+    tq.post([&]{
+      auto lock = std::unique_lock<std::mutex>(mutex);
+      if (++started == WORKERS) {
+        allStarted.set_value();
+        cond.notify_all();
+      }
+      cond.wait_for(lock, std::chrono::seconds(5),
+                    [&]{ return started == WORKERS; });
+    });
+  }
+  ASSERT_EQ(std::future_status::ready,
+            allStarted.get_future().wait_for(std::chrono::seconds(5)));
+}
+
+TEST(TaskQueue, WorkerPoolHonorsWorkerCount) {
+  constexpr int WORKERS = 2;
+  auto concurrency = Concurrency{};
+  auto mutex = std::mutex{};
+  auto threads = std::set<std::thread::id>{};
+  auto done = std::promise<void>();
+  auto left = std::atomic<int>{WORKERS * 4};
+  auto tq = TaskQueue("pool", true, WORKERS);
+  tq.start();
+  for (int i = 0; i < WORKERS * 4; ++i) {
+    tq.post([&]{
+      concurrency.enter();
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        threads.insert(std::this_thread::get_id());
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      concurrency.leave();
+      if (--left == 0) {
+        done.set_value();
+      }
+    });
+  }
+  done.get_future().wait();
+
+  ASSERT_EQ(WORKERS, concurrency.maxRunning.load());
+  ASSERT_EQ(std::size_t{WORKERS}, threads.size());
+}
+
+TEST(TaskQueue, WorkerPoolRepeatedTaskNeverOverlaps) {
+  // each run takes longer than the interval
+  auto concurrency = Concurrency{};
+  auto runs = std::atomic<int>{0};
+  auto done = std::promise<void>();
+  auto tq = TaskQueue("pool", true, 4);
+  tq.start();
+  tq.postAtInterval("repeat", 0, 1, [&]{
+    concurrency.enter();
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    concurrency.leave();
+    if (++runs == 10) {
+      done.set_value();
+    }
+  });
+  done.get_future().wait();
+  tq.remove("repeat");
+
+  ASSERT_EQ(1, concurrency.maxRunning.load());
+}
+
+TEST(TaskQueue, WorkerPoolRunsPendingTasksOnDestruction) {
+  auto ran = std::atomic<int>{0};
+  auto gate = std::promise<void>();
+  auto gateFuture = gate.get_future().share();
+  {
+    auto tq = TaskQueue("pool", true, 1);
+    tq.start();
+    // the only worker is held while the others queue up behind it
+    tq.post([gateFuture, &ran]{
+      gateFuture.wait();
+      ++ran;
+    });
+    for (int i = 0; i < 10; ++i) {
+      tq.post([&ran]{ ++ran; });
+    }
+    gate.set_value();
+  }
+  ASSERT_EQ(11, ran.load());
+}
+
+TEST(TaskQueue, RepeatPolicies) {
+  // the next tick after the stall is 25ms after its end, a fixed delay
+  // task runs 50ms after it
+  auto fixedRate = backToBack(runsAfterStall(TaskQueue::REPEAT_FIXED_RATE, 0));
+  EXPECT_EQ(3, fixedRate.first);
+
+  auto catchUp = backToBack(runsAfterStall(TaskQueue::REPEAT_CATCH_UP, 2));
+  EXPECT_EQ(2, catchUp.first);
+
+  auto coalesce =
+    backToBack(runsAfterStall(TaskQueue::REPEAT_COALESCE_MISSED, 0));
+  EXPECT_EQ(1, coalesce.first);
+
+  auto skip = backToBack(runsAfterStall(TaskQueue::REPEAT_SKIP_MISSED, 0));
+  EXPECT_EQ(0, skip.first);
+  EXPECT_LT(skip.second, 40);
+
+  auto fixedDelay =
+    backToBack(runsAfterStall(TaskQueue::REPEAT_FIXED_DELAY, 0));
+  EXPECT_EQ(0, fixedDelay.first);
+  EXPECT_GE(fixedDelay.second, 40);
+}
+
+TEST(TaskQueue, RemoveRepeatedTaskWhileItRuns) {
+  for (auto useWorkerPool : {false, true}) {
+    auto runs = std::atomic<int>{0};
+    auto started = std::promise<void>();
+    auto gate = std::promise<void>();
+    auto gateFuture = gate.get_future().share();
+    auto tq = TaskQueue("repeat", useWorkerPool, 2);
+    tq.start();
+    tq.postAtInterval("repeat", 0, 5, [&, gateFuture]{
+      if (++runs == 1) {
+        started.set_value();
+        gateFuture.wait();
+      }
+    });
+    started.get_future().wait();
+    tq.remove("repeat");
+    gate.set_value();
+
+    // a run that is queued again would be due by now
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_EQ(1, runs.load()) << "useWorkerPool: " << useWorkerPool;
+  }
+}
@@ -0,0 +1,118 @@
+#include <gtest/gtest.h>
+#include "nul/timer_wheel.hpp"
+#include <vector>
+#include <random>
+#include <algorithm>
+
+using namespace nul;
+
+namespace {
+  struct Timer : public TimerNode {
+    int id{0};
+  };
+
+  std::vector<int> drain(TimerWheel &wheel, int64_t nowUs, int64_t stepUs) {
+    auto ids = std::vector<int>{};
+    while (!wheel.empty()) {
+      auto node = wheel.popExpired(nowUs);
+      if (node) {
+        EXPECT_LE(node->triggerTimeUs, nowUs);
+        ids.push_back(static_cast<Timer *>(node)->id);
+        continue;
+      }
+      auto next = wheel.nextTimeUs();
+      EXPECT_GT(next, nowUs);
+      nowUs = std::min(next, nowUs + stepUs);
+    }
+    return ids;
+  }
+}
+
+TEST(TimerWheel, FiresInTriggerTimeOrder) {
+  std::mt19937_64 rng(42);
+  constexpr auto N = 20000;
+  auto timers = std::vector<Timer>(N);
+
+  TimerWheel wheel;
+  wheel.advance(0);
+  for (int i = 0; i < N; ++i) {
+    timers[i].id = i;
+    // mix near and far timers, with plenty of equal trigger times
+    timers[i].triggerTimeUs = (i % 3 == 0) ?
+      static_cast<int64_t>(rng() % 100) * 1000 :
+      static_cast<int64_t>(rng() % 5000000000ull);
+    wheel.add(&timers[i]);
+  }
+  ASSERT_EQ(N, wheel.size());
+
+  auto expected = std::vector<int>(N);
+  for (int i = 0; i < N; ++i) {
+    expected[i] = i;
+  }
+  std::stable_sort(expected.begin(), expected.end(), [&](int a, int b){
+    return timers[a].triggerTimeUs < timers[b].triggerTimeUs;
+  });
+
+  ASSERT_EQ(expected, drain(wheel, 0, 1000000000));
+}
+
+TEST(TimerWheel, AddWhileAdvancing) {
+  TimerWheel wheel;
+  Timer t1, t2, t3;
+  t1.id = 1; t1.triggerTimeUs = 5000;
+  t2.id = 2; t2.triggerTimeUs = 5000;
+  t3.id = 3; t3.triggerTimeUs = 100;
+
+  wheel.advance(0);
+  wheel.add(&t1);
+  ASSERT_EQ(nullptr, wheel.popExpired(4999));
+
+  // t3 is already overdue when it is added
+  wheel.add(&t2);
+  wheel.add(&t3);
+  ASSERT_EQ(&t3, wheel.popExpired(5000));
+  ASSERT_EQ(&t1, wheel.popExpired(5000));
+  ASSERT_EQ(&t2, wheel.popExpired(5000));
+  ASSERT_TRUE(wheel.empty());
+  ASSERT_EQ(-1, wheel.nextTimeUs());
+}
+
+TEST(TimerWheel, Remove) {
+  TimerWheel wheel;
+  wheel.advance(0);
+  auto timers = std::vector<Timer>(100);
+  for (int i = 0; i < 100; ++i) {
+    timers[i].id = i;
+    timers[i].triggerTimeUs = int64_t{1} << (i % 40);
+    wheel.add(&timers[i]);
+  }
+
+  wheel.forEach([&](TimerNode *node){
+    if (static_cast<Timer *>(node)->id % 2 == 0) {
+      wheel.remove(node);
+    }
+  });
+  ASSERT_EQ(50, wheel.size());
+  ASSERT_FALSE(wheel.contains(&timers[0]));
+  ASSERT_TRUE(wheel.contains(&timers[1]));
+
+  auto ids = drain(wheel, 0, int64_t{1} << 40);
+  ASSERT_EQ(50, ids.size());
+  for (auto id : ids) {
+    ASSERT_EQ(1, id % 2);
+  }
+}
+
+TEST(TimerWheel, FarAwayTimer) {
+  TimerWheel wheel;
+  wheel.advance(0);
+  Timer far, near;
+  far.triggerTimeUs = int64_t{1} << 50;  // beyond the range of the wheel
+  near.triggerTimeUs = 1;
+  wheel.add(&far);
+  wheel.add(&near);
+
+  ASSERT_EQ(&near, wheel.popExpired(1));
+  ASSERT_EQ(nullptr, wheel.popExpired((int64_t{1} << 50) - 1));
+  ASSERT_EQ(&far, wheel.popExpired(int64_t{1} << 50));
+}
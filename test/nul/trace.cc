@@ -0,0 +1,53 @@
+#include <gtest/gtest.h>
+#include "nul/looper.hpp"
+#include <future>
+#include <string>
+
+using namespace nul;
+
+namespace {
+
+std::size_t countOf(const std::string &str, const std::string &part) {
+  auto count = std::size_t{0};
+  for (auto pos = str.find(part); pos != std::string::npos;
+       pos = str.find(part, pos + 1)) {
+    ++count;
+  }
+  return count;
+}
+
+} /* end of anonymous namespace */
+
+TEST(Tracer, RecordsTasksWithPostSites) {
+  auto looper = Looper::create("traced");
+  looper->start();
+  auto tq = TaskQueue(looper);
+  tq.postSync([]{});  // the looper waits from here on
+
+  Tracer::start();
+  auto done = std::promise<void>();
+  auto line = __LINE__; tq.post(7, []{});
+  tq.postDelayed(5000, [&done]{ done.set_value(); });
+  tq.post([](int){}, 1);  // bound arguments, no site
+  done.get_future().wait();
+  Tracer::stop();
+  tq.postSync([]{});  // the last task has been recorded, this post is not
+
+  auto json = Tracer::dump();
+  auto site = std::string(__FILE__) + ":" + std::to_string(line);
+  ASSERT_EQ(0, json.find("{\"traceEvents\":["));
+  ASSERT_NE(std::string::npos, json.find("\"name\":\"traced\""));
+  ASSERT_NE(std::string::npos, json.find("{\"name\":\"" + site + "\""));
+  ASSERT_NE(std::string::npos, json.find("\"identity\":7"));
+  ASSERT_EQ(3, countOf(json, "{\"name\":\"post\""));
+  // a flow from each post to the run of its task
+  ASSERT_EQ(3, countOf(json, "\"ph\":\"s\""));
+  ASSERT_EQ(3, countOf(json, "\"ph\":\"f\""));
+  ASSERT_EQ(1, countOf(json, "{\"name\":\"timer\""));
+  ASSERT_LE(1, countOf(json, "{\"name\":\"wait\""));
+
+  // a new session starts empty
+  Tracer::start();
+  Tracer::stop();
+  ASSERT_EQ(0, countOf(Tracer::dump(), "{\"name\":\"post\""));
+}